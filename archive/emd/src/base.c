@@ -21,6 +21,8 @@
 #include <semaphore.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /******************************************************************************
  * prayers to the POSIX gods                                                  *
@@ -486,6 +488,241 @@ vec_type *vec_name##_vec_getp(const struct vec_name##_vec *da, size_t i) { \
 IMPLEMENT_VEC(size_t, size)
 IMPLEMENT_VEC(uint64_t, uint64)
 
+// splitmix64 finalizer, spreads sequential ids over the whole 64 bits
+uint64_t uint64_hash(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111eb;
+  x ^= x >> 31;
+  return x;
+}
+
+// Open addressing hash set of integer keys with linear probing. `cap` is
+// always a power of two. A slot holding 0 is empty, the key 0 itself is
+// tracked by `has_zero`.
+#define IMPLEMENT_SET(set_type, set_name) \
+struct set_name##_set { \
+  set_type *buf; \
+  size_t len; \
+  size_t cap; \
+  bool has_zero; \
+}; \
+ \
+/* NOTE: a set_create call is not necessary, a zeroed set will */ \
+/* initialize itself at the first call to set_insert */ \
+err_t set_name##_set_create(struct set_name##_set *set, size_t cap) { \
+  assert(set != NULL); \
+  size_t pow2 = 16; \
+  while (pow2 < cap) pow2 *= 2; \
+  set_type *buf = calloc(pow2, sizeof(set_type)); \
+  if (buf == NULL) { \
+    errmsg_fmt("calloc error: %s", strerror(errno)); \
+    return E_ERR; \
+  } \
+  *set = (struct set_name##_set) { .buf = buf, .len = 0, .cap = pow2 }; \
+  return E_OK; \
+} \
+ \
+void set_name##_set_destroy(struct set_name##_set *set) { \
+  assert(set != NULL); \
+  free(set->buf); \
+  set->buf = NULL; \
+  set->len = 0; \
+  set->cap = 0; \
+  set->has_zero = false; \
+} \
+ \
+void set_name##_set_clear(struct set_name##_set *set) { \
+  assert(set != NULL); \
+  if (set->buf != NULL) memset(set->buf, 0, set->cap * sizeof(set_type)); \
+  set->len = 0; \
+  set->has_zero = false; \
+} \
+ \
+/* index of the slot holding `x` or of the empty slot where it would go */ \
+size_t set_name##_set_slot(const struct set_name##_set *set, set_type x) { \
+  size_t mask = set->cap - 1; \
+  size_t i = uint64_hash((uint64_t) x) & mask; \
+  while (set->buf[i] != 0 && set->buf[i] != x) { \
+    i = (i + 1) & mask; \
+  } \
+  return i; \
+} \
+ \
+bool set_name##_set_contains(const struct set_name##_set *set, set_type x) { \
+  assert(set != NULL); \
+  if (x == 0) return set->has_zero; \
+  if (set->buf == NULL) return false; \
+  return set->buf[set_name##_set_slot(set, x)] == x; \
+} \
+ \
+err_t set_name##_set_grow(struct set_name##_set *set) { \
+  struct set_name##_set grown; \
+  err_t err = set_name##_set_create(&grown, set->cap * 2); \
+  if (err != E_OK) return E_ERR; \
+  for (size_t i = 0; i < set->cap; ++i) { \
+    if (set->buf[i] != 0) grown.buf[set_name##_set_slot(&grown, set->buf[i])] = set->buf[i]; \
+  } \
+  grown.len = set->len; \
+  grown.has_zero = set->has_zero; \
+  free(set->buf); \
+  *set = grown; \
+  return E_OK; \
+} \
+ \
+/* `inserted` (optional) is set to false if `x` was already in the set */ \
+err_t set_name##_set_insert(struct set_name##_set *set, set_type x, bool *inserted) { \
+  assert(set != NULL); \
+  if (x == 0) { \
+    if (inserted != NULL) *inserted = !set->has_zero; \
+    if (!set->has_zero) set->len += 1; \
+    set->has_zero = true; \
+    return E_OK; \
+  } \
+  if (set->buf == NULL) { \
+    bool has_zero = set->has_zero; \
+    size_t len = set->len; \
+    if (set_name##_set_create(set, set->cap) != E_OK) return E_ERR; \
+    set->has_zero = has_zero; \
+    set->len = len; \
+  } else if (4 * (set->len + 1) > 3 * set->cap) { \
+    if (set_name##_set_grow(set) != E_OK) return E_ERR; \
+  } \
+  size_t i = set_name##_set_slot(set, x); \
+  if (inserted != NULL) *inserted = set->buf[i] == 0; \
+  if (set->buf[i] == 0) { \
+    set->buf[i] = x; \
+    set->len += 1; \
+  } \
+  return E_OK; \
+}
+
+IMPLEMENT_SET(uint64_t, uint64)
+
+// Open addressing hash map of integer keys, same layout as IMPLEMENT_SET with
+// the values stored next to the keys. The value of the key 0 is `zero_val`.
+#define IMPLEMENT_MAP(key_type, val_type, map_name) \
+struct map_name##_map { \
+  key_type *keys; \
+  val_type *vals; \
+  size_t len; \
+  size_t cap; \
+  bool has_zero; \
+  val_type zero_val; \
+}; \
+ \
+/* NOTE: a map_create call is not necessary, a zeroed map will */ \
+/* initialize itself at the first call to map_put */ \
+err_t map_name##_map_create(struct map_name##_map *map, size_t cap) { \
+  assert(map != NULL); \
+  size_t pow2 = 16; \
+  while (pow2 < cap) pow2 *= 2; \
+  key_type *keys = calloc(pow2, sizeof(key_type)); \
+  val_type *vals = malloc(pow2 * sizeof(val_type)); \
+  if (keys == NULL || vals == NULL) { \
+    free(keys); \
+    free(vals); \
+    errmsg_fmt("calloc/malloc error: %s", strerror(errno)); \
+    return E_ERR; \
+  } \
+  *map = (struct map_name##_map) { .keys = keys, .vals = vals, .len = 0, .cap = pow2 }; \
+  return E_OK; \
+} \
+ \
+void map_name##_map_destroy(struct map_name##_map *map) { \
+  assert(map != NULL); \
+  free(map->keys); \
+  free(map->vals); \
+  map->keys = NULL; \
+  map->vals = NULL; \
+  map->len = 0; \
+  map->cap = 0; \
+  map->has_zero = false; \
+} \
+ \
+void map_name##_map_clear(struct map_name##_map *map) { \
+  assert(map != NULL); \
+  if (map->keys != NULL) memset(map->keys, 0, map->cap * sizeof(key_type)); \
+  map->len = 0; \
+  map->has_zero = false; \
+} \
+ \
+/* index of the slot holding `key` or of the empty slot where it would go */ \
+size_t map_name##_map_slot(const struct map_name##_map *map, key_type key) { \
+  size_t mask = map->cap - 1; \
+  size_t i = uint64_hash((uint64_t) key) & mask; \
+  while (map->keys[i] != 0 && map->keys[i] != key) { \
+    i = (i + 1) & mask; \
+  } \
+  return i; \
+} \
+ \
+/* E_NOT_FOUND if `key` is not in the map, `val` can be NULL */ \
+err_t map_name##_map_get(const struct map_name##_map *map, key_type key, val_type *val) { \
+  assert(map != NULL); \
+  if (key == 0) { \
+    if (!map->has_zero) return E_NOT_FOUND; \
+    if (val != NULL) *val = map->zero_val; \
+    return E_OK; \
+  } \
+  if (map->keys == NULL) return E_NOT_FOUND; \
+  size_t i = map_name##_map_slot(map, key); \
+  if (map->keys[i] != key) return E_NOT_FOUND; \
+  if (val != NULL) *val = map->vals[i]; \
+  return E_OK; \
+} \
+ \
+err_t map_name##_map_grow(struct map_name##_map *map) { \
+  struct map_name##_map grown; \
+  err_t err = map_name##_map_create(&grown, map->cap * 2); \
+  if (err != E_OK) return E_ERR; \
+  for (size_t i = 0; i < map->cap; ++i) { \
+    if (map->keys[i] == 0) continue; \
+    size_t slot = map_name##_map_slot(&grown, map->keys[i]); \
+    grown.keys[slot] = map->keys[i]; \
+    grown.vals[slot] = map->vals[i]; \
+  } \
+  grown.len = map->len; \
+  grown.has_zero = map->has_zero; \
+  grown.zero_val = map->zero_val; \
+  free(map->keys); \
+  free(map->vals); \
+  *map = grown; \
+  return E_OK; \
+} \
+ \
+/* insert or overwrite the value of `key` */ \
+err_t map_name##_map_put(struct map_name##_map *map, key_type key, val_type val) { \
+  assert(map != NULL); \
+  if (key == 0) { \
+    if (!map->has_zero) map->len += 1; \
+    map->has_zero = true; \
+    map->zero_val = val; \
+    return E_OK; \
+  } \
+  if (map->keys == NULL) { \
+    struct map_name##_map created; \
+    if (map_name##_map_create(&created, map->cap) != E_OK) return E_ERR; \
+    created.len = map->len; \
+    created.has_zero = map->has_zero; \
+    created.zero_val = map->zero_val; \
+    *map = created; \
+  } else if (4 * (map->len + 1) > 3 * map->cap) { \
+    if (map_name##_map_grow(map) != E_OK) return E_ERR; \
+  } \
+  size_t i = map_name##_map_slot(map, key); \
+  if (map->keys[i] == 0) { \
+    map->keys[i] = key; \
+    map->len += 1; \
+  } \
+  map->vals[i] = val; \
+  return E_OK; \
+}
+
+IMPLEMENT_MAP(uint64_t, size_t, uint64_size)
+IMPLEMENT_MAP(uint64_t, int64_t, uint64_int64)
+
 /******************************************************************************
  * string pool                                                                *
  ******************************************************************************/
@@ -773,6 +1010,7 @@ err_t ptr_fifo_push(struct ptr_fifo *fifo, void *ptr, time_t timeout_sec) {
 
 // ownership of buf is taken from fifo
 // if timeout_sec == 0, ptr_fifo_pop will not timeout
+// returns E_EMPTY if the fifo is still empty after timeout_sec
 err_t ptr_fifo_pop(struct ptr_fifo *fifo, void **ptr, time_t timeout_sec) {
   assert(fifo != NULL);
   assert(fifo->unsafe.ptrs != NULL);
@@ -792,7 +1030,10 @@ err_t ptr_fifo_pop(struct ptr_fifo *fifo, void **ptr, time_t timeout_sec) {
 #else
   rv = sem_wait(fifo->pop);
 #endif
-  if (rv != 0) {
+  if (rv != 0 && errno == ETIMEDOUT) {
+    errmsg_fmt("sem_timedwait: %s", strerror(errno));
+    return E_EMPTY;
+  } else if (rv != 0) {
     errmsg_fmt("sem_timedwait/wait: %s", strerror(errno));
     return E_ERR;
   }
@@ -813,7 +1054,7 @@ err_t ptr_fifo_try_pop(struct ptr_fifo *fifo, void **ptr) {
   assert(ptr != NULL);
 
   int rv = sem_trywait(fifo->pop);
-  if (errno == EAGAIN) {
+  if (rv != 0 && errno == EAGAIN) {
     return E_EMPTY;
   } else if (rv != 0) {
     errmsg_fmt("sem_trywait: %s", strerror(errno));
@@ -862,6 +1103,77 @@ err_t time_parse(const char *format, const char *str, time_t *time) {
   return E_OK;
 }
 
+// Days from 1970-01-01 to the gregorian date `year`-`month`-`day`, month and
+// day start at 1
+int64_t time_days_from_civil(int64_t year, int64_t month, int64_t day) {
+  // shift the year start to march so that the leap day is the last one
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t year_of_era = year - era * 400;
+  int64_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+bool time_is_leap_year(uint32_t year) {
+  return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+// Parse the `n` digits at `s`, sets `*bad` if one of them is not a digit
+uint32_t time_parse_digits(const char *s, size_t n, uint32_t *bad) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t digit = (uint32_t) (unsigned char) s[i] - '0';
+    *bad |= digit > 9;
+    value = value * 10 + digit;
+  }
+  return value;
+}
+
+// Parse the `%Y-%m-%d` date at the start of `s` into days since epoch, `s`
+// must have at least 10 characters
+err_t time_parse_ymd(const char *s, int64_t *days) {
+  const uint8_t MONTH_DAYS[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+  uint32_t bad = (s[4] != '-') | (s[7] != '-');
+  uint32_t year = time_parse_digits(s, 4, &bad);
+  uint32_t month = time_parse_digits(s + 5, 2, &bad);
+  uint32_t day = time_parse_digits(s + 8, 2, &bad);
+  if (bad || month < 1 || month > 12 || day < 1 || day > MONTH_DAYS[month - 1] ||
+      (month == 2 && day == 29 && !time_is_leap_year(year))) {
+    errmsg_fmt("invalid date %.10s", s);
+    return E_ERR;
+  }
+  *days = time_days_from_civil(year, month, day);
+  return E_OK;
+}
+
+// Parse a `%Y-%m-%dT%H:%M:%SZ` utc time, as esi formats them. Unlike
+// time_parse, does not depend on the timezone.
+err_t time_parse_iso(struct string str, time_t *time) {
+  assert(str.buf != NULL);
+  assert(time != NULL);
+  const size_t ISO_LEN = sizeof("2024-11-23T11:15:00Z") - 1;
+  if (str.len != ISO_LEN) {
+    errmsg_fmt("invalid time %.*s", (int) str.len, str.buf);
+    return E_ERR;
+  }
+  int64_t days;
+  err_t err = time_parse_ymd(str.buf, &days);
+  if (err != E_OK) return E_ERR;
+
+  const char *s = str.buf;
+  uint32_t bad = (s[10] != 'T') | (s[13] != ':') | (s[16] != ':') | (s[19] != 'Z');
+  uint32_t hour = time_parse_digits(s + 11, 2, &bad);
+  uint32_t min = time_parse_digits(s + 14, 2, &bad);
+  uint32_t sec = time_parse_digits(s + 17, 2, &bad);
+  if (bad || hour > 23 || min > 59 || sec > 60) {  // 60 for leap seconds, like strptime
+    errmsg_fmt("invalid time %.*s", (int) str.len, str.buf);
+    return E_ERR;
+  }
+  *time = days * TIME_DAY + hour * TIME_HOUR + min * TIME_MINUTE + sec;
+  return E_OK;
+}
+
 time_t time_eleven_fifteen_today(time_t now) {
   struct tm tm;
   struct tm *rv = gmtime_r(&now, &tm);
@@ -888,27 +1200,22 @@ struct date {
   uint16_t day;
 };
 
-// return iso 8601 ordinal date
-err_t date_parse(const char *format, const char *str, struct date *date) {
-  assert(format != NULL);
-  assert(str != NULL);
+// Parse a `%Y-%m-%d` date into an iso 8601 ordinal date, the first day of
+// the year is 0
+err_t date_parse(struct string str, struct date *date) {
+  assert(str.buf != NULL);
   assert(date != NULL);
-  struct tm tm = {0};
-  char *endptr = strptime(str, format, &tm);
-  if (endptr == NULL || *endptr != '\0') {
-    errmsg_fmt("strptime: invalid date format");
+  if (str.len != sizeof("2024-11-23") - 1) {
+    errmsg_fmt("invalid date %.*s", (int) str.len, str.buf);
     return E_ERR;
   }
-  if (tm.tm_year < 0 || tm.tm_year > UINT16_MAX - 1900) {
-    errmsg_fmt("strptime: year %d out of range", tm.tm_year);
-    return E_ERR;
-  }
-  if (tm.tm_yday < 0 || tm.tm_yday > UINT16_MAX) {
-    errmsg_fmt("strptime: day %d out of range", tm.tm_yday);
-    return E_ERR;
-  }
-  date->year = tm.tm_year + 1900;
-  date->day = tm.tm_yday;
+  int64_t days;
+  err_t err = time_parse_ymd(str.buf, &days);
+  if (err != E_OK) return E_ERR;
+  uint32_t bad = 0;
+  uint32_t year = time_parse_digits(str.buf, 4, &bad);
+  date->year = year;
+  date->day = days - time_days_from_civil(year, 1, 1);
   return E_OK;
 }
 
@@ -930,17 +1237,39 @@ bool date_is_leap_year(uint16_t year) {
   return year % 400 == 0 || (year % 4 == 0 && year % 100 != 0);
 }
 
+// days are counted from 0, as date_parse does
 void date_incr(struct date *date) {
   assert(date != NULL);
   uint64_t day_in_year = date_is_leap_year(date->year) ? 366 : 365;
-  if (date->day >= day_in_year) {
-    date->day = 1;
+  if (date->day + 1 >= day_in_year) {
+    date->day = 0;
     date->year += 1;
   } else {
     date->day += 1;
   }
 }
 
+// days since 1970-01-01
+int64_t date_to_days(struct date date) {
+  return time_days_from_civil(date.year, 1, 1) + date.day;
+}
+
+struct date date_from_days(int64_t days) {
+  assert(days >= 0);
+  struct date date = { .year = 1970 };
+  while (true) {
+    int64_t day_in_year = date_is_leap_year(date.year) ? 366 : 365;
+    int64_t year_start = time_days_from_civil(date.year, 1, 1);
+    if (days < year_start + day_in_year) {
+      date.day = days - year_start;
+      return date;
+    }
+    // jump close to the year first
+    int64_t years = (days - year_start) / 366;
+    date.year += years > 0 ? years : 1;
+  }
+}
+
 struct date date_utc(time_t time) {
   struct tm tm = {0};
   struct tm *res = gmtime_r(&time, &tm);
@@ -949,7 +1278,7 @@ struct date date_utc(time_t time) {
   }
   return (struct date) {
     .year = tm.tm_year + 1900,
-    .day = tm.tm_yday + 1,  // POSIX api is so weird
+    .day = tm.tm_yday,  // counted from 0, as date_parse does
   };
 }
 
@@ -1035,6 +1364,9 @@ err_t serialize_string(FILE *stream, struct string s) {
     errmsg_prefix("serialize_uint64: ");
     return E_ERR;
   }
+  if (s.len == 0) {
+    return E_OK;  // fwrite of 0 bytes writes 0 items
+  }
   size_t count = fwrite(s.buf, s.len, 1, stream);
   if (count < 1) {
     errmsg_fmt("serialize_string: write: %s", strerror(errno));
@@ -1058,3 +1390,14 @@ err_t asgs_prase_bool(bool *out, const char *in) {
   }
   return E_ERR;
 }
+
+err_t asgs_prase_uint(size_t *out, const char *in) {
+  assert(out != NULL);
+  if (!isdigit((unsigned char) in[0])) return E_ERR;
+  char *endptr;
+  errno = 0;
+  unsigned long long n = strtoull(in, &endptr, 10);
+  if (*endptr != '\0' || errno != 0 || n > SIZE_MAX) return E_ERR;
+  *out = (size_t) n;
+  return E_OK;
+}
@@ -1,13 +1,16 @@
 
 #define DUMP_PATH_LEN_MAX 4096
 
-const uint8_t DUMP_VERSION       = 1;
+// version 2: order tables are in the compact encoding, see dump_write_order_table
+const uint8_t DUMP_VERSION       = 2;
 const char    DUMP_ASCII_ART[32] = "இ}ڿڰۣ-ڰۣ~—";
 
-const uint8_t DUMP_TYPE_LOCATIONS = 0;
-const uint8_t DUMP_TYPE_ORDERS    = 1;
-const uint8_t DUMP_TYPE_HISTORIES = 2;
-const uint8_t DUMP_TYPE_INTERNAL  = 3;
+const uint8_t DUMP_TYPE_LOCATIONS    = 0;
+const uint8_t DUMP_TYPE_ORDERS       = 1;
+const uint8_t DUMP_TYPE_HISTORIES    = 2;
+const uint8_t DUMP_TYPE_INTERNAL     = 3;
+const uint8_t DUMP_TYPE_ORDERS_DELTA = 4;
+const uint8_t DUMP_TYPE_SUMMARIES    = 5;
 
 struct dump_record_entry {
   FILE *fp;
@@ -86,6 +89,7 @@ struct dump {
   FILE *file;
   uint32_t checksum;
   enum dump_mode mode;
+  uint8_t version;
 };
 
 // `expiration` is expiration date of said data
@@ -146,6 +150,7 @@ err_t dump_open_write(struct dump *dump, struct string path, uint8_t type,
   dump->file = file;
   dump->checksum = 0;
   dump->mode = DUMP_WRITE;
+  dump->version = DUMP_VERSION;
   return E_OK;
 }
 
@@ -193,17 +198,30 @@ err_t dump_open_read(struct dump *dump, struct string path) {
     return E_ERR;
   }
 
+  int version = fgetc(file);
+  if (version == EOF) {
+    errmsg_fmt("fgetc: no dump version");
+    fclose(file);
+    return E_ERR;
+  }
+  if (version < 1 || version > DUMP_VERSION) {
+    errmsg_fmt("unsupported dump version %d", version);
+    fclose(file);
+    return E_ERR;
+  }
+
   int rv = fseek(file, 46, SEEK_SET);  // seek the begin of the body
   if (rv != 0) {
     errmsg_fmt("fseek: %s", strerror(errno));
-    fclose(dump->file);
+    fclose(file);
     return E_ERR;
   }
 
-  // NOTE: here, I didn't checked the dump version nor checksum
+  // NOTE: here, I didn't checked the checksum
   dump->file = file;
   dump->checksum = 0;
   dump->mode = DUMP_READ;
+  dump->version = version;
   return E_OK;
 }
 
@@ -232,6 +250,45 @@ err_t dump_seek_start(struct dump *dump) {
   return E_OK;
 }
 
+// A dump without header nor checksum held in memory, to encode or decode a
+// part of a file. The buffer of a written dump is allocated, see
+// open_memstream, and is only complete once the dump is closed.
+err_t dump_open_memory_write(struct dump *dump, char **buf, size_t *len) {
+  assert(dump != NULL);
+  FILE *file = open_memstream(buf, len);
+  if (file == NULL) {
+    errmsg_fmt("open_memstream: %s", strerror(errno));
+    return E_ERR;
+  }
+  *dump = (struct dump) { .file = file, .mode = DUMP_WRITE, .version = DUMP_VERSION };
+  return E_OK;
+}
+
+// WARN: `buf` must outlive the dump
+err_t dump_open_memory_read(struct dump *dump, const char *buf, size_t len) {
+  assert(dump != NULL);
+  assert(len > 0);
+  FILE *file = fmemopen((void *) buf, len, "r");
+  if (file == NULL) {
+    errmsg_fmt("fmemopen: %s", strerror(errno));
+    return E_ERR;
+  }
+  *dump = (struct dump) { .file = file, .mode = DUMP_READ, .version = DUMP_VERSION };
+  return E_OK;
+}
+
+err_t dump_close_memory(struct dump *dump) {
+  assert(dump != NULL);
+  assert(dump->file != NULL);
+  int rv = fclose(dump->file);
+  dump->file = NULL;
+  if (rv != 0) {
+    errmsg_fmt("fclose: %s", strerror(errno));
+    return E_ERR;
+  }
+  return E_OK;
+}
+
 bool dump_does_exist(struct string path) {
   char *path_nt = NULL;
   err_t err = string_alloc_null_terminated_cpy(&path_nt, path);
@@ -328,6 +385,29 @@ err_t dump_write_float64(struct dump *dump, double x) {
   return dump_write_uint64(dump, n);
 }
 
+// LEB128, 7 bits per byte, least significant group first
+err_t dump_write_varint(struct dump *dump, uint64_t n) {
+  unsigned char bytes[10];
+  size_t len = 0;
+  do {
+    bytes[len] = n & 0x7f;
+    n >>= 7;
+    if (n != 0) bytes[len] |= 0x80;
+    len += 1;
+  } while (n != 0);
+  err_t err = dump_write(dump, bytes, len);
+  if (err != E_OK) {
+    errmsg_prefix("dump_write: ");
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+// small negative numbers are mapped to small varints: 0, -1, 1, -2 -> 0, 1, 2, 3
+err_t dump_write_zigzag(struct dump *dump, int64_t n) {
+  return dump_write_varint(dump, ((uint64_t) n << 1) ^ (uint64_t) (n >> 63));
+}
+
 err_t dump_write_string(struct dump *dump, struct string s) {
   err_t err = dump_write_uint64(dump, s.len);
   if (err != E_OK) {
@@ -447,6 +527,29 @@ err_t dump_read_float64(struct dump *dump, double *x) {
   return E_OK;
 }
 
+err_t dump_read_varint(struct dump *dump, uint64_t *n) {
+  assert(n != NULL);
+  *n = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    uint8_t byte;
+    err_t err = dump_read_uint8(dump, &byte);
+    if (err != E_OK) return err;
+    *n |= (uint64_t) (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) return E_OK;
+  }
+  errmsg_fmt("varint longer than 10 bytes");
+  return E_ERR;
+}
+
+err_t dump_read_zigzag(struct dump *dump, int64_t *n) {
+  assert(n != NULL);
+  uint64_t u;
+  err_t err = dump_read_varint(dump, &u);
+  if (err != E_OK) return err;
+  *n = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+  return E_OK;
+}
+
 err_t dump_read_date(struct dump *dump, struct date *date) {
   assert(date != NULL);
   err_t res;
@@ -3,29 +3,391 @@ const err_t E_ESI_BASE = 1000;
 
 const struct string ESI_ROOT = STRING_NEW("https://esi.evetech.net/latest");
 const uint64_t      ESI_REQUEST_TIMEOUT = 7;
-const char         *ESI_DATE = "%Y-%m-%d";
-const char         *ESI_TIME = "%Y-%m-%dT%H:%M:%SZ";
 const char         *ESI_HEADER_TIME = "%a, %d %b %Y %H:%M:%S GMT";
 
 // NOTE: this handle is never cleaned up but its not a big deal
 __thread CURL *esi_curl_thread_handle = NULL;
 
-#define  SSO_ACCESS_TOKEN_LEN_MAX 4096
-char     sso_access_token[SSO_ACCESS_TOKEN_LEN_MAX];
-uint64_t sso_access_token_expiry = 0;
-mutex_t  sso_access_token_mu = MUTEX_INIT;
+// Every esi handle of the process is attached to `esi_share` so that DNS
+// results and TLS sessions are shared between the hoardlings threads instead
+// of being negotiated once per thread. Connections are not shared, libcurl
+// does not support a connection cache used by concurrent threads: each thread
+// reuses its own through its thread handle or its esi_multi.
+// NOTE: like the thread handles, the share is never cleaned up
+CURLSH  *esi_share = NULL;
+mutex_t  esi_share_mu[CURL_LOCK_DATA_LAST];
+
+void esi_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access,
+                    void *userptr) {
+  assert(data < CURL_LOCK_DATA_LAST);
+  mutex_lock(&esi_share_mu[data], 5);
+}
 
-// Will the curl handle passed as argument
-err_t sso_access_token_acquire(CURL *handle) {
-  assert(handle != NULL);
+void esi_share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+  assert(data < CURL_LOCK_DATA_LAST);
+  mutex_unlock(&esi_share_mu[data]);
+}
 
-  uint64_t now = (uint64_t) time(NULL);
-  mutex_lock(&sso_access_token_mu, 5);
-  if (now + 10 < sso_access_token_expiry) {
-    mutex_unlock(&sso_access_token_mu);
-    return E_OK;
+// must be called once, after curl_global_init and before any esi request
+err_t esi_share_create(void) {
+  assert(esi_share == NULL);
+  for (size_t i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+    esi_share_mu[i] = (mutex_t) MUTEX_INIT;
+  }
+
+  CURLSH *share = curl_share_init();
+  if (share == NULL) {
+    errmsg_fmt("curl_share_init: damn");
+    return E_ERR;
+  }
+
+  CURLSHcode rv = curl_share_setopt(share, CURLSHOPT_LOCKFUNC, esi_share_lock);
+  if (rv != CURLSHE_OK) goto setopt_error;
+  rv = curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, esi_share_unlock);
+  if (rv != CURLSHE_OK) goto setopt_error;
+  rv = curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  if (rv != CURLSHE_OK) goto setopt_error;
+  rv = curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  if (rv != CURLSHE_OK) goto setopt_error;
+
+  esi_share = share;
+  return E_OK;
+
+setopt_error:
+  errmsg_fmt("curl_share_setopt: %s", curl_share_strerror(rv));
+  curl_share_cleanup(share);
+  return E_ERR;
+}
+
+// The share survives curl_easy_reset so it only has to be set once per handle
+CURL *esi_handle_create(void) {
+  CURL *handle = curl_easy_init();
+  if (handle == NULL) {
+    return NULL;
+  }
+  if (esi_share != NULL) {
+    CURLcode rv = curl_easy_setopt(handle, CURLOPT_SHARE, esi_share);
+    if (rv != CURLE_OK) {
+      log_warn("esi_handle_create: CURLOPT_SHARE error: %s", curl_easy_strerror(rv));
+    }
+  }
+  return handle;
+}
+
+// Instrumentation
+//
+// Every request is accounted to the class of endpoint it targets. For each
+// class, esi_stats keeps counters, the sum of each curl phase and a latency
+// histogram. esi_stats_snapshot gives the numbers since the start of the
+// process and a summary of the last ESI_STATS_LOG_INTERVAL is logged by the
+// thread that records the first request past that interval.
+
+enum esi_endpoint {
+  ESI_ENDPOINT_ORDERS,
+  ESI_ENDPOINT_HISTORY,
+  ESI_ENDPOINT_STRUCTURES,
+  ESI_ENDPOINT_SSO,
+  ESI_ENDPOINT_OTHER,
+  ESI_ENDPOINT_LEN,
+};
+
+const char *ESI_ENDPOINT_NAMES[ESI_ENDPOINT_LEN] = {
+  "orders", "history", "structures", "sso", "other",
+};
+
+enum esi_code_class {
+  ESI_CODE_200,
+  ESI_CODE_304,
+  ESI_CODE_420,
+  ESI_CODE_429,
+  ESI_CODE_4XX,  // other than 420 and 429
+  ESI_CODE_5XX,
+  ESI_CODE_OTHER,
+  ESI_CODE_LEN,
+};
+
+const char *ESI_CODE_NAMES[ESI_CODE_LEN] = {
+  "200", "304", "420", "429", "4xx", "5xx", "other",
+};
+
+// Log-linear histogram of durations in microseconds (HDR style): values
+// under 16us have their own bucket, then each power of two is split into 16
+// buckets so that a value is known within 6%. Values past 2^27us (2 minutes)
+// are clamped.
+#define ESI_HISTOGRAM_SUB_BITS 4
+#define ESI_HISTOGRAM_MSB_MAX 26
+#define ESI_HISTOGRAM_LEN ((ESI_HISTOGRAM_MSB_MAX - ESI_HISTOGRAM_SUB_BITS + 2) << ESI_HISTOGRAM_SUB_BITS)
+
+struct esi_histogram {
+  uint64_t counts[ESI_HISTOGRAM_LEN];
+  uint64_t count;
+  uint64_t max_us;
+};
+
+size_t esi_histogram_index(uint64_t us) {
+  const uint64_t SUB_LEN = 1 << ESI_HISTOGRAM_SUB_BITS;
+  if (us < SUB_LEN) {
+    return us;
+  }
+  if (us >= (uint64_t) 1 << (ESI_HISTOGRAM_MSB_MAX + 1)) {
+    us = ((uint64_t) 1 << (ESI_HISTOGRAM_MSB_MAX + 1)) - 1;
+  }
+  size_t msb = 0;
+  while (us >> (msb + 1) != 0) msb += 1;
+  size_t shift = msb - ESI_HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << ESI_HISTOGRAM_SUB_BITS) + (us >> shift) - SUB_LEN;
+}
+
+// middle of the bucket
+uint64_t esi_histogram_value(size_t idx) {
+  const uint64_t SUB_LEN = 1 << ESI_HISTOGRAM_SUB_BITS;
+  if (idx < SUB_LEN) {
+    return idx;
+  }
+  size_t shift = (idx >> ESI_HISTOGRAM_SUB_BITS) - 1;
+  uint64_t low = ((idx & (SUB_LEN - 1)) + SUB_LEN) << shift;
+  return low + (((uint64_t) 1 << shift) >> 1);
+}
+
+void esi_histogram_record(struct esi_histogram *h, uint64_t us) {
+  h->counts[esi_histogram_index(us)] += 1;
+  h->count += 1;
+  if (us > h->max_us) h->max_us = us;
+}
+
+// `p` is between 0 and 1, returns 0 if the histogram is empty
+uint64_t esi_histogram_percentile(const struct esi_histogram *h, double p) {
+  if (h->count == 0) return 0;
+  uint64_t rank = (uint64_t) (p * h->count);
+  if (rank >= h->count) rank = h->count - 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < ESI_HISTOGRAM_LEN; ++i) {
+    seen += h->counts[i];
+    if (seen > rank) {
+      uint64_t value = esi_histogram_value(i);
+      return value < h->max_us ? value : h->max_us;
+    }
+  }
+  return h->max_us;
+}
+
+// timings of a transfer in microseconds
+struct esi_transfer {
+  uint64_t dns_us;
+  uint64_t connect_us;
+  uint64_t tls_us;
+  uint64_t ttfb_us;      // from the request being sent to the first byte
+  uint64_t transfer_us;  // from the first byte to the last one
+  uint64_t total_us;
+  uint64_t bytes;
+};
+
+struct esi_endpoint_stats {
+  uint64_t requests;   // performed requests, including the failed ones
+  uint64_t retries;
+  uint64_t failures;   // requests that did not get a response
+  uint64_t codes[ESI_CODE_LEN];
+  uint64_t bytes;
+  uint64_t governor_wait_us;  // time spent waiting for the rate governor
+  uint64_t dns_us;
+  uint64_t connect_us;
+  uint64_t tls_us;
+  uint64_t ttfb_us;
+  uint64_t transfer_us;
+  struct esi_histogram latency;
+};
+
+const double ESI_STATS_LOG_INTERVAL = 60;
+
+struct esi_endpoint_stats esi_stats[ESI_ENDPOINT_LEN];
+struct esi_endpoint_stats esi_stats_interval[ESI_ENDPOINT_LEN];  // since the last log
+double                    esi_stats_logged_at = -1;  // monotonic time of the last log
+mutex_t                   esi_stats_mu = MUTEX_INIT;
+
+double esi_now(void) {
+  struct timespec ts;
+  int rv = clock_gettime(CLOCK_MONOTONIC, &ts);
+  assert(rv == 0);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum esi_endpoint esi_endpoint_of(struct string uri) {
+  struct string markets = string_new("/markets/");
+  struct string structures = string_new("/universe/structures/");
+  if (uri.len >= structures.len && memcmp(uri.buf, structures.buf, structures.len) == 0) {
+    return ESI_ENDPOINT_STRUCTURES;
+  }
+  if (uri.len >= markets.len && memcmp(uri.buf, markets.buf, markets.len) == 0) {
+    // skip the region id
+    size_t i = markets.len;
+    while (i < uri.len && uri.buf[i] != '/') i += 1;
+    struct string rest = { .buf = uri.buf + i, .len = uri.len - i };
+    if (rest.len >= 7 && memcmp(rest.buf, "/orders", 7) == 0) {
+      return ESI_ENDPOINT_ORDERS;
+    }
+    if (rest.len >= 8 && memcmp(rest.buf, "/history", 8) == 0) {
+      return ESI_ENDPOINT_HISTORY;
+    }
+  }
+  return ESI_ENDPOINT_OTHER;
+}
+
+enum esi_code_class esi_code_class_of(int code) {
+  if (code == 200) return ESI_CODE_200;
+  if (code == 304) return ESI_CODE_304;
+  if (code == 420) return ESI_CODE_420;
+  if (code == 429) return ESI_CODE_429;
+  if (code >= 400 && code < 500) return ESI_CODE_4XX;
+  if (code >= 500 && code < 600) return ESI_CODE_5XX;
+  return ESI_CODE_OTHER;
+}
+
+// Read the timings of a performed transfer, missing timings are left to 0
+struct esi_transfer esi_transfer_get(CURL *handle) {
+  curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0;
+  curl_off_t starttransfer = 0, total = 0, size = 0;
+  curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+  curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+  curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+  curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+  curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+  curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &size);
+
+  // curl timings are cumulative since the start of the transfer, a reused
+  // connection has its connect and appconnect times to 0
+  struct esi_transfer transfer = { .total_us = total, .bytes = size };
+  transfer.dns_us = namelookup;
+  if (connect > namelookup) transfer.connect_us = connect - namelookup;
+  if (appconnect > connect) transfer.tls_us = appconnect - connect;
+  if (starttransfer > pretransfer) transfer.ttfb_us = starttransfer - pretransfer;
+  if (total > starttransfer) transfer.transfer_us = total - starttransfer;
+  return transfer;
+}
+
+void esi_stats_log(void);
+
+// Account a request that got a response with `code`, or none if code is 0
+void esi_stats_record(enum esi_endpoint endpoint, int code, struct esi_transfer transfer) {
+  assert(endpoint < ESI_ENDPOINT_LEN);
+  mutex_lock(&esi_stats_mu, 5);
+  struct esi_endpoint_stats *stats[] = { &esi_stats[endpoint], &esi_stats_interval[endpoint] };
+  for (size_t i = 0; i < 2; ++i) {
+    stats[i]->requests += 1;
+    if (code == 0) {
+      stats[i]->failures += 1;
+    } else {
+      stats[i]->codes[esi_code_class_of(code)] += 1;
+    }
+    stats[i]->bytes += transfer.bytes;
+    stats[i]->dns_us += transfer.dns_us;
+    stats[i]->connect_us += transfer.connect_us;
+    stats[i]->tls_us += transfer.tls_us;
+    stats[i]->ttfb_us += transfer.ttfb_us;
+    stats[i]->transfer_us += transfer.transfer_us;
+    esi_histogram_record(&stats[i]->latency, transfer.total_us);
   }
-  mutex_unlock(&sso_access_token_mu);
+
+  double now = esi_now();
+  if (esi_stats_logged_at < 0) {
+    esi_stats_logged_at = now;
+  } else if (now - esi_stats_logged_at >= ESI_STATS_LOG_INTERVAL) {
+    esi_stats_log();
+    memset(esi_stats_interval, 0, sizeof(esi_stats_interval));
+    esi_stats_logged_at = now;
+  }
+  mutex_unlock(&esi_stats_mu);
+}
+
+void esi_stats_record_retry(enum esi_endpoint endpoint) {
+  assert(endpoint < ESI_ENDPOINT_LEN);
+  mutex_lock(&esi_stats_mu, 5);
+  esi_stats[endpoint].retries += 1;
+  esi_stats_interval[endpoint].retries += 1;
+  mutex_unlock(&esi_stats_mu);
+}
+
+void esi_stats_record_wait(enum esi_endpoint endpoint, double wait_secs) {
+  assert(endpoint < ESI_ENDPOINT_LEN);
+  if (wait_secs <= 0) return;
+  mutex_lock(&esi_stats_mu, 5);
+  esi_stats[endpoint].governor_wait_us += (uint64_t) (wait_secs * 1e6);
+  esi_stats_interval[endpoint].governor_wait_us += (uint64_t) (wait_secs * 1e6);
+  mutex_unlock(&esi_stats_mu);
+}
+
+// copy the stats since the start of the process
+void esi_stats_snapshot(struct esi_endpoint_stats snapshot[ESI_ENDPOINT_LEN]) {
+  mutex_lock(&esi_stats_mu, 5);
+  memcpy(snapshot, esi_stats, sizeof(esi_stats));
+  mutex_unlock(&esi_stats_mu);
+}
+
+// log a line per endpoint that was requested during the interval
+// WARN: esi_stats_mu must be held
+void esi_stats_log(void) {
+  for (size_t e = 0; e < ESI_ENDPOINT_LEN; ++e) {
+    const struct esi_endpoint_stats *st = &esi_stats_interval[e];
+    if (st->requests == 0) continue;
+
+    const size_t CODES_LEN_MAX = 256;
+    char codes[CODES_LEN_MAX];
+    size_t codes_len = 0;
+    codes[0] = '\0';
+    for (size_t c = 0; c < ESI_CODE_LEN; ++c) {
+      if (st->codes[c] == 0) continue;
+      int len = snprintf(codes + codes_len, CODES_LEN_MAX - codes_len, " %s:%" PRIu64,
+                         ESI_CODE_NAMES[c], st->codes[c]);
+      if (len < 0 || (size_t) len >= CODES_LEN_MAX - codes_len) break;
+      codes_len += len;
+    }
+
+    log_print("esi_stats: %s: %" PRIu64 " requests (%" PRIu64 " retries, %" PRIu64
+              " failures), %.1fMB, codes%s, latency p50 %.0fms p90 %.0fms p99 %.0fms"
+              " max %.0fms, governor wait %.1fs, dns %.1fs, connect %.1fs, tls %.1fs,"
+              " ttfb %.1fs, transfer %.1fs",
+              ESI_ENDPOINT_NAMES[e], st->requests, st->retries, st->failures,
+              st->bytes / 1e6, codes,
+              esi_histogram_percentile(&st->latency, 0.50) / 1e3,
+              esi_histogram_percentile(&st->latency, 0.90) / 1e3,
+              esi_histogram_percentile(&st->latency, 0.99) / 1e3,
+              st->latency.max_us / 1e3, st->governor_wait_us / 1e6,
+              st->dns_us / 1e6, st->connect_us / 1e6, st->tls_us / 1e6,
+              st->ttfb_us / 1e6, st->transfer_us / 1e6);
+  }
+}
+
+// SSO access token
+//
+// The access token is refreshed in the background by the sso refresher
+// thread, ahead of its expiry, so that an authenticated request never waits
+// for login.eveonline.com. The refresher writes the new token in the slot
+// that is not in use and publishes it by flipping `sso_token_current`.
+// The refresher is started by the first call to sso_access_token_acquire.
+
+#define  SSO_ACCESS_TOKEN_LEN_MAX 4096
+const uint64_t SSO_REFRESH_AHEAD = 120;  // refresh the token 2 minutes before it expires
+const uint64_t SSO_REFRESH_RETRY = 10;   // delay before retrying a failed refresh
+const uint64_t SSO_ACQUIRE_TIMEOUT = 30;
+
+struct sso_token {
+  char value[SSO_ACCESS_TOKEN_LEN_MAX];
+  uint64_t expiry;
+};
+
+struct sso_token sso_tokens[2];
+size_t           sso_token_current = 0;  // slot of the published token
+mutex_t          sso_token_mu = MUTEX_INIT;
+pthread_cond_t   sso_token_cond = PTHREAD_COND_INITIALIZER;  // signaled on publication
+pthread_once_t   sso_refresher_once = PTHREAD_ONCE_INIT;
+bool             sso_refresher_running = false;
+
+// Request a new access token with the refresh token and publish it.
+// Returns the lifetime of the new token in seconds in `lifetime`.
+// NOTE: only called by the sso refresher, `handle` is its own
+err_t sso_access_token_refresh(CURL *handle, uint64_t *lifetime) {
+  assert(handle != NULL);
+  assert(lifetime != NULL);
 
   // get the little secrets
 	struct string client_id = secret_table_get(string_new("ssoClientId"));
@@ -118,6 +480,7 @@ err_t sso_access_token_acquire(CURL *handle) {
   rv = curl_easy_perform(handle);
   if (rv != CURLE_OK) {
     errmsg_fmt("curl_easy_perform error: %s", curl_easy_strerror(rv));
+    esi_stats_record(ESI_ENDPOINT_SSO, 0, esi_transfer_get(handle));
     goto cleanup;
   }
   fclose(res_body_file);  // null terminates `res_body` buffer
@@ -128,8 +491,10 @@ err_t sso_access_token_acquire(CURL *handle) {
   rv = curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &res_code);
   if (rv != CURLE_OK) {
     errmsg_fmt("CURLINFO_RESPONSE_CODE error: %s", curl_easy_strerror(rv));
+    esi_stats_record(ESI_ENDPOINT_SSO, 0, esi_transfer_get(handle));
     goto cleanup;
   }
+  esi_stats_record(ESI_ENDPOINT_SSO, res_code, esi_transfer_get(handle));
   if (res_code != 200) {
     errmsg_fmt("response code %d", res_code);
     goto cleanup;
@@ -185,16 +550,22 @@ err_t sso_access_token_acquire(CURL *handle) {
     errmsg_fmt("json error: access_token is not a string");
     goto cleanup;
   }
-  if (strlen(json_string_value(access_token)) > SSO_ACCESS_TOKEN_LEN_MAX) {
+  if (strlen(json_string_value(access_token)) >= SSO_ACCESS_TOKEN_LEN_MAX) {
     errmsg_fmt("sso error: what did ccp manage to stick in this token so that it would get so big");
     goto cleanup;
   }
 
   // we have it!!!!, we got our access token!!
-  mutex_lock(&sso_access_token_mu, 5);
-  strcpy(sso_access_token, json_string_value(access_token));
-  sso_access_token_expiry = (uint64_t) time(NULL) + expires_in_secs - 7;
-  mutex_unlock(&sso_access_token_mu);
+  // NOTE: the refresher is the only writer so the unused slot can be written
+  // without holding the lock
+  size_t next = 1 - sso_token_current;
+  strcpy(sso_tokens[next].value, json_string_value(access_token));
+  sso_tokens[next].expiry = (uint64_t) time(NULL) + expires_in_secs - 7;
+  mutex_lock(&sso_token_mu, 5);
+  sso_token_current = next;
+  pthread_cond_broadcast(&sso_token_cond);
+  mutex_unlock(&sso_token_mu);
+  *lifetime = expires_in_secs;
   err = E_OK;
 
 cleanup:
@@ -204,29 +575,279 @@ cleanup:
   return err;
 }
 
-uint64_t esi_timeout = 0;
-mutex_t esi_timeout_mu = MUTEX_INIT;
+void *sso_refresher(void *args) {
+  CURL *handle = esi_handle_create();
+  if (handle == NULL) {
+    log_error("sso refresher: curl_easy_init failed, quitting");
+    mutex_lock(&sso_token_mu, 5);
+    sso_refresher_running = false;
+    pthread_cond_broadcast(&sso_token_cond);  // wake up the waiting acquirers
+    mutex_unlock(&sso_token_mu);
+    return NULL;
+  }
+
+  while (true) {
+    uint64_t expires_in;
+    err_t err = sso_access_token_refresh(handle, &expires_in);
+    uint64_t wait_secs;
+    if (err != E_OK) {
+      log_error("sso refresher: unable to refresh the access token");
+      errmsg_prefix("sso_access_token_refresh: ");
+      errmsg_print();
+      wait_secs = SSO_REFRESH_RETRY;
+    } else if (expires_in > 2 * SSO_REFRESH_AHEAD) {
+      wait_secs = expires_in - SSO_REFRESH_AHEAD;
+    } else {
+      wait_secs = expires_in / 2;
+    }
+    sleep(wait_secs);
+  }
+  return NULL;
+}
+
+void sso_refresher_spawn(void) {
+  // set before the refresher starts so that it can clear it if it fails right
+  // away
+  mutex_lock(&sso_token_mu, 5);
+  sso_refresher_running = true;
+  mutex_unlock(&sso_token_mu);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  int rv = pthread_create(&thread, &attr, sso_refresher, NULL);
+  pthread_attr_destroy(&attr);
+  if (rv != 0) {
+    log_error("sso refresher: pthread_create: %s", strerror(rv));
+    mutex_lock(&sso_token_mu, 5);
+    sso_refresher_running = false;
+    mutex_unlock(&sso_token_mu);
+  }
+}
+
+// Wait for a valid access token and copy it to `token`. Only waits at start
+// up or if the refresher keeps failing.
+err_t sso_access_token_acquire(char token[SSO_ACCESS_TOKEN_LEN_MAX]) {
+  pthread_once(&sso_refresher_once, sso_refresher_spawn);
+
+  struct timespec deadline;
+  int rv = clock_gettime(CLOCK_REALTIME, &deadline);
+  assert(rv == 0);
+  deadline.tv_sec += SSO_ACQUIRE_TIMEOUT;
+
+  mutex_lock(&sso_token_mu, 5);
+  while (true) {
+    const struct sso_token *current = &sso_tokens[sso_token_current];
+    if ((uint64_t) time(NULL) + 10 < current->expiry) {
+      strcpy(token, current->value);
+      mutex_unlock(&sso_token_mu);
+      return E_OK;
+    }
+    if (!sso_refresher_running) {
+      mutex_unlock(&sso_token_mu);
+      errmsg_fmt("the sso refresher is not running");
+      return E_ERR;
+    }
+    rv = pthread_cond_timedwait(&sso_token_cond, &sso_token_mu, &deadline);
+    if (rv == ETIMEDOUT) {
+      mutex_unlock(&sso_token_mu);
+      errmsg_fmt("no access token after %" PRIu64 "s", SSO_ACQUIRE_TIMEOUT);
+      return E_ERR;
+    }
+  }
+}
+
+// Rate governor
+//
+// Every esi request goes through the governor before being sent. It paces the
+// requests of the whole process with a token bucket and tells the concurrent
+// downloaders how many requests they may keep in flight (AIMD: the window
+// grows by one request per window of successes and is halved on congestion,
+// that is a 420, a 429, a 5xx or a transfer that failed).
+// The error budget advertised by esi in `X-Esi-Error-Limit-Remain` and
+// `X-Esi-Error-Limit-Reset` is read from every response: the refill rate
+// shrinks with the budget and requests are held until the end of the window
+// once the budget is almost spent, instead of waiting for a 420. Other 4xx,
+// such as the 404 of a market without history, only spend the budget.
+
+// NOTE: macros so that ESI_GOVERNOR_INIT can initialize the global governor
+#define ESI_CONCURRENCY_MAX ((size_t) 64)
+
+#define ESI_GOVERNOR_RATE_MAX 100.0  // requests per second
+#define ESI_GOVERNOR_BURST 50.0      // capacity of the token bucket
+const long   ESI_GOVERNOR_BUDGET_COMFORT = 50;  // esi error budget under which the rate shrinks
+const long   ESI_GOVERNOR_BUDGET_FLOOR = 10;    // esi error budget under which requests are held
+const double ESI_GOVERNOR_DECREASE_DELAY = 1;   // seconds between two multiplicative decreases
+
+struct esi_governor {
+  double tokens;
+  double rate;          // current refill rate in tokens per second
+  double refilled_at;   // monotonic time of the last refill
+  double concurrency;   // AIMD window
+  double decreased_at;  // monotonic time of the last multiplicative decrease
+  double blocked_until; // monotonic time before which no request is sent
+  long budget_remain;   // last X-Esi-Error-Limit-Remain or -1
+  long budget_reset;    // last X-Esi-Error-Limit-Reset or -1
+};
+
+#define ESI_GOVERNOR_INIT { \
+  .tokens = ESI_GOVERNOR_BURST, .rate = ESI_GOVERNOR_RATE_MAX, .refilled_at = 0, \
+  .concurrency = ESI_CONCURRENCY_MAX, .decreased_at = 0, .blocked_until = 0, \
+  .budget_remain = -1, .budget_reset = -1 \
+}
+
+struct esi_governor esi_governor = ESI_GOVERNOR_INIT;
+mutex_t             esi_governor_mu = MUTEX_INIT;
+
+// snapshot of the governor given to the callers
+struct esi_governor_state {
+  double tokens;
+  double rate;
+  size_t concurrency;
+  long budget_remain;  // -1 if esi did not tell yet
+  long budget_reset;   // -1 if esi did not tell yet
+  double blocked_secs; // time left before requests are sent again
+};
+
+void esi_sleep(double secs) {
+  if (secs <= 0) return;
+  struct timespec ts = {
+    .tv_sec = (time_t) secs,
+    .tv_nsec = (long) ((secs - (time_t) secs) * 1e9),
+  };
+  nanosleep(&ts, NULL);
+}
+
+// WARN: esi_governor_mu must be held
+void esi_governor_refill(double now) {
+  if (now > esi_governor.refilled_at) {
+    esi_governor.tokens += (now - esi_governor.refilled_at) * esi_governor.rate;
+    if (esi_governor.tokens > ESI_GOVERNOR_BURST) {
+      esi_governor.tokens = ESI_GOVERNOR_BURST;
+    }
+  }
+  esi_governor.refilled_at = now;
+}
+
+// Take the governor's permission to send one more request if it allows it
+// right away. Returns 0 if so, the time to wait in seconds before asking again
+// otherwise.
+double esi_governor_try_acquire(void) {
+  mutex_lock(&esi_governor_mu, 5);
+  double now = esi_now();
+  esi_governor_refill(now);
+
+  double wait_secs;
+  if (esi_governor.blocked_until > now) {
+    wait_secs = esi_governor.blocked_until - now;
+  } else if (esi_governor.tokens >= 1) {
+    esi_governor.tokens -= 1;
+    wait_secs = 0;
+  } else {
+    wait_secs = (1 - esi_governor.tokens) / esi_governor.rate;
+  }
+  mutex_unlock(&esi_governor_mu);
+
+  assert(wait_secs < 60 * 60);  // just to be sure
+  return wait_secs;
+}
+
+// Block until the governor allows one more request to be sent
+// Returns the time spent waiting in seconds
+// WARN: not to be used while requests are in flight in an esi_multi, the
+// transfers are not advanced while sleeping, see esi_governor_try_acquire
+double esi_governor_acquire(void) {
+  double waited_secs = 0;
+  while (true) {
+    double wait_secs = esi_governor_try_acquire();
+    if (wait_secs == 0) return waited_secs;
+    esi_sleep(wait_secs);
+    waited_secs += wait_secs;
+  }
+}
+
+// WARN: esi_governor_mu must be held
+void esi_governor_decrease(double now) {
+  if (now - esi_governor.decreased_at < ESI_GOVERNOR_DECREASE_DELAY) {
+    return;  // the requests in flight were sent before the last decrease
+  }
+  esi_governor.decreased_at = now;
+  esi_governor.concurrency /= 2;
+  if (esi_governor.concurrency < 1) {
+    esi_governor.concurrency = 1;
+  }
+}
+
+// Hold every request for `duration` seconds
+void esi_governor_block(uint64_t duration) {
+  mutex_lock(&esi_governor_mu, 5);
+  double now = esi_now();
+  if (now + duration > esi_governor.blocked_until) {
+    esi_governor.blocked_until = now + duration;
+  }
+  esi_governor_decrease(now);
+  mutex_unlock(&esi_governor_mu);
+}
 
-void esi_timeout_set(uint64_t duration) {
-  uint64_t now = (uint64_t) time(NULL);
-  mutex_lock(&esi_timeout_mu, 5);
-  if (now + duration > esi_timeout) {
-    esi_timeout = now + duration;
+// Feed the outcome of a request to the AIMD window. A request is congested
+// if it timed out or was rejected by esi because of the load.
+void esi_governor_feedback(bool congested) {
+  mutex_lock(&esi_governor_mu, 5);
+  if (congested) {
+    esi_governor_decrease(esi_now());
+  } else {
+    esi_governor.concurrency += 1 / esi_governor.concurrency;
+    if (esi_governor.concurrency > ESI_CONCURRENCY_MAX) {
+      esi_governor.concurrency = ESI_CONCURRENCY_MAX;
+    }
   }
-  mutex_unlock(&esi_timeout_mu);
+  mutex_unlock(&esi_governor_mu);
 }
 
-void esi_timeout_clear(void) {
-  mutex_lock(&esi_timeout_mu, 5);
-  uint64_t timeout = esi_timeout;
-  mutex_unlock(&esi_timeout_mu);
+// Update the governor with the error budget advertised by esi
+void esi_governor_budget(long remain, long reset) {
+  assert(remain >= 0);
+  assert(reset >= 0);
+
+  mutex_lock(&esi_governor_mu, 5);
+  double now = esi_now();
+  esi_governor_refill(now);
+
+  esi_governor.budget_remain = remain;
+  esi_governor.budget_reset = reset;
 
-  uint64_t now = (uint64_t) time(NULL);
-  if (timeout > now) {
-    assert(timeout - now < 60 * 60);  // just to be sure
-    sleep(timeout - now);
-    esi_timeout_clear();
+  if (remain <= ESI_GOVERNOR_BUDGET_FLOOR) {
+    if (now + reset > esi_governor.blocked_until) {
+      log_print("esi_governor: error budget %ld, holding requests for %lds", remain, reset);
+      esi_governor.blocked_until = now + reset;
+    }
+  }
+  if (remain < ESI_GOVERNOR_BUDGET_COMFORT) {
+    esi_governor.rate = ESI_GOVERNOR_RATE_MAX * remain / ESI_GOVERNOR_BUDGET_COMFORT;
+    if (esi_governor.rate < 1) {
+      esi_governor.rate = 1;
+    }
+  } else {
+    esi_governor.rate = ESI_GOVERNOR_RATE_MAX;
   }
+  mutex_unlock(&esi_governor_mu);
+}
+
+struct esi_governor_state esi_governor_state_get(void) {
+  mutex_lock(&esi_governor_mu, 5);
+  double now = esi_now();
+  esi_governor_refill(now);
+  struct esi_governor_state state = {
+    .tokens = esi_governor.tokens,
+    .rate = esi_governor.rate,
+    .concurrency = (size_t) esi_governor.concurrency,
+    .budget_remain = esi_governor.budget_remain,
+    .budget_reset = esi_governor.budget_reset,
+    .blocked_secs = esi_governor.blocked_until > now ? esi_governor.blocked_until - now : 0,
+  };
+  mutex_unlock(&esi_governor_mu);
+  return state;
 }
 
 err_t esi_parse_error_timeout(struct string body, int *timeout_secs) {
@@ -244,7 +865,7 @@ err_t esi_parse_error_timeout(struct string body, int *timeout_secs) {
   }
 
   json_t *timeout_field = json_object_get(root, "timeout");
-  if (!json_is_integer(root)){ 
+  if (!json_is_integer(timeout_field)) {
     errmsg_fmt("json error: timeout is not a number");
     goto cleanup;
   }
@@ -297,6 +918,9 @@ cleanup:
 }
 
 const err_t E_ESI_ERR = E_ESI_BASE + 1;  // esi returned an error
+const err_t E_ESI_RETRY = E_ESI_BASE + 2;  // request failed but can be retried
+
+#define ESI_ETAG_LEN_MAX 128
 
 struct esi_response {
   struct string body;
@@ -304,6 +928,9 @@ struct esi_response {
   time_t expires;   // content expiry
   time_t modified;  // content last modification date
   int code;         // http response code
+  char etag[ESI_ETAG_LEN_MAX + 1];  // content of the ETag header or ""
+  long budget_remain;  // content of the X-Esi-Error-Limit-Remain header or -1
+  long budget_reset;   // content of the X-Esi-Error-Limit-Reset header or -1
 };
 
 void esi_response_destroy(struct esi_response *res) {
@@ -320,8 +947,9 @@ err_t esi_build_request(
   assert(handle != NULL);
 
   // get soo token
+  char token[SSO_ACCESS_TOKEN_LEN_MAX];
   if (authenticated) {
-    err_t err = sso_access_token_acquire(handle);
+    err_t err = sso_access_token_acquire(token);
     if (err != E_OK) {
       errmsg_prefix("soo_access_token_acquire: ");
       return E_ERR;
@@ -329,6 +957,7 @@ err_t esi_build_request(
   }
 
   // reset handle
+  // NOTE: reset keeps the live connections and the share of the handle
   CURLcode rv;
   curl_easy_reset(handle);
 
@@ -354,6 +983,26 @@ err_t esi_build_request(
     return E_ERR;
   }
 
+  // multiplex requests over a single HTTP/2 connection when esi allows it,
+  // and rather wait for that connection than opening a new one
+  rv = curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  if (rv != CURLE_OK) {
+    errmsg_fmt("CURLOPT_HTTP_VERSION error: %s", curl_easy_strerror(rv));
+    return E_ERR;
+  }
+  rv = curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+  if (rv != CURLE_OK) {
+    errmsg_fmt("CURLOPT_PIPEWAIT error: %s", curl_easy_strerror(rv));
+    return E_ERR;
+  }
+
+  // keep idle connections alive between two cycles of a hoardling
+  rv = curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+  if (rv != CURLE_OK) {
+    errmsg_fmt("CURLOPT_TCP_KEEPALIVE error: %s", curl_easy_strerror(rv));
+    return E_ERR;
+  }
+
   // method
   const size_t METHOD_LEN_MAX = 32;
   char method_nt[METHOD_LEN_MAX];
@@ -388,215 +1037,609 @@ err_t esi_build_request(
       return E_ERR;
     }
 
-    mutex_lock(&sso_access_token_mu, 5);
-    rv = curl_easy_setopt(handle, CURLOPT_XOAUTH2_BEARER, sso_access_token);
+    // NOTE: curl keeps its own copy of the token
+    rv = curl_easy_setopt(handle, CURLOPT_XOAUTH2_BEARER, token);
     if (rv != CURLE_OK) {
       errmsg_fmt("CURLOPT_XOAUTH2_BEARER error: %s", curl_easy_strerror(rv));
       return E_ERR;
     }
-    mutex_unlock(&sso_access_token_mu);
   }
 
   return E_OK;
 }
 
-// response->pages, response->expires and response->modified are set to 0 if
-// the corresponding header is not present or can't be parsed
-err_t esi_perform_request(CURL *handle, struct esi_response *response,
-                          int trails) {
-  err_t res = E_ERR;
-  CURLcode rv;
-  CURLHcode hrv;
-  FILE *body_file = NULL;
-  *response = (struct esi_response) {0};
-  // WARN: do not call return passed this line, set `err` and goto cleanup
-
-  rv = curl_easy_setopt(handle, CURLOPT_TIMEOUT, ESI_REQUEST_TIMEOUT);
+// Read the response code and the headers of a performed request.
+// response->pages, response->expires and response->modified are set to 0 and
+// response->budget_remain and response->budget_reset to -1 if the
+// corresponding header is not present or can't be parsed
+// Returns E_ESI_RETRY if the response code is not available
+err_t esi_read_response(CURL *handle, struct esi_response *response) {
+  long res_code;
+  CURLcode rv = curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &res_code);
   if (rv != CURLE_OK) {
-    errmsg_fmt("CURLOPT_TIMEOUT error: %s", curl_easy_strerror(rv));
-    goto cleanup;
+    errmsg_fmt("CURLINFO_RESPONSE_CODE error: %s", curl_easy_strerror(rv));
+    return E_ESI_RETRY;
+  }
+  response->code = res_code;
+  response->pages = 0;
+  response->expires = 0;
+  response->modified = 0;
+  response->etag[0] = '\0';
+  response->budget_remain = -1;
+  response->budget_reset = -1;
+
+  // parse `x-pages` header
+  {
+    struct curl_header *pages_header;
+    CURLHcode hrv = curl_easy_header(handle, "X-Pages", 0, CURLH_HEADER, -1, &pages_header);
+    if (hrv == CURLHE_OK && pages_header->value[0] != '\0') {
+      char *endptr;
+      long pages_long = strtol(pages_header->value, &endptr, 10);
+      if (*endptr != '\0') {  // if header value is not an valid long
+        log_warn("esi_fetch: X-Pages \"%s\" is not a valid int", pages_header->value);
+      } else if (pages_long < 0 || pages_long > 10000) {
+        log_warn("esi_fetch: X-Pages \"%s\" is out of range", pages_header->value);
+      } else {
+        response->pages = pages_long;
+      }
+    }
   }
 
-  while (trails > 0) {
-    trails -= 1;
+  // parse `expires` header
+  {
+    struct curl_header *expires_header;
+    CURLHcode hrv = curl_easy_header(handle, "Expires", 0, CURLH_HEADER, -1, &expires_header);
+    if (hrv == CURLHE_OK && expires_header->value[0] != '\0') {
+      err_t err = time_parse(ESI_HEADER_TIME, expires_header->value, &response->expires);
+      if (err != E_OK) {
+        log_warn("esi_fetch: Expires \"%s\" is not a valid date", expires_header->value);
+        response->expires = 0;
+      }
+    }
+  }
 
-    // wait for the api to be clear of any timeout
-    esi_timeout_clear();
+  // parse `last-modified` header
+  {
+    struct curl_header *modified_header;
+    CURLHcode hrv = curl_easy_header(handle, "Last-Modified", 0, CURLH_HEADER, -1, &modified_header);
+    if (hrv == CURLHE_OK && modified_header->value[0] != '\0') {
+      err_t err = time_parse(ESI_HEADER_TIME, modified_header->value, &response->modified);
+      if (err != E_OK) {
+        log_warn("esi_fetch: Last-Modified \"%s\" is not a valid date", modified_header->value);
+        response->modified = 0;
+      }
+    }
+  }
 
-    // reset body_file
-    if (body_file != NULL) {
-      fclose(body_file);
-      string_destroy(&response->body);
-      body_file = NULL;
+  // parse `etag` header
+  {
+    struct curl_header *etag_header;
+    CURLHcode hrv = curl_easy_header(handle, "ETag", 0, CURLH_HEADER, -1, &etag_header);
+    if (hrv == CURLHE_OK && strlen(etag_header->value) <= ESI_ETAG_LEN_MAX) {
+      strcpy(response->etag, etag_header->value);
     }
+  }
 
-    // create body memstream
-    body_file = open_memstream(&response->body.buf, &response->body.len);
-    if (body_file == NULL) {
-      errmsg_fmt("open_memstream: %s", strerror(errno));
-      goto cleanup;
+  // parse the error budget headers
+  {
+    struct curl_header *remain_header;
+    CURLHcode hrv = curl_easy_header(handle, "X-Esi-Error-Limit-Remain", 0,
+                                     CURLH_HEADER, -1, &remain_header);
+    if (hrv == CURLHE_OK && remain_header->value[0] != '\0') {
+      char *endptr;
+      long remain = strtol(remain_header->value, &endptr, 10);
+      if (*endptr != '\0' || remain < 0 || remain > 10000) {
+        log_warn("esi_fetch: X-Esi-Error-Limit-Remain \"%s\" is not valid", remain_header->value);
+      } else {
+        response->budget_remain = remain;
+      }
     }
-    rv = curl_easy_setopt(handle, CURLOPT_WRITEDATA, body_file);
-    if (rv != CURLE_OK) {
-      errmsg_fmt("CURLOPT_WRITEDATA error: %s", curl_easy_strerror(rv));
-      goto cleanup;
+
+    struct curl_header *reset_header;
+    hrv = curl_easy_header(handle, "X-Esi-Error-Limit-Reset", 0,
+                           CURLH_HEADER, -1, &reset_header);
+    if (hrv == CURLHE_OK && reset_header->value[0] != '\0') {
+      char *endptr;
+      long reset = strtol(reset_header->value, &endptr, 10);
+      if (*endptr != '\0' || reset < 0 || reset > 120) {
+        log_warn("esi_fetch: X-Esi-Error-Limit-Reset \"%s\" is not valid", reset_header->value);
+      } else {
+        response->budget_reset = reset;
+      }
     }
+  }
 
-    // do perform the request
-    rv = curl_easy_perform(handle);    
-    if (rv != CURLE_OK) {
-      errmsg_fmt("curl_easy_perform: %s", curl_easy_strerror(rv));
-      continue;
+  return E_OK;
+}
+
+// Inspect a response read with esi_read_response. `response->body` must
+// already hold the whole response body.
+// Returns E_ESI_RETRY if the request should be tried again (the governor might
+// have been told to hold the requests in the process) and E_ESI_ERR if esi
+// returned an error.
+err_t esi_check_response(struct esi_response *response) {
+  int res_code = response->code;
+
+  // every esi response carries the error budget
+  if (response->budget_remain >= 0 && response->budget_reset >= 0) {
+    esi_governor_budget(response->budget_remain, response->budget_reset);
+  }
+  esi_governor_feedback(res_code == 420 || res_code == 429 ||
+                        (res_code >= 500 && res_code < 600));
+
+  // implicit timeout
+  if (res_code == 500 || res_code == 503) {
+    esi_governor_block(20);
+
+    log_print("esi_fetch: 20s implicit timeout %d", res_code);
+    errmsg_fmt("20s implicit timeout %d", res_code);
+    return E_ESI_RETRY;
+  }
+
+  // request rate timeout
+  if (res_code == 429) {
+    // NOTE: one day, CCP will maybe add a `Retry-After` header to their
+    // responses..
+    esi_governor_block(20);
+
+    log_print("esi_fetch: 20s implicit timeout %d", res_code);
+    errmsg_fmt("20s implicit timeout %d", res_code);
+    return E_ESI_RETRY;
+  }
+
+  // error rate timeout
+  if (res_code == 420) {
+    long timeout_secs = response->budget_reset;
+    if (timeout_secs <= 0) {
+      log_warn("esi_fetch: X-Esi-Error-Limit-Reset header is not present");
+      timeout_secs = 20;
     }
 
-    long res_code;
-    rv = curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &res_code);
-    if (rv != CURLE_OK) {
-      errmsg_fmt("CURLINFO_RESPONSE_CODE error: %s", curl_easy_strerror(rv));
-      continue;
+    esi_governor_block(timeout_secs);
+
+    log_print("esi_fetch: %lds explicit timeout %d", timeout_secs, res_code);
+    errmsg_fmt("%lds explicit timeout %d", timeout_secs, res_code);
+    return E_ESI_RETRY;
+  }
+
+  // gateway timeout
+  if (res_code == 504) {
+    int timeout_secs;
+    err_t err = esi_parse_error_timeout(response->body, &timeout_secs);
+    if (err != E_OK) {
+      struct string err = errmsg_get();
+      log_warn("esi_fetch: can't decode esi timeout: %.*s", (int) err.len, err.buf);
+      timeout_secs = 20;
     }
-    response->code = res_code;
 
-    // implicit timeout
-    if (res_code == 500 || res_code == 503) {
-      esi_timeout_set(20);
+    esi_governor_block(timeout_secs);
 
-      log_print("esi_fetch: 20s implicit timeout %d", res_code);
-      errmsg_fmt("20s implicit timeout %d", res_code);
-      continue;
+    log_print("esi_fetch: %ds explicit timeout %d", timeout_secs, res_code);
+    errmsg_fmt("%ds explicit timeout %d", timeout_secs, res_code);
+    return E_ESI_RETRY;
+  }
+
+  // esi error
+  // NOTE: a 304 can only be received by a request that uses the esi cache
+  if (res_code != 200 && res_code != 304) {
+    struct string message = {0};
+    err_t err = esi_parse_error_message(response->body, &message);
+    if (err == E_OK) {
+      errmsg_fmt("esi error json: %.*s", (int) message.len, message.buf);
+    } else {
+      errmsg_fmt("esi error: %.*s", (int) response->body.len, response->body.buf);
     }
 
-    // request rate timeout
-    if (res_code == 429) {
-      // NOTE: one day, CCP will maybe add a `Retry-After` header to their
-      // responses..
-      esi_timeout_set(20);
+    string_destroy(&message);
+    return E_ESI_ERR;
+  }
 
-      log_print("esi_fetch: 20s implicit timeout %d", res_code);
-      errmsg_fmt("20s implicit timeout %d", res_code);
-      continue;
+  return E_OK;
+}
+
+// Record / replay
+//
+// In record mode, every response received from esi is appended to a corpus
+// file along with the request it answers. In replay mode, the corpus is
+// loaded in memory and esi is never contacted: the requests are answered
+// from the corpus, with an optional simulated latency and a share of
+// injected 420, 429 and 504 errors. A request that was recorded several
+// times is answered with its recordings in order, the last one being
+// repeated once they all have been served.
+//
+// The corpus is a sequence of records, integers are big endian:
+//   string method, string uri, string request body
+//   uint16 code, uint32 pages, int64 expires, int64 modified, string etag,
+//   int32 budget remain, int32 budget reset, string response body
+// where a string is a uint64 length followed by its bytes.
+// NOTE: transport errors (curl failures) are not recorded
+
+enum esi_corpus_mode {
+  ESI_CORPUS_OFF,
+  ESI_CORPUS_RECORD,
+  ESI_CORPUS_REPLAY,
+};
+
+struct esi_corpus_key {
+  struct string method;
+  struct string uri;
+  struct string body;
+};
+
+struct esi_corpus_entry {
+  struct esi_corpus_key key;
+  struct esi_response response;
+  size_t idx;   // position in the corpus file
+  bool served;
+};
+
+IMPLEMENT_VEC(struct esi_corpus_entry, esi_corpus_entry)
+
+enum esi_corpus_mode           esi_corpus_mode = ESI_CORPUS_OFF;
+FILE                          *esi_corpus_file = NULL;  // record mode
+struct esi_corpus_entry_vec    esi_corpus = { .cap = 1024 };  // replay mode
+mutex_t                        esi_corpus_mu = MUTEX_INIT;
+uint64_t                       esi_replay_latency_ms = 0;
+double                         esi_replay_error_rate = 0;
+unsigned int                   esi_replay_seed = 1;
+
+// WARN: must be called before any esi request
+err_t esi_corpus_record_open(struct string path) {
+  assert(esi_corpus_mode == ESI_CORPUS_OFF);
+  char *path_nt;
+  err_t err = string_alloc_null_terminated_cpy(&path_nt, path);
+  if (err != E_OK) {
+    errmsg_prefix("string_alloc_null_terminated_cpy: ");
+    return E_ERR;
+  }
+  esi_corpus_file = fopen(path_nt, "w");
+  free(path_nt);
+  if (esi_corpus_file == NULL) {
+    errmsg_fmt("fopen: %s", strerror(errno));
+    return E_ERR;
+  }
+  esi_corpus_mode = ESI_CORPUS_RECORD;
+  return E_OK;
+}
+
+// Append a response to the corpus, errors are only logged
+// NOTE: the corpus is flushed after each record so that it stays usable if
+// the process is killed
+void esi_corpus_record(struct esi_corpus_key key, const struct esi_response *response) {
+  assert(esi_corpus_mode == ESI_CORPUS_RECORD);
+  mutex_lock(&esi_corpus_mu, 5);
+  FILE *f = esi_corpus_file;
+  err_t err = E_OK;
+  if (err == E_OK) err = serialize_string(f, key.method);
+  if (err == E_OK) err = serialize_string(f, key.uri);
+  if (err == E_OK) err = serialize_string(f, key.body);
+  if (err == E_OK) err = serialize_uint16(f, (uint16_t) response->code);
+  if (err == E_OK) err = serialize_uint32(f, (uint32_t) response->pages);
+  if (err == E_OK) err = serialize_int64(f, (int64_t) response->expires);
+  if (err == E_OK) err = serialize_int64(f, (int64_t) response->modified);
+  if (err == E_OK) err = serialize_string(f, string_new((char *) response->etag));
+  if (err == E_OK) err = serialize_int32(f, (int32_t) response->budget_remain);
+  if (err == E_OK) err = serialize_int32(f, (int32_t) response->budget_reset);
+  if (err == E_OK) err = serialize_string(f, response->body);
+  if (err == E_OK && fflush(f) != 0) {
+    errmsg_fmt("fflush: %s", strerror(errno));
+    err = E_ERR;
+  }
+  mutex_unlock(&esi_corpus_mu);
+  if (err != E_OK) {
+    errmsg_prefix("esi_corpus_record: ");
+    errmsg_print();
+  }
+}
+
+err_t esi_corpus_read_uint(FILE *f, size_t size, uint64_t *n) {
+  unsigned char bytes[8];
+  assert(size <= 8);
+  if (fread(bytes, size, 1, f) < 1) {
+    if (feof(f)) {
+      errmsg_fmt("fread: end of file");
+      return E_EOF;
     }
+    errmsg_fmt("fread: %s", strerror(errno));
+    return E_ERR;
+  }
+  *n = 0;
+  for (size_t i = 0; i < size; ++i) {
+    *n = (*n << 8) + bytes[i];
+  }
+  return E_OK;
+}
 
-    // error rate timeout
-    if (res_code == 420) {
-      long timeout_secs;
-      struct curl_header *timeout_header;
-      hrv = curl_easy_header(handle, "X-Esi-Error-Limit-Reset", 0,
-                             CURLH_HEADER, -1, &timeout_header);
+// WARN: You then need to destroy the returned string
+err_t esi_corpus_read_string(FILE *f, struct string *str) {
+  uint64_t len;
+  err_t err = esi_corpus_read_uint(f, 8, &len);
+  if (err != E_OK) return err;
+  if (len > 1 << 30) {
+    errmsg_fmt("string of %" PRIu64 " bytes is too long", len);
+    return E_ERR;
+  }
+  char *buf = malloc(len + 1);
+  if (buf == NULL) {
+    errmsg_fmt("malloc: %s", strerror(errno));
+    return E_ERR;
+  }
+  if (len > 0 && fread(buf, len, 1, f) < 1) {
+    free(buf);
+    errmsg_fmt("fread: %s", feof(f) ? "end of file" : strerror(errno));
+    return feof(f) ? E_EOF : E_ERR;
+  }
+  buf[len] = '\0';
+  *str = (struct string) { .buf = buf, .len = len };
+  return E_OK;
+}
 
-      if (hrv != CURLHE_OK || timeout_header->value[0] == '\0') {
-        log_warn("esi_fetch: X-Esi-Error-Limit-Reset header is not present");
-        timeout_secs = 20;
-      } else {
-        char *endptr;
-        timeout_secs = strtol(timeout_header->value, &endptr, 10);
-        if (*endptr != '\0') {  // if header value is not an valid long
-          log_warn("esi_fetch: X-Esi-Error-Limit-Reset header \"%s\" is not a valid integer", timeout_header->value);
-          timeout_secs = 20;
-        } else if (timeout_secs <= 0 || timeout_secs > 120) {
-          log_warn("esi_fetch: X-Esi-Error-Limit-Reset header \"%s\" is out of range", timeout_header->value);
-          timeout_secs = 20;
-        }
-      }
+void esi_corpus_entry_destroy(struct esi_corpus_entry *entry) {
+  string_destroy(&entry->key.method);
+  string_destroy(&entry->key.uri);
+  string_destroy(&entry->key.body);
+  esi_response_destroy(&entry->response);
+}
 
-      esi_timeout_set(timeout_secs);
+// E_EOF if the corpus ends before the record
+err_t esi_corpus_read_entry(FILE *f, struct esi_corpus_entry *entry) {
+  *entry = (struct esi_corpus_entry) {0};
+  struct string etag = {0};
+  uint64_t n;
+  err_t err = E_OK;
+  if (err == E_OK) err = esi_corpus_read_string(f, &entry->key.method);
+  if (err == E_OK) err = esi_corpus_read_string(f, &entry->key.uri);
+  if (err == E_OK) err = esi_corpus_read_string(f, &entry->key.body);
+  if (err == E_OK) err = esi_corpus_read_uint(f, 2, &n);
+  if (err == E_OK) entry->response.code = (int) n;
+  if (err == E_OK) err = esi_corpus_read_uint(f, 4, &n);
+  if (err == E_OK) entry->response.pages = n;
+  if (err == E_OK) err = esi_corpus_read_uint(f, 8, &n);
+  if (err == E_OK) entry->response.expires = (time_t) (int64_t) n;
+  if (err == E_OK) err = esi_corpus_read_uint(f, 8, &n);
+  if (err == E_OK) entry->response.modified = (time_t) (int64_t) n;
+  if (err == E_OK) err = esi_corpus_read_string(f, &etag);
+  if (err == E_OK && etag.len > ESI_ETAG_LEN_MAX) {
+    errmsg_fmt("etag is too long");
+    err = E_ERR;
+  }
+  if (err == E_OK) memcpy(entry->response.etag, etag.buf, etag.len + 1);
+  if (err == E_OK) err = esi_corpus_read_uint(f, 4, &n);
+  if (err == E_OK) entry->response.budget_remain = (int32_t) n;
+  if (err == E_OK) err = esi_corpus_read_uint(f, 4, &n);
+  if (err == E_OK) entry->response.budget_reset = (int32_t) n;
+  if (err == E_OK) err = esi_corpus_read_string(f, &entry->response.body);
+  string_destroy(&etag);
+  if (err != E_OK) esi_corpus_entry_destroy(entry);
+  return err;
+}
 
-      log_print("esi_fetch: %ds explicit timeout %d", timeout_secs, res_code);
-      errmsg_fmt("%ds explicit timeout %d", timeout_secs, res_code);
-      continue;
+int esi_corpus_key_cmp(struct esi_corpus_key a, struct esi_corpus_key b) {
+  int cmp = string_cmp(a.uri, b.uri);
+  if (cmp != 0) return cmp;
+  cmp = string_cmp(a.method, b.method);
+  if (cmp != 0) return cmp;
+  return string_cmp(a.body, b.body);
+}
+
+int esi_corpus_entry_cmp(const void *a_ptr, const void *b_ptr) {
+  const struct esi_corpus_entry *a = a_ptr;
+  const struct esi_corpus_entry *b = b_ptr;
+  int cmp = esi_corpus_key_cmp(a->key, b->key);
+  if (cmp != 0) return cmp;
+  return a->idx < b->idx ? -1 : a->idx > b->idx;
+}
+
+// Load the corpus for replay. `latency_ms` is added to every request and
+// `error_rate` (between 0 and 1) is the share of requests answered with an
+// injected error.
+// WARN: must be called before any esi request
+err_t esi_corpus_replay_load(struct string path, uint64_t latency_ms, double error_rate) {
+  assert(esi_corpus_mode == ESI_CORPUS_OFF);
+  assert(error_rate >= 0 && error_rate <= 1);
+  char *path_nt;
+  err_t err = string_alloc_null_terminated_cpy(&path_nt, path);
+  if (err != E_OK) {
+    errmsg_prefix("string_alloc_null_terminated_cpy: ");
+    return E_ERR;
+  }
+  FILE *f = fopen(path_nt, "r");
+  free(path_nt);
+  if (f == NULL) {
+    errmsg_fmt("fopen: %s", strerror(errno));
+    return E_ERR;
+  }
+
+  while (true) {
+    struct esi_corpus_entry entry;
+    err = esi_corpus_read_entry(f, &entry);
+    if (err == E_EOF) {
+      break;  // the last record may have been cut by a kill, drop it
+    } else if (err != E_OK) {
+      errmsg_prefix("esi_corpus_read_entry: ");
+      fclose(f);
+      return E_ERR;
+    }
+    entry.idx = esi_corpus.len;
+    err = esi_corpus_entry_vec_push(&esi_corpus, entry);
+    if (err != E_OK) {
+      errmsg_prefix("esi_corpus_entry_vec_push: ");
+      esi_corpus_entry_destroy(&entry);
+      fclose(f);
+      return E_ERR;
     }
+  }
+  fclose(f);
+
+  qsort(esi_corpus.buf, esi_corpus.len, sizeof(struct esi_corpus_entry),
+        esi_corpus_entry_cmp);
+  esi_replay_latency_ms = latency_ms;
+  esi_replay_error_rate = error_rate;
+  esi_corpus_mode = ESI_CORPUS_REPLAY;
+  log_print("esi_corpus: %zu responses loaded", esi_corpus.len);
+  return E_OK;
+}
 
-    // gateway timeout
-    if (res_code == 504) {
-      int frv = fflush(body_file);
-      if (frv != 0) {
-        errmsg_fmt("fflush: %s", strerror(errno));
-        goto cleanup;
-      }
+// Leave record or replay mode
+void esi_corpus_close(void) {
+  mutex_lock(&esi_corpus_mu, 5);
+  if (esi_corpus_file != NULL) {
+    fclose(esi_corpus_file);
+    esi_corpus_file = NULL;
+  }
+  for (size_t i = 0; i < esi_corpus.len; ++i) {
+    esi_corpus_entry_destroy(esi_corpus.buf + i);
+  }
+  esi_corpus_entry_vec_destroy(&esi_corpus);
+  esi_corpus = (struct esi_corpus_entry_vec) { .cap = 1024 };
+  esi_corpus_mode = ESI_CORPUS_OFF;
+  mutex_unlock(&esi_corpus_mu);
+}
 
-      int timeout_secs;
-      err_t err = esi_parse_error_timeout(response->body, &timeout_secs);
-      if (err != E_OK) {
-        struct string err = errmsg_get();
-        log_warn("esi_fetch: can't decode esi timeout: %.*s", (int) err.len, err.buf);
-        timeout_secs = 20;
-      }
+// Fill `response` with the next answer to `key`. The body is copied.
+// Returns E_NOT_FOUND if the request is not in the corpus
+// WARN: You then need to destroy `response`
+err_t esi_corpus_replay(struct esi_corpus_key key, struct esi_response *response) {
+  assert(esi_corpus_mode == ESI_CORPUS_REPLAY);
+  mutex_lock(&esi_corpus_mu, 5);
+
+  // injected errors
+  if (esi_replay_error_rate > 0 &&
+      rand_r(&esi_replay_seed) < esi_replay_error_rate * ((double) RAND_MAX + 1)) {
+    int codes[] = { 420, 429, 504 };
+    int code = codes[rand_r(&esi_replay_seed) % 3];
+    mutex_unlock(&esi_corpus_mu);
+    *response = (struct esi_response) {
+      .code = code,
+      .budget_remain = code == 420 ? 0 : 100,
+      .budget_reset = 1,
+    };
+    const char *body = code == 504
+      ? "{\"error\":\"Timeout contacting tranquility\",\"timeout\":1}"
+      : "{\"error\":\"injected by esi_corpus_replay\"}";
+    return string_alloc_cpy(&response->body, string_new((char *) body));
+  }
 
-      esi_timeout_set(timeout_secs);
+  // binary search of the first recording of key
+  size_t lo = 0;
+  size_t hi = esi_corpus.len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (esi_corpus_key_cmp(esi_corpus.buf[mid].key, key) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo >= esi_corpus.len || esi_corpus_key_cmp(esi_corpus.buf[lo].key, key) != 0) {
+    mutex_unlock(&esi_corpus_mu);
+    errmsg_fmt("%.*s %.*s is not in the corpus", (int) key.method.len, key.method.buf,
+               (int) key.uri.len, key.uri.buf);
+    return E_NOT_FOUND;
+  }
+  struct esi_corpus_entry *entry = esi_corpus.buf + lo;
+  while (entry->served && entry + 1 < esi_corpus.buf + esi_corpus.len &&
+         esi_corpus_key_cmp(entry[1].key, key) == 0) {
+    entry += 1;
+  }
+  entry->served = true;
+  *response = entry->response;
+  response->body = (struct string) {0};
+  err_t err = string_alloc_cpy(&response->body, entry->response.body);
+  mutex_unlock(&esi_corpus_mu);
+  if (err != E_OK) {
+    errmsg_prefix("string_alloc_cpy: ");
+    return E_ERR;
+  }
+  return E_OK;
+}
 
-      log_print("esi_fetch: %ds explicit timeout %d", timeout_secs, res_code);
-      errmsg_fmt("%ds explicit timeout %d", timeout_secs, res_code);
-      continue;
+// response->pages, response->expires and response->modified are set to 0 if
+// the corresponding header is not present or can't be parsed
+// `handle` is not used in replay mode
+err_t esi_perform_request(CURL *handle, struct esi_corpus_key key,
+                          struct esi_response *response, int trails) {
+  err_t res = E_ERR;
+  CURLcode rv;
+  FILE *body_file = NULL;
+  *response = (struct esi_response) {0};
+  // WARN: do not call return passed this line, set `err` and goto cleanup
+
+  if (esi_corpus_mode != ESI_CORPUS_REPLAY) {
+    rv = curl_easy_setopt(handle, CURLOPT_TIMEOUT, ESI_REQUEST_TIMEOUT);
+    if (rv != CURLE_OK) {
+      errmsg_fmt("CURLOPT_TIMEOUT error: %s", curl_easy_strerror(rv));
+      goto cleanup;
     }
+  }
 
-    // esi error
-    if (res_code != 200) {
-      int frv = fflush(body_file);
-      if (frv != 0) {
-        errmsg_fmt("fflush: %s", strerror(errno));
+  enum esi_endpoint endpoint = esi_endpoint_of(key.uri);
+  while (trails > 0) {
+    trails -= 1;
+
+    // wait for the governor to let the request through
+    esi_stats_record_wait(endpoint, esi_governor_acquire());
+
+    // reset the body of the previous trail
+    string_destroy(&response->body);
+
+    if (esi_corpus_mode == ESI_CORPUS_REPLAY) {
+      esi_sleep(esi_replay_latency_ms / 1e3);
+      err_t err = esi_corpus_replay(key, response);
+      if (err == E_NOT_FOUND) {
+        res = E_ESI_ERR;
+        goto cleanup;
+      } else if (err != E_OK) {
+        errmsg_prefix("esi_corpus_replay: ");
+        goto cleanup;
+      }
+      struct esi_transfer transfer = {
+        .total_us = esi_replay_latency_ms * 1000,
+        .bytes = response->body.len,
+      };
+      esi_stats_record(endpoint, response->code, transfer);
+    } else {
+      // create body memstream
+      body_file = open_memstream(&response->body.buf, &response->body.len);
+      if (body_file == NULL) {
+        errmsg_fmt("open_memstream: %s", strerror(errno));
+        goto cleanup;
+      }
+      rv = curl_easy_setopt(handle, CURLOPT_WRITEDATA, body_file);
+      if (rv != CURLE_OK) {
+        errmsg_fmt("CURLOPT_WRITEDATA error: %s", curl_easy_strerror(rv));
         goto cleanup;
       }
 
-      struct string message;
-      err_t err = esi_parse_error_message(response->body, &message);
-      if (err == E_OK) {
-        errmsg_fmt("esi error json: %.*s", (int) message.len, message.buf);
-      } else {
-        errmsg_fmt("esi error: %.*s", (int) response->body.len, response->body.buf);
+      // do perform the request
+      rv = curl_easy_perform(handle);
+      fclose(body_file);  // flushes `response->body`
+      body_file = NULL;
+      if (rv != CURLE_OK) {
+        errmsg_fmt("curl_easy_perform: %s", curl_easy_strerror(rv));
+        esi_stats_record(endpoint, 0, esi_transfer_get(handle));
+        esi_governor_feedback(true);
+        if (trails > 0) esi_stats_record_retry(endpoint);
+        continue;
       }
 
-      string_destroy(&message);
-      res = E_ESI_ERR;
-      goto cleanup;
-    }
-    
-    // parse `x-pages` header
-    {
-      struct curl_header *pages_header;
-      CURLHcode hrv = curl_easy_header(handle, "X-Pages", 0, CURLH_HEADER, -1, &pages_header);
-      if (hrv == CURLHE_OK && pages_header->value[0] != '\0') {
-        char *endptr;
-        long pages_long = strtol(pages_header->value, &endptr, 10);
-        if (*endptr != '\0') {  // if header value is not an valid long
-          log_warn("esi_fetch: X-Pages \"%s\" is not a valid int", pages_header->value);
-          response->pages = 0;
-        } else if (pages_long < 0 || pages_long > 10000) {
-          log_warn("esi_fetch: X-Pages \"%s\" is out of range", pages_header->value);
-          response->pages = 0;
-        } else {
-          response->pages = pages_long;
-        }
+      err_t err = esi_read_response(handle, response);
+      esi_stats_record(endpoint, err == E_OK ? response->code : 0, esi_transfer_get(handle));
+      if (err == E_ESI_RETRY) {
+        if (trails > 0) esi_stats_record_retry(endpoint);
+        continue;
       }
-    }
-    
-    // parse `expires` header
-    {
-      struct curl_header *expires_header;
-      CURLHcode hrv = curl_easy_header(handle, "Expires", 0, CURLH_HEADER, -1, &expires_header);
-      if (hrv == CURLHE_OK && expires_header->value[0] != '\0') {
-        err_t err = time_parse(ESI_HEADER_TIME, expires_header->value, &response->expires);
-        if (err != E_OK) {
-          log_warn("esi_fetch: X-Pages \"%s\" is not a valid date", expires_header->value);
-          response->expires = 0;
-        }
+      if (esi_corpus_mode == ESI_CORPUS_RECORD) {
+        esi_corpus_record(key, response);
       }
     }
 
-    // parse `modified` header
-    {
-      struct curl_header *modified_header;
-      CURLHcode hrv = curl_easy_header(handle, "Expires", 0, CURLH_HEADER, -1, &modified_header);
-      if (hrv == CURLHE_OK && modified_header->value[0] != '\0') {
-        err_t err = time_parse(ESI_HEADER_TIME, modified_header->value, &response->modified);
-        if (err != E_OK) {
-          log_warn("esi_fetch: X-Pages \"%s\" is not a valid date", modified_header->value);
-          response->modified = 0;
-        }
-      }
+    err_t err = esi_check_response(response);
+    if (err == E_ESI_RETRY) {
+      if (trails > 0) esi_stats_record_retry(endpoint);
+      continue;
     }
-
-    assert(res_code == 200);
-    res = E_OK;
+    res = err;
     goto cleanup;
   }
 
@@ -625,9 +1668,19 @@ err_t esi_fetch(
   assert(uri.len > 0);
   assert(trails > 0);
 
+  struct esi_corpus_key key = { .method = method, .uri = uri, .body = body };
+  if (esi_corpus_mode == ESI_CORPUS_REPLAY) {
+    err_t err = esi_perform_request(NULL, key, response, trails);
+    if (err != E_OK) {
+      errmsg_prefix("esi_perform_request: ");
+      return err;
+    }
+    return E_OK;
+  }
+
   // Build the request upon the thread local handle
   if (esi_curl_thread_handle == NULL) {
-    esi_curl_thread_handle = curl_easy_init();
+    esi_curl_thread_handle = esi_handle_create();
     if (esi_curl_thread_handle == NULL) {
       errmsg_fmt("curl_easy_init: damn");
       return E_ERR;
@@ -639,7 +1692,7 @@ err_t esi_fetch(
     return E_ERR;
   }
 
-  err = esi_perform_request(esi_curl_thread_handle, response, trails);
+  err = esi_perform_request(esi_curl_thread_handle, key, response, trails);
   if (err != E_OK) {
     errmsg_prefix("esi_perform_request: ");
     return err;
@@ -647,3 +1700,614 @@ err_t esi_fetch(
 
   return E_OK;
 }
+
+// Validator cache
+//
+// ESI answers a request carrying the ETag of a previous response with a 304 if
+// the content did not change. For each uri, the cache keeps that ETag along
+// with a payload given by the caller (typically the content of the response
+// once parsed) so that a 304 can be served without decoding anything.
+// NOTE: entries are never evicted, the set of cached uris is expected to be
+// bounded (one entry per order page of the universe)
+
+struct esi_cache_entry {
+  struct string uri;
+  char          etag[ESI_ETAG_LEN_MAX + 1];
+  size_t        pages;
+  struct string payload;
+};
+
+IMPLEMENT_VEC(struct esi_cache_entry, esi_cache_entry)
+
+struct esi_cache_entry_vec esi_cache = { .cap = 512 };
+mutex_t                    esi_cache_mu = MUTEX_INIT;
+
+// WARN: esi_cache_mu must be locked
+struct esi_cache_entry *esi_cache_find(struct string uri) {
+  for (size_t i = 0; i < esi_cache.len; ++i) {
+    if (string_cmp(esi_cache.buf[i].uri, uri) == 0) {
+      return esi_cache.buf + i;
+    }
+  }
+  return NULL;
+}
+
+// copy the etag of uri to `etag`, returns E_NOT_FOUND if uri is not cached
+err_t esi_cache_get_etag(struct string uri, char etag[ESI_ETAG_LEN_MAX + 1]) {
+  mutex_lock(&esi_cache_mu, 5);
+  struct esi_cache_entry *entry = esi_cache_find(uri);
+  if (entry != NULL) {
+    strcpy(etag, entry->etag);
+  }
+  mutex_unlock(&esi_cache_mu);
+  return entry == NULL ? E_NOT_FOUND : E_OK;
+}
+
+// payload and uri are copied
+err_t esi_cache_put(struct string uri, const char *etag, size_t pages,
+                    struct string payload) {
+  assert(etag != NULL);
+  if (etag[0] == '\0') {
+    return E_OK;  // nothing to validate the payload with
+  }
+  assert(strlen(etag) <= ESI_ETAG_LEN_MAX);
+
+  struct string payload_cpy;
+  err_t err = string_alloc_cpy(&payload_cpy, payload);
+  if (err != E_OK) {
+    errmsg_prefix("string_alloc_cpy: ");
+    return E_ERR;
+  }
+
+  mutex_lock(&esi_cache_mu, 5);
+  struct esi_cache_entry *entry = esi_cache_find(uri);
+  if (entry == NULL) {
+    struct string uri_cpy;
+    err = string_alloc_cpy(&uri_cpy, uri);
+    if (err == E_OK) {
+      err = esi_cache_entry_vec_push(&esi_cache, (struct esi_cache_entry) { .uri = uri_cpy });
+      if (err != E_OK) string_destroy(&uri_cpy);
+    }
+    if (err != E_OK) {
+      mutex_unlock(&esi_cache_mu);
+      string_destroy(&payload_cpy);
+      errmsg_prefix("string_alloc_cpy/esi_cache_entry_vec_push: ");
+      return E_ERR;
+    }
+    entry = esi_cache.buf + esi_cache.len - 1;
+  }
+  string_destroy(&entry->payload);
+  entry->payload = payload_cpy;
+  entry->pages = pages;
+  strcpy(entry->etag, etag);
+  mutex_unlock(&esi_cache_mu);
+  return E_OK;
+}
+
+// Fill a 304 response with the cached payload of uri. The payload is copied
+// to response->body and response->pages is taken from the cache if esi did
+// not send it again.
+err_t esi_cache_load(struct string uri, struct esi_response *response) {
+  assert(response != NULL);
+  mutex_lock(&esi_cache_mu, 5);
+  struct esi_cache_entry *entry = esi_cache_find(uri);
+  if (entry == NULL) {
+    mutex_unlock(&esi_cache_mu);
+    errmsg_fmt("no cache entry for %.*s", (int) uri.len, uri.buf);
+    return E_NOT_FOUND;
+  }
+  err_t err = string_alloc_cpy(&response->body, entry->payload);
+  if (response->pages == 0) {
+    response->pages = entry->pages;
+  }
+  mutex_unlock(&esi_cache_mu);
+  if (err != E_OK) {
+    errmsg_prefix("string_alloc_cpy: ");
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+// Concurrent requests
+//
+// An esi_multi performs up to `cap` esi_request at the same time on a single
+// thread. Retries and esi timeouts are handled the same way as in
+// esi_perform_request so that a finished request is either a success or
+// definitely failed.
+//
+// The thread never sleeps on the governor while requests are in flight:
+// requests are only added once esi_governor_try_acquire lets them through and
+// retries are held in the multi until it does, the time left is spent polling
+// the transfers in flight.
+
+struct esi_request {
+  CURL *handle;
+  FILE *body_file;
+  struct esi_corpus_key key;  // copy of the request, used by the corpus
+  double replay_ready_at;     // monotonic time at which a replayed request is done
+  double held_at;             // monotonic time at which a retry was held by the governor
+  struct curl_slist *header_list;
+  struct string cache_uri;  // set if the request uses the esi cache
+  struct esi_response response;
+  int trails;
+  err_t err;   // outcome of the request, set by esi_multi_next
+  void *data;  // left to the caller
+};
+
+err_t esi_request_create(struct esi_request *req) {
+  assert(req != NULL);
+  CURL *handle = esi_handle_create();
+  if (handle == NULL) {
+    errmsg_fmt("curl_easy_init: damn");
+    return E_ERR;
+  }
+  *req = (struct esi_request) { .handle = handle };
+  return E_OK;
+}
+
+void esi_request_destroy(struct esi_request *req) {
+  assert(req != NULL);
+  if (req->body_file != NULL) fclose(req->body_file);
+  if (req->handle != NULL) curl_easy_cleanup(req->handle);
+  curl_slist_free_all(req->header_list);
+  string_destroy(&req->cache_uri);
+  string_destroy(&req->key.method);
+  string_destroy(&req->key.uri);
+  string_destroy(&req->key.body);
+  esi_response_destroy(&req->response);
+  *req = (struct esi_request) {0};
+}
+
+// The request is not sent until it is added to an esi_multi
+err_t esi_request_prepare(struct esi_request *req, struct string method,
+                          struct string uri, struct string body,
+                          bool authenticated, int trails) {
+  assert(req != NULL);
+  assert(req->handle != NULL);
+  assert(req->body_file == NULL);
+  assert(trails > 0);
+
+  string_destroy(&req->key.method);
+  string_destroy(&req->key.uri);
+  string_destroy(&req->key.body);
+  err_t err = E_OK;
+  if (err == E_OK) err = string_alloc_cpy(&req->key.method, method);
+  if (err == E_OK) err = string_alloc_cpy(&req->key.uri, uri);
+  if (err == E_OK) err = string_alloc_cpy(&req->key.body, body);
+  if (err != E_OK) {
+    errmsg_prefix("string_alloc_cpy: ");
+    return E_ERR;
+  }
+
+  // a replayed request never reaches curl
+  if (esi_corpus_mode != ESI_CORPUS_REPLAY) {
+    err = esi_build_request(req->handle, method, uri, body, authenticated);
+    if (err != E_OK) {
+      errmsg_prefix("esi_build_request: ");
+      return E_ERR;
+    }
+  }
+  CURLcode rv = curl_easy_setopt(req->handle, CURLOPT_TIMEOUT, ESI_REQUEST_TIMEOUT);
+  if (rv != CURLE_OK) {
+    errmsg_fmt("CURLOPT_TIMEOUT error: %s", curl_easy_strerror(rv));
+    return E_ERR;
+  }
+  rv = curl_easy_setopt(req->handle, CURLOPT_PRIVATE, req);
+  if (rv != CURLE_OK) {
+    errmsg_fmt("CURLOPT_PRIVATE error: %s", curl_easy_strerror(rv));
+    return E_ERR;
+  }
+  curl_slist_free_all(req->header_list);
+  req->header_list = NULL;
+  string_destroy(&req->cache_uri);
+  esi_response_destroy(&req->response);
+  req->response = (struct esi_response) {0};
+  req->trails = trails;
+  req->err = E_ERR;
+  return E_OK;
+}
+
+// Make a prepared request conditional on the ETag cached for `uri`. If esi
+// answers with a 304, the response code is kept to 304 and the response body
+// is the payload stored with esi_request_cache_store.
+err_t esi_request_use_cache(struct esi_request *req, struct string uri) {
+  assert(req != NULL);
+  assert(req->cache_uri.buf == NULL);
+
+  err_t err = string_alloc_cpy(&req->cache_uri, uri);
+  if (err != E_OK) {
+    errmsg_prefix("string_alloc_cpy: ");
+    return E_ERR;
+  }
+
+  char etag[ESI_ETAG_LEN_MAX + 1];
+  err = esi_cache_get_etag(uri, etag);
+  if (err == E_NOT_FOUND) {
+    return E_OK;
+  }
+
+  const size_t HEADER_LEN_MAX = ESI_ETAG_LEN_MAX + 32;
+  char header[HEADER_LEN_MAX];
+  snprintf(header, HEADER_LEN_MAX, "If-None-Match: %s", etag);
+  struct curl_slist *header_list = curl_slist_append(req->header_list, header);
+  if (header_list == NULL) {
+    errmsg_fmt("curl_slist_append: damn");
+    return E_ERR;
+  }
+  req->header_list = header_list;
+  CURLcode rv = curl_easy_setopt(req->handle, CURLOPT_HTTPHEADER, req->header_list);
+  if (rv != CURLE_OK) {
+    errmsg_fmt("CURLOPT_HTTPHEADER error: %s", curl_easy_strerror(rv));
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+// store `payload` as the content validated by the ETag of the response
+err_t esi_request_cache_store(struct esi_request *req, struct string payload) {
+  assert(req != NULL);
+  assert(req->cache_uri.buf != NULL);
+  assert(req->response.code == 200);
+  return esi_cache_put(req->cache_uri, req->response.etag, req->response.pages,
+                       payload);
+}
+
+// reset the response and open a new body memstream
+err_t esi_request_start(struct esi_request *req) {
+  assert(req != NULL);
+  assert(req->body_file == NULL);
+  esi_response_destroy(&req->response);
+  req->response = (struct esi_response) {0};
+
+  req->body_file = open_memstream(&req->response.body.buf, &req->response.body.len);
+  if (req->body_file == NULL) {
+    errmsg_fmt("open_memstream: %s", strerror(errno));
+    return E_ERR;
+  }
+  CURLcode rv = curl_easy_setopt(req->handle, CURLOPT_WRITEDATA, req->body_file);
+  if (rv != CURLE_OK) {
+    errmsg_fmt("CURLOPT_WRITEDATA error: %s", curl_easy_strerror(rv));
+    fclose(req->body_file);
+    req->body_file = NULL;
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+struct esi_multi {
+  CURLM *handle;
+  size_t len;  // number of requests in flight, held retries included
+  size_t cap;  // maximum number of requests in flight
+  struct esi_request **replayed;  // requests in flight in replay mode
+  size_t replayed_len;
+  struct esi_request **held;  // retries waiting for the governor
+  size_t held_len;
+};
+
+err_t esi_multi_create(struct esi_multi *multi, size_t cap) {
+  assert(multi != NULL);
+  assert(cap >= 1 && cap <= ESI_CONCURRENCY_MAX);
+  CURLM *handle = curl_multi_init();
+  if (handle == NULL) {
+    errmsg_fmt("curl_multi_init: damn");
+    return E_ERR;
+  }
+  CURLMcode mrv = curl_multi_setopt(handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  if (mrv != CURLM_OK) {
+    errmsg_fmt("CURLMOPT_PIPELINING error: %s", curl_multi_strerror(mrv));
+    curl_multi_cleanup(handle);
+    return E_ERR;
+  }
+  struct esi_request **replayed = calloc(cap, sizeof(struct esi_request *));
+  struct esi_request **held = calloc(cap, sizeof(struct esi_request *));
+  if (replayed == NULL || held == NULL) {
+    errmsg_fmt("calloc: %s", strerror(errno));
+    free(replayed);
+    free(held);
+    curl_multi_cleanup(handle);
+    return E_ERR;
+  }
+  *multi = (struct esi_multi) {
+    .handle = handle,
+    .len = 0,
+    .cap = cap,
+    .replayed = replayed,
+    .replayed_len = 0,
+    .held = held,
+    .held_len = 0,
+  };
+  return E_OK;
+}
+
+// WARN: requests still in flight must be aborted beforehand
+void esi_multi_destroy(struct esi_multi *multi) {
+  assert(multi != NULL);
+  if (multi->handle != NULL) curl_multi_cleanup(multi->handle);
+  free(multi->replayed);
+  free(multi->held);
+  *multi = (struct esi_multi) {0};
+}
+
+// The multi is full once it holds `cap` requests or as many requests as the
+// concurrency window of the governor allows
+bool esi_multi_is_full(const struct esi_multi *multi) {
+  assert(multi != NULL);
+  size_t concurrency = esi_governor_state_get().concurrency;
+  return multi->len >= multi->cap || multi->len >= concurrency;
+}
+
+// send a request the governor let through
+err_t esi_multi_start(struct esi_multi *multi, struct esi_request *req) {
+  err_t err = esi_request_start(req);
+  if (err != E_OK) {
+    errmsg_prefix("esi_request_start: ");
+    return E_ERR;
+  }
+
+  if (esi_corpus_mode == ESI_CORPUS_REPLAY) {
+    req->replay_ready_at = esi_now() + esi_replay_latency_ms / 1e3;
+    multi->replayed[multi->replayed_len++] = req;
+    multi->len += 1;
+    return E_OK;
+  }
+
+  CURLMcode mrv = curl_multi_add_handle(multi->handle, req->handle);
+  if (mrv != CURLM_OK) {
+    errmsg_fmt("curl_multi_add_handle: %s", curl_multi_strerror(mrv));
+    fclose(req->body_file);
+    req->body_file = NULL;
+    return E_ERR;
+  }
+  multi->len += 1;
+  return E_OK;
+}
+
+// req must have been prepared with esi_request_prepare and let through by
+// esi_governor_try_acquire
+err_t esi_multi_add(struct esi_multi *multi, struct esi_request *req) {
+  assert(multi != NULL);
+  assert(req != NULL);
+  // NOTE: the governor window is not checked so that a request in flight can
+  // always be retried, even if the window shrunk in the meantime
+  if (multi->len >= multi->cap) {
+    errmsg_fmt("esi_multi is full");
+    return E_FULL;
+  }
+  return esi_multi_start(multi, req);
+}
+
+// remove a request in flight from the multi handle
+void esi_multi_abort(struct esi_multi *multi, struct esi_request *req) {
+  assert(multi != NULL);
+  assert(req != NULL);
+  for (size_t i = 0; i < multi->held_len; ++i) {
+    if (multi->held[i] == req) {
+      multi->held[i] = multi->held[--multi->held_len];
+      multi->len -= 1;
+      return;
+    }
+  }
+  if (esi_corpus_mode == ESI_CORPUS_REPLAY) {
+    for (size_t i = 0; i < multi->replayed_len; ++i) {
+      if (multi->replayed[i] == req) {
+        multi->replayed[i] = multi->replayed[--multi->replayed_len];
+        break;
+      }
+    }
+  } else {
+    CURLMcode mrv = curl_multi_remove_handle(multi->handle, req->handle);
+    if (mrv != CURLM_OK) {
+      log_warn("curl_multi_remove_handle: %s", curl_multi_strerror(mrv));
+    }
+  }
+  multi->len -= 1;
+}
+
+// Answer a started request from the corpus
+// Returns the outcome of the request, as esi_multi_next sees it
+err_t esi_multi_replay(struct esi_request *req) {
+  struct esi_response recorded;
+  err_t err = esi_corpus_replay(req->key, &recorded);
+  if (err != E_OK) {
+    fclose(req->body_file);
+    req->body_file = NULL;
+  }
+  if (err == E_NOT_FOUND) {
+    return E_ESI_ERR;
+  } else if (err != E_OK) {
+    errmsg_prefix("esi_corpus_replay: ");
+    return E_ERR;
+  }
+  struct esi_transfer transfer = {
+    .total_us = esi_replay_latency_ms * 1000,
+    .bytes = recorded.body.len,
+  };
+  esi_stats_record(esi_endpoint_of(req->key.uri), recorded.code, transfer);
+
+  if (recorded.body.len > 0) {
+    fwrite(recorded.body.buf, 1, recorded.body.len, req->body_file);
+  }
+  fclose(req->body_file);  // flushes `req->response.body`
+  req->body_file = NULL;
+
+  struct string body = req->response.body;
+  esi_response_destroy(&recorded);
+  req->response = recorded;
+  req->response.body = body;
+  return esi_check_response(&req->response);
+}
+
+// Wait for the next replayed request to be done
+struct esi_request *esi_multi_next_replayed(struct esi_multi *multi) {
+  assert(multi->replayed_len > 0);
+  size_t first = 0;
+  for (size_t i = 1; i < multi->replayed_len; ++i) {
+    if (multi->replayed[i]->replay_ready_at < multi->replayed[first]->replay_ready_at) {
+      first = i;
+    }
+  }
+  struct esi_request *done = multi->replayed[first];
+  multi->replayed[first] = multi->replayed[--multi->replayed_len];
+  esi_sleep(done->replay_ready_at - esi_now());
+  return done;
+}
+
+// Send the held retries the governor lets through. A retry that could not be
+// sent is returned in `failed` with the error message left in errmsg.
+// Returns the time to wait before the next held retry can be sent
+double esi_multi_release(struct esi_multi *multi, struct esi_request **failed) {
+  *failed = NULL;
+  while (multi->held_len > 0) {
+    double wait_secs = esi_governor_try_acquire();
+    if (wait_secs > 0) return wait_secs;
+
+    struct esi_request *req = multi->held[--multi->held_len];
+    multi->len -= 1;
+    esi_stats_record_wait(esi_endpoint_of(req->key.uri), esi_now() - req->held_at);
+    err_t err = esi_multi_start(multi, req);
+    if (err != E_OK) {
+      errmsg_prefix("esi_multi_start: ");
+      *failed = req;
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// Wait for one of the requests in flight to be done and return it in `req`,
+// for at most `wait_secs` if it is not 0. Callers held by the governor pass
+// the time esi_governor_try_acquire asked them to wait.
+// The outcome of the request is stored in (*req)->err and the error message
+// of a failed request is left in errmsg.
+// Returns E_EMPTY if there is no request in flight, once `wait_secs` are
+// slept, or if no request was done in time.
+err_t esi_multi_next(struct esi_multi *multi, struct esi_request **req, double wait_secs) {
+  assert(multi != NULL);
+  assert(req != NULL);
+  assert(wait_secs >= 0);
+
+  if (multi->len == 0) {
+    esi_sleep(wait_secs);  // no transfer is held up
+    return E_EMPTY;
+  }
+  double deadline = wait_secs > 0 ? esi_now() + wait_secs : 0;
+
+  while (true) {
+    struct esi_request *done;
+    err_t err;
+
+    double held_secs = esi_multi_release(multi, &done);
+    if (done != NULL) {
+      err = E_ERR;
+    } else if (esi_corpus_mode == ESI_CORPUS_REPLAY) {
+      if (multi->replayed_len == 0) {
+        // only held retries are left, no transfer is held up
+        double sleep_secs = held_secs;
+        if (deadline > 0 && deadline - esi_now() < sleep_secs) {
+          sleep_secs = deadline - esi_now();
+        }
+        esi_sleep(sleep_secs);
+        if (deadline > 0 && esi_now() >= deadline) {
+          return E_EMPTY;
+        }
+        continue;
+      }
+      done = esi_multi_next_replayed(multi);
+      multi->len -= 1;
+      done->trails -= 1;
+      err = esi_multi_replay(done);
+    } else {
+      int running;
+      CURLMcode mrv = curl_multi_perform(multi->handle, &running);
+      if (mrv != CURLM_OK) {
+        errmsg_fmt("curl_multi_perform: %s", curl_multi_strerror(mrv));
+        return E_ERR;
+      }
+
+      int msgs_left;
+      CURLMsg *msg = curl_multi_info_read(multi->handle, &msgs_left);
+      if (msg == NULL || msg->msg != CURLMSG_DONE) {
+        // poll until the held retries or the caller can be let through
+        double timeout_secs = 1;
+        if (held_secs > 0 && held_secs < timeout_secs) {
+          timeout_secs = held_secs;
+        }
+        if (deadline > 0) {
+          double left_secs = deadline - esi_now();
+          if (left_secs <= 0) {
+            return E_EMPTY;
+          }
+          if (left_secs < timeout_secs) timeout_secs = left_secs;
+        }
+        int timeout_ms = (int) (timeout_secs * 1e3);
+        if (timeout_ms < 1) timeout_ms = 1;
+        mrv = curl_multi_poll(multi->handle, NULL, 0, timeout_ms, NULL);
+        if (mrv != CURLM_OK) {
+          errmsg_fmt("curl_multi_poll: %s", curl_multi_strerror(mrv));
+          return E_ERR;
+        }
+        continue;
+      }
+
+      CURLcode rv = curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &done);
+      if (rv != CURLE_OK) {
+        errmsg_fmt("CURLINFO_PRIVATE error: %s", curl_easy_strerror(rv));
+        return E_ERR;
+      }
+      CURLcode result = msg->data.result;  // msg is freed by remove_handle
+      mrv = curl_multi_remove_handle(multi->handle, done->handle);
+      if (mrv != CURLM_OK) {
+        errmsg_fmt("curl_multi_remove_handle: %s", curl_multi_strerror(mrv));
+        return E_ERR;
+      }
+      multi->len -= 1;
+      fclose(done->body_file);  // flushes `done->response.body`
+      done->body_file = NULL;
+      done->trails -= 1;
+
+      if (result != CURLE_OK) {
+        errmsg_fmt("curl: %s", curl_easy_strerror(result));
+        esi_stats_record(esi_endpoint_of(done->key.uri), 0, esi_transfer_get(done->handle));
+        esi_governor_feedback(true);
+        err = E_ESI_RETRY;
+      } else {
+        err = esi_read_response(done->handle, &done->response);
+        esi_stats_record(esi_endpoint_of(done->key.uri), err == E_OK ? done->response.code : 0,
+                         esi_transfer_get(done->handle));
+        if (err == E_OK && esi_corpus_mode == ESI_CORPUS_RECORD) {
+          esi_corpus_record(done->key, &done->response);
+        }
+        if (err == E_OK) {
+          err = esi_check_response(&done->response);
+        }
+      }
+    }
+
+    if (err == E_OK && done->response.code == 304) {
+      assert(done->cache_uri.buf != NULL);
+      string_destroy(&done->response.body);
+      err = esi_cache_load(done->cache_uri, &done->response);
+      if (err != E_OK) {
+        errmsg_prefix("esi_cache_load: ");
+        err = E_ERR;
+      }
+    }
+
+    if (err == E_ESI_RETRY && done->trails > 0) {
+      // sent again once the governor lets it through, see esi_multi_release
+      esi_stats_record_retry(esi_endpoint_of(done->key.uri));
+      assert(multi->held_len < multi->cap);
+      done->held_at = esi_now();
+      multi->held[multi->held_len++] = done;
+      multi->len += 1;
+      continue;
+    } else if (err == E_ESI_RETRY) {
+      errmsg_prefix("out of trails: ");
+    }
+
+    if (err != E_OK) string_destroy(&done->response.body);
+    done->err = err;
+    *req = done;
+    return E_OK;
+  }
+}
@@ -127,37 +127,120 @@ struct history_day *history_day_vec_get_by_date(struct history_day_vec *vec,
   return NULL;
 }
 
-// market_vec should already be initialized
+// Append the distinct markets of `table` to `market_vec`, in one pass
+// market_vec is empty on error
 err_t get_active_markets(struct history_market_vec *market_vec,
-                         struct order_vec *order_vec) {
+                         const struct order_table *table) {
   assert(market_vec != NULL);
-  assert(order_vec != NULL);
+  assert(table != NULL);
 
-  // fuck big O
-  for (size_t i = 0; i < order_vec->len; ++i) {
+  struct uint64_vec key_vec = { .cap = 1024 };
+  err_t err = order_fill_market_key_vec(&key_vec, table);
+  if (err != E_OK) {
+    errmsg_prefix("order_fill_market_key_vec: ");
+    market_vec->len = 0;
+    return E_ERR;
+  }
+  for (size_t i = 0; i < key_vec.len; ++i) {
     struct history_market market = {
-      .region_id = order_vec->buf[i].region_id,
-      .type_id = order_vec->buf[i].type_id,
+      .region_id = order_market_key_region_id(key_vec.buf[i]),
+      .type_id = order_market_key_type_id(key_vec.buf[i]),
     };
-    size_t j;
-    for (j = 0; j < market_vec->len; ++j) {
-      if (
-        market_vec->buf[j].type_id == market.type_id &&
-        market_vec->buf[j].region_id == market.region_id
-      ) {
-        break;
-      }
-    }
-    if (j >= market_vec->len) {
-      err_t err = history_market_vec_push(market_vec, market);
-      if (err != E_OK) {
-        errmsg_prefix("history_market_vec_push: ");
-        market_vec->len = 0;
-        return E_ERR;
-      }
+    err = history_market_vec_push(market_vec, market);
+    if (err != E_OK) {
+      errmsg_prefix("history_market_vec_push: ");
+      market_vec->len = 0;
+      break;
     }
   }
+  uint64_vec_destroy(&key_vec);
+  return err;
+}
 
+// Parse one element of an esi history array
+err_t history_parse_bit(struct history_bit *bit, json_t *json_day, struct history_market market) {
+  assert(bit != NULL);
+  if (!json_is_object(json_day)) {
+    errmsg_fmt("json error: json_day is not an object");
+    return E_ERR;
+  }
+
+  json_t *json_average = json_object_get(json_day, "average");
+  if (!json_is_real(json_average)) {
+    errmsg_fmt("json error: json_average is not a real");
+    return E_ERR;
+  }
+  json_t *json_highest = json_object_get(json_day, "highest");
+  if (!json_is_real(json_highest)) {
+    errmsg_fmt("json error: json_highest is not a real");
+    return E_ERR;
+  }
+  json_t *json_lowest = json_object_get(json_day, "lowest");
+  if (!json_is_real(json_lowest)) {
+    errmsg_fmt("json error: json_lowest is not a real");
+    return E_ERR;
+  }
+  json_t *json_order_count = json_object_get(json_day, "order_count");
+  if (!json_is_integer(json_order_count)) {
+    errmsg_fmt("json error: json_order_count is not an integer");
+    return E_ERR;
+  }
+  json_t *json_volume = json_object_get(json_day, "volume");
+  if (!json_is_integer(json_volume)) {
+    errmsg_fmt("json error: json_volume is not an integer");
+    return E_ERR;
+  }
+  json_t *json_date = json_object_get(json_day, "date");
+  if (!json_is_string(json_date)) {
+    errmsg_fmt("json error: json_date is not a string");
+    return E_ERR;
+  }
+
+  json_int_t order_count = json_integer_value(json_order_count);
+  if (order_count < 0 || order_count > UINT64_MAX) {
+    errmsg_fmt("json error: order_count is out of range");
+    return E_ERR;
+  }
+  json_int_t volume = json_integer_value(json_volume);
+  if (volume < 0 || volume > UINT64_MAX) {
+    errmsg_fmt("json error: volume is out of range");
+    return E_ERR;
+  }
+
+  struct date date;
+  err_t err = date_parse(string_new((char *) json_string_value(json_date)), &date);
+  if (err != E_OK) {
+    errmsg_prefix("date_parse: ");
+    return E_ERR;
+  }
+
+  *bit = (struct history_bit) {
+    .date = date,
+    .market = market,
+    .stats = {
+      .average = json_real_value(json_average),
+      .highest = json_real_value(json_highest),
+      .lowest = json_real_value(json_lowest),
+      .order_count = order_count,
+      .volume = volume,
+    },
+  };
+  return E_OK;
+}
+
+err_t history_parse_root(json_t **root, struct string raw_json) {
+  json_error_t json_err;
+  *root = json_loadb(raw_json.buf, raw_json.len, 0, &json_err);
+  if (*root == NULL) {
+    errmsg_fmt("json error on line %d: %s", json_err.line, json_err.text);
+    return E_ERR;
+  }
+  if (!json_is_array(*root)) {
+    errmsg_fmt("json error: root is not an array");
+    json_decref(*root);
+    *root = NULL;
+    return E_ERR;
+  }
   return E_OK;
 }
 
@@ -165,175 +248,512 @@ err_t history_parse(struct history_bit_vec *bit_vec, struct string raw_json,
                     struct history_market market) {
   assert(bit_vec != NULL);
 
-  err_t res = E_ERR;
   size_t bit_vec_initial_len = bit_vec->len;
   json_t *root;
-
-  json_error_t json_err;
-  root = json_loadb(raw_json.buf, raw_json.len, 0, &json_err);
-  if (root == NULL) {
-    errmsg_fmt("json error on line %d: %s", json_err.line, json_err.text);
-    goto cleanup;
-  }
-  if (!json_is_array(root)) {
-    errmsg_fmt("json error: root is not an array");
-    goto cleanup;
-  }
+  err_t err = history_parse_root(&root, raw_json);
+  if (err != E_OK) return E_ERR;
 
   for (size_t i = 0; i < json_array_size(root); ++i) {
-    json_t *json_day = json_array_get(root, i);
-    if (!json_is_object(json_day)) {
-      errmsg_fmt("json error: json_day is not an object");
-      goto cleanup;
+    struct history_bit bit;
+    err = history_parse_bit(&bit, json_array_get(root, i), market);
+    if (err != E_OK) break;
+    err = history_bit_vec_push(bit_vec, bit);
+    if (err != E_OK) {
+      errmsg_prefix("history_bit_vec_push: ");
+      break;
     }
+  }
 
-    json_t *json_average = json_object_get(json_day, "average");
-    if (!json_is_real(json_average)) {
-      errmsg_fmt("json error: json_average is not a real");
-      goto cleanup;
-    }
-    json_t *json_highest = json_object_get(json_day, "highest");
-    if (!json_is_real(json_highest)) {
-      errmsg_fmt("json error: json_highest is not a real");
-      goto cleanup;
-    }
-    json_t *json_lowest = json_object_get(json_day, "lowest");
-    if (!json_is_real(json_lowest)) {
-      errmsg_fmt("json error: json_lowest is not a real");
-      goto cleanup;
-    }
-    json_t *json_order_count = json_object_get(json_day, "order_count");
-    if (!json_is_integer(json_order_count)) {
-      errmsg_fmt("json error: json_order_count is not an integer");
-      goto cleanup;
-    }
-    json_t *json_volume = json_object_get(json_day, "volume");
-    if (!json_is_integer(json_volume)) {
-      errmsg_fmt("json error: json_volume is not an integer");
-      goto cleanup;
-    }
-    json_t *json_date = json_object_get(json_day, "date");
-    if (!json_is_string(json_date)) {
-      errmsg_fmt("json error: json_date is not a string");
-      goto cleanup;
-    }
+  if (err != E_OK) bit_vec->len = bit_vec_initial_len;
+  json_decref(root);
+  return err;
+}
 
-    json_int_t order_count = json_integer_value(json_order_count);
-    if (order_count < 0 || order_count > UINT64_MAX) {
-      errmsg_fmt("json error: order_count is out of range");
-      goto cleanup;
-    }
-    json_int_t volume = json_integer_value(json_volume);
-    if (volume < 0 || volume > UINT64_MAX) {
-      errmsg_fmt("json error: volume is out of range");
-      goto cleanup;
-    }
+// Append to `bit_vec` the bit of `day` only, if the market was traded that
+// day. esi history arrays are sorted by date so the array is scanned from its
+// tail, for the latest days only the last few elements are decoded.
+err_t history_parse_day(struct history_bit_vec *bit_vec, struct string raw_json,
+                        struct history_market market, struct date day) {
+  assert(bit_vec != NULL);
 
-    struct date date;
-    err_t err = date_parse(ESI_DATE, json_string_value(json_date), &date);
-    if (err != E_OK) {
-      errmsg_prefix("date_parse: ");
-      goto cleanup;
+  json_t *root;
+  err_t err = history_parse_root(&root, raw_json);
+  if (err != E_OK) return E_ERR;
+
+  for (size_t i = json_array_size(root); i > 0; --i) {
+    struct history_bit bit;
+    err = history_parse_bit(&bit, json_array_get(root, i - 1), market);
+    if (err != E_OK) break;
+    if (date_is_after(bit.date, day)) continue;
+    if (date_is_equal(bit.date, day)) {
+      err = history_bit_vec_push(bit_vec, bit);
+      if (err != E_OK) errmsg_prefix("history_bit_vec_push: ");
     }
+    break;
+  }
 
-    struct history_bit bit = {
-      .date = date,
-      .market = market,
-      .stats = {
-        .average = json_real_value(json_average),
-        .highest = json_real_value(json_highest),
-        .lowest = json_real_value(json_lowest),
-        .order_count = order_count,
-        .volume = volume,
-      },
-    };
-    err = history_bit_vec_push(bit_vec, bit);
-    if (err != E_OK) {
-      errmsg_prefix("history_bit_vec_push: ");
-      goto cleanup;
+  json_decref(root);
+  return err;
+}
+
+// Negative cache of the markets without history
+//
+// esi answers 400 or 404 to the history of a market that has none, those
+// answers spend the esi error budget. Such markets are remembered until their
+// entry expires, then asked again. The cache is kept in a dump, see
+// history_negative_cache_save.
+
+const time_t HISTORY_NEGATIVE_TTL = 7 * TIME_DAY;
+
+struct history_negative_cache {
+  struct uint64_int64_map expires;  // market key -> expiry, 0 once forgotten
+  bool dirty;                       // changed since it was loaded or saved
+};
+
+uint64_t history_market_key(struct history_market market) {
+  return order_market_key(market.region_id, market.type_id);
+}
+
+void history_negative_cache_destroy(struct history_negative_cache *cache) {
+  assert(cache != NULL);
+  uint64_int64_map_destroy(&cache->expires);
+  *cache = (struct history_negative_cache) {0};
+}
+
+// Whether `market` is known to have no history at `now`
+bool history_negative_cache_has(const struct history_negative_cache *cache,
+                                struct history_market market, time_t now) {
+  assert(cache != NULL);
+  int64_t expires;
+  err_t err = uint64_int64_map_get(&cache->expires, history_market_key(market), &expires);
+  return err == E_OK && now < expires;
+}
+
+err_t history_negative_cache_put(struct history_negative_cache *cache,
+                                 struct history_market market, time_t expires) {
+  assert(cache != NULL);
+  err_t err = uint64_int64_map_put(&cache->expires, history_market_key(market), expires);
+  if (err != E_OK) {
+    errmsg_prefix("uint64_int64_map_put: ");
+    return E_ERR;
+  }
+  cache->dirty = true;
+  return E_OK;
+}
+
+// A market that has a history again
+void history_negative_cache_forget(struct history_negative_cache *cache,
+                                   struct history_market market) {
+  assert(cache != NULL);
+  uint64_t key = history_market_key(market);
+  if (uint64_int64_map_get(&cache->expires, key, NULL) != E_OK) return;
+  err_t err = uint64_int64_map_put(&cache->expires, key, 0);
+  assert(err == E_OK);  // the key is already there
+  cache->dirty = true;
+}
+
+// The entries that did not expire at `now` are written as a varint count
+// followed by (uint64 market key, int64 expiry) pairs
+err_t dump_write_history_negative_cache(struct dump *dump,
+                                        const struct history_negative_cache *cache, time_t now) {
+  assert(cache != NULL);
+  const struct uint64_int64_map *map = &cache->expires;
+  uint64_t len = 0;
+  for (size_t i = 0; i < map->cap && map->keys != NULL; ++i) {
+    if (map->keys[i] != 0 && now < map->vals[i]) len += 1;
+  }
+  if (dump_write_varint(dump, len) != E_OK) goto error;
+  for (size_t i = 0; i < map->cap && map->keys != NULL; ++i) {
+    if (map->keys[i] == 0 || now >= map->vals[i]) continue;
+    if (dump_write_uint64(dump, map->keys[i]) != E_OK) goto error;
+    if (dump_write_int64(dump, map->vals[i]) != E_OK) goto error;
+  }
+  return E_OK;
+
+error:
+  errmsg_prefix("dump_write: ");
+  return E_ERR;
+}
+
+// Expired entries are dropped
+err_t dump_read_history_negative_cache(struct dump *dump, struct history_negative_cache *cache,
+                                       time_t now) {
+  assert(cache != NULL);
+  uint64_t len;
+  if (dump_read_varint(dump, &len) != E_OK) goto error;
+  for (uint64_t i = 0; i < len; ++i) {
+    uint64_t key;
+    int64_t expires;
+    if (dump_read_uint64(dump, &key) != E_OK) goto error;
+    if (dump_read_int64(dump, &expires) != E_OK) goto error;
+    if (now >= expires) continue;
+    if (uint64_int64_map_put(&cache->expires, key, expires) != E_OK) {
+      errmsg_prefix("uint64_int64_map_put: ");
+      return E_ERR;
     }
   }
+  return E_OK;
 
-  res = E_OK;
+error:
+  errmsg_prefix("dump_read: ");
+  return E_ERR;
+}
 
-cleanup:
-  if (res != E_OK) bit_vec->len = bit_vec_initial_len;
-  json_decref(root);
-  return res;
+// Replace the dump at `path`, it is written next to it then renamed over so
+// that a crash never leaves a truncated cache
+err_t history_negative_cache_save(struct history_negative_cache *cache, struct string path,
+                                  time_t now) {
+  assert(cache != NULL);
+  char path_buf[DUMP_PATH_LEN_MAX];
+  char tmp_path_buf[DUMP_PATH_LEN_MAX];
+  string_null_terminate(path, path_buf, DUMP_PATH_LEN_MAX);
+  struct string tmp_path = string_fmt(tmp_path_buf, DUMP_PATH_LEN_MAX, "%s.tmp", path_buf);
+
+  struct dump dump;
+  err_t err = dump_open_write(&dump, tmp_path, DUMP_TYPE_INTERNAL, 0);
+  if (err != E_OK) {
+    errmsg_prefix("dump_open_write: ");
+    return E_ERR;
+  }
+  err = dump_write_history_negative_cache(&dump, cache, now);
+  if (err != E_OK) {
+    errmsg_prefix("dump_write_history_negative_cache: ");
+    dump_close_write(&dump);
+    return E_ERR;
+  }
+  err = dump_close_write(&dump);
+  if (err != E_OK) {
+    errmsg_prefix("dump_close_write: ");
+    return E_ERR;
+  }
+  if (rename(tmp_path_buf, path_buf) != 0) {
+    errmsg_fmt("rename %s: %s", tmp_path_buf, strerror(errno));
+    return E_ERR;
+  }
+  cache->dirty = false;
+  return E_OK;
 }
 
-err_t history_download(struct history_bit_vec *bit_vec,
-                       struct history_market market) {
-  assert(bit_vec != NULL);
+// Load the dump at `path` in an empty `cache`, a missing dump is an empty
+// cache. cache is empty on error.
+err_t history_negative_cache_load(struct history_negative_cache *cache, struct string path,
+                                  time_t now) {
+  assert(cache != NULL);
+  *cache = (struct history_negative_cache) {0};
+  if (!dump_does_exist(path)) return E_OK;
 
-  // log_print("download market (%" PRIu64 ", %" PRIu64 ")", market.region_id, market.type_id);
+  struct dump dump;
+  err_t err = dump_open_read(&dump, path);
+  if (err != E_OK) {
+    errmsg_prefix("dump_open_read: ");
+    return E_ERR;
+  }
+  err = dump_read_history_negative_cache(&dump, cache, now);
+  dump_close_read(&dump);
+  if (err != E_OK) {
+    history_negative_cache_destroy(cache);
+    errmsg_prefix("dump_read_history_negative_cache: ");
+    return E_ERR;
+  }
+  return E_OK;
+}
 
-  err_t res = E_ERR;
-  struct esi_response response = {0};
+// Concurrent download of the histories of many markets
+//
+// The histories are downloaded with up to `concurrency` requests in flight,
+// as far as the esi governor allows. A market whose request failed is put in
+// a retry queue and downloaded again after its own delay, that grows with each
+// attempt, while the other markets go on. A retry that would happen passed the
+// retry horizon of the download is given up on, so that a market that keeps
+// failing does not hold the download for hours.
+
+const size_t HISTORY_RETRY_MAX = 5;     // retries of a failed market before giving up
+const double HISTORY_RETRY_GROWTH = 3;  // growth of the retry delay at each retry
+
+// Receives the history of each market, `bit_vec` is reused afterwards
+struct history_listener {
+  err_t (*downloaded)(struct history_market market, const struct history_bit_vec *bit_vec,
+                      void *data);
+  void *data;
+};
+
+struct history_request {
+  struct esi_request esi;
+  size_t market_idx;
+  size_t tries;
+  bool busy;
+};
+
+// A failed market waiting for its next attempt
+struct history_retry {
+  size_t market_idx;
+  size_t tries;     // attempts so far
+  double ready_at;  // esi_now time of the next attempt
+};
+
+IMPLEMENT_VEC(struct history_retry, history_retry)
+
+struct history_download_stats {
+  size_t markets;
+  size_t known_empty;  // skipped thanks to the negative cache
+  size_t not_found;
+  size_t retried;
+  size_t failed;
+};
+
+err_t history_request_add(struct esi_multi *multi, struct history_request *req,
+                          const struct history_market *markets, size_t market_idx,
+                          size_t tries) {
+  assert(req != NULL);
+  assert(!req->busy);
 
   const size_t URI_LEN_MAX = 2048;
   char uri_buf[URI_LEN_MAX];
-  struct string uri = string_fmt(uri_buf, URI_LEN_MAX, 
+  struct history_market market = markets[market_idx];
+  struct string uri = string_fmt(uri_buf, URI_LEN_MAX,
                                  "/markets/%" PRIu64 "/history?type_id=%" PRIu64,
                                  market.region_id, market.type_id);
-  err_t err = esi_fetch(&response, string_new("GET"), uri, (struct string) {0},
-                        false, 5);
-  if (response.code == 400 || response.code == 404) {
-    res = E_NOT_FOUND;
-    errmsg_fmt("history (%" PRIu64 ", %" PRIu64 ") not found", market.region_id, market.type_id);
-    goto cleanup;
-  } else if (err != E_OK) {
-    errmsg_prefix("esi_fetch: ");
-    goto cleanup;
+  err_t err = esi_request_prepare(&req->esi, string_new("GET"), uri,
+                                  (struct string) {0}, false, 5);
+  if (err != E_OK) {
+    errmsg_prefix("esi_request_prepare: ");
+    return E_ERR;
   }
+  req->esi.data = req;
+  req->market_idx = market_idx;
+  req->tries = tries;
 
-  err = history_parse(bit_vec, response.body, market);
+  err = esi_multi_add(multi, &req->esi);
   if (err != E_OK) {
-    errmsg_prefix("history_parse: ");
+    errmsg_prefix("esi_multi_add: ");
+    return E_ERR;
+  }
+  req->busy = true;
+  return E_OK;
+}
+
+// Queue the retry of a failed market, returns false if it is out of retries
+// or if the retry would happen after `horizon_at` (esi_now time, 0 for none)
+bool history_retry_defer(struct history_retry_vec *retries, size_t market_idx,
+                         size_t tries, double retry_delay, double horizon_at, err_t *err) {
+  *err = E_OK;
+  if (tries > HISTORY_RETRY_MAX) return false;
+  double delay = retry_delay;
+  for (size_t i = 1; i < tries; ++i) delay *= HISTORY_RETRY_GROWTH;
+  struct history_retry retry = {
+    .market_idx = market_idx,
+    .tries = tries,
+    .ready_at = esi_now() + delay,
+  };
+  if (horizon_at > 0 && retry.ready_at > horizon_at) return false;
+  *err = history_retry_vec_push(retries, retry);
+  if (*err != E_OK) errmsg_prefix("history_retry_vec_push: ");
+  return true;
+}
+
+// Index in `retries` of the first retry due, SIZE_MAX if there is none
+size_t history_retry_next(const struct history_retry_vec *retries, double now) {
+  size_t next = SIZE_MAX;
+  for (size_t i = 0; i < retries->len; ++i) {
+    if (retries->buf[i].ready_at > now) continue;
+    if (next == SIZE_MAX || retries->buf[i].ready_at < retries->buf[next].ready_at) next = i;
+  }
+  return next;
+}
+
+// Download the history of every market of `markets` and hand it to
+// `listener`, whole or only the bit of `day` if its year is not 0 (see
+// history_parse_day). Markets without history (400 or 404) are skipped and put in
+// `negative` (can be NULL) for HISTORY_NEGATIVE_TTL, the markets it holds are
+// not downloaded. A market that
+// failed is tried again `retry_delay` seconds later, then with a delay growing
+// by HISTORY_RETRY_GROWTH, and skipped after HISTORY_RETRY_MAX retries or once
+// its retry would be more than `retry_horizon` seconds after the start of the
+// download (0 for no horizon).
+// Returns an error if the listener fails.
+err_t history_download_markets(const struct history_market *markets, size_t markets_len,
+                               struct date day, size_t concurrency, double retry_delay,
+                               double retry_horizon, struct history_negative_cache *negative,
+                               const struct history_listener *listener) {
+  assert(markets != NULL || markets_len == 0);
+  assert(concurrency >= 1 && concurrency <= ESI_CONCURRENCY_MAX);
+  assert(listener != NULL && listener->downloaded != NULL);
+
+  err_t res = E_ERR;
+  struct esi_multi multi = {0};
+  struct history_request *reqs = NULL;
+  struct history_retry_vec retries = { .cap = 64 };
+  struct history_bit_vec bit_vec = { .cap = 512 };
+  struct history_download_stats stats = { .markets = markets_len };
+  double horizon_at = retry_horizon > 0 ? esi_now() + retry_horizon : 0;
+  // WARN: do not call return passed this line, set `res` and goto cleanup
+
+  reqs = calloc(concurrency, sizeof(struct history_request));
+  if (reqs == NULL) {
+    errmsg_fmt("calloc: %s", strerror(errno));
     goto cleanup;
   }
+  for (size_t i = 0; i < concurrency; ++i) {
+    err_t err = esi_request_create(&reqs[i].esi);
+    if (err != E_OK) {
+      errmsg_prefix("esi_request_create: ");
+      goto cleanup;
+    }
+  }
+  err_t err = esi_multi_create(&multi, concurrency);
+  if (err != E_OK) {
+    errmsg_prefix("esi_multi_create: ");
+    goto cleanup;
+  }
+
+  size_t next_market = 0;
+  while (true) {
+    // fill up the free requests, due retries first, as far as the esi
+    // governor allows
+    double wait_secs = 0;
+    for (size_t i = 0; i < concurrency && !esi_multi_is_full(&multi); ++i) {
+      if (reqs[i].busy) continue;
+      while (next_market < markets_len && negative != NULL &&
+             history_negative_cache_has(negative, markets[next_market], time(NULL))) {
+        stats.known_empty += 1;
+        next_market += 1;
+      }
+      size_t retry_idx = history_retry_next(&retries, esi_now());
+      if (retry_idx == SIZE_MAX && next_market >= markets_len) break;
+      wait_secs = esi_governor_try_acquire();
+      if (wait_secs > 0) break;  // the requests in flight go on meanwhile
+
+      size_t market_idx, tries;
+      if (retry_idx != SIZE_MAX) {
+        market_idx = retries.buf[retry_idx].market_idx;
+        tries = retries.buf[retry_idx].tries;
+        retries.buf[retry_idx] = retries.buf[--retries.len];
+        stats.retried += 1;
+      } else {
+        market_idx = next_market++;
+        tries = 0;
+      }
+      err = history_request_add(&multi, reqs + i, markets, market_idx, tries + 1);
+      if (err != E_OK) {
+        errmsg_prefix("history_request_add: ");
+        goto cleanup;
+      }
+    }
+
+    struct esi_request *done;
+    err = esi_multi_next(&multi, &done, wait_secs);
+    if (err == E_EMPTY) {
+      // the governor held the markets left
+      if (next_market < markets_len || multi.len > 0) continue;
+      if (retries.len == 0) break;
+      // only deferred retries are left
+      double ready_at = retries.buf[0].ready_at;
+      for (size_t i = 1; i < retries.len; ++i) {
+        if (retries.buf[i].ready_at < ready_at) ready_at = retries.buf[i].ready_at;
+      }
+      esi_sleep(ready_at - esi_now());
+      continue;
+    } else if (err != E_OK) {
+      errmsg_prefix("esi_multi_next: ");
+      goto cleanup;
+    }
 
+    struct history_request *req = done->data;
+    struct history_market market = markets[req->market_idx];
+    req->busy = false;
+    if (done->err == E_OK) {
+      bit_vec.len = 0;
+      if (day.year == 0) {
+        err = history_parse(&bit_vec, done->response.body, market);
+        if (err != E_OK) errmsg_prefix("history_parse: ");
+      } else {
+        err = history_parse_day(&bit_vec, done->response.body, market, day);
+        if (err != E_OK) errmsg_prefix("history_parse_day: ");
+      }
+    } else {
+      err = done->err;
+    }
+    int code = done->response.code;
+    esi_response_destroy(&done->response);
+
+    if (err == E_OK) {
+      if (negative != NULL) history_negative_cache_forget(negative, market);
+      err = listener->downloaded(market, &bit_vec, listener->data);
+      if (err != E_OK) {
+        errmsg_prefix("history_listener: ");
+        goto cleanup;
+      }
+    } else if (code == 400 || code == 404) {
+      stats.not_found += 1;
+      if (negative != NULL) {
+        err = history_negative_cache_put(negative, market, time(NULL) + HISTORY_NEGATIVE_TTL);
+        if (err != E_OK) {
+          errmsg_prefix("history_negative_cache_put: ");
+          goto cleanup;
+        }
+      }
+    } else {
+      struct string msg = errmsg_get();
+      log_warn("history_download: history (%" PRIu64 ", %" PRIu64 ") failed: %.*s",
+               market.region_id, market.type_id, (int) msg.len, msg.buf);
+      if (!history_retry_defer(&retries, req->market_idx, req->tries, retry_delay,
+                               horizon_at, &err)) {
+        log_error("history_download: history (%" PRIu64 ", %" PRIu64 ") failed, out of trails",
+                  market.region_id, market.type_id);
+        stats.failed += 1;
+      } else if (err != E_OK) {
+        goto cleanup;
+      }
+    }
+  }
+
+  struct esi_governor_state governor = esi_governor_state_get();
+  log_print("history_download: %zu markets (%zu known empty, %zu not found, %zu failed), "
+            "%zu retries, esi concurrency %zu, esi error budget %ld", stats.markets,
+            stats.known_empty, stats.not_found, stats.failed, stats.retried,
+            governor.concurrency, governor.budget_remain);
   res = E_OK;
 
 cleanup:
-  esi_response_destroy(&response);
+  if (reqs != NULL) {
+    for (size_t i = 0; i < concurrency; ++i) {
+      if (reqs[i].busy) esi_multi_abort(&multi, &reqs[i].esi);
+      esi_request_destroy(&reqs[i].esi);
+    }
+  }
+  esi_multi_destroy(&multi);
+  free(reqs);
+  history_retry_vec_destroy(&retries);
+  history_bit_vec_destroy(&bit_vec);
   return res;
 }
 
-// market_vec should be initialized
+// Append the active markets of the regions to `market_vec`. The markets of
+// each region are indexed when its orders are downloaded (see
+// order_download_regions), a region's markets are distinct from the others'
+// since the region is part of the market.
+// market_vec is empty on error
 err_t order_fill_active_market_vec(struct history_market_vec *market_vec,
-                                   struct order_vec *order_vec) {
+                                   const struct order_region *regions, size_t regions_len) {
   assert(market_vec != NULL);
-  assert(order_vec != NULL);
-
-  // TODO: remove
-  time_t debug_start = time(NULL);
-
-  for (size_t i = 0; i < order_vec->len; ++i) {
-    size_t j;
-    for (j = 0; j < market_vec->len; ++j) {
-      if (
-        market_vec->buf[j].region_id == order_vec->buf[i].region_id &&
-        market_vec->buf[j].type_id == order_vec->buf[i].type_id
-      ) break;
-    }
-    if (j >= market_vec->len) {
+  assert(regions != NULL);
+
+  for (size_t i = 0; i < regions_len; ++i) {
+    const struct uint64_vec *keys = &regions[i].markets;
+    for (size_t j = 0; j < keys->len; ++j) {
       struct history_market market = {
-        .region_id = order_vec->buf[i].region_id,
-        .type_id = order_vec->buf[i].type_id,
+        .region_id = order_market_key_region_id(keys->buf[j]),
+        .type_id = order_market_key_type_id(keys->buf[j]),
       };
       err_t err = history_market_vec_push(market_vec, market);
       if (err != E_OK) {
         errmsg_prefix("history_market_vec_push: ");
+        market_vec->len = 0;
         return E_ERR;
       }
     }
   }
 
-  // TODO: remove
-  time_t debug_end = time(NULL);
-  log_print("DEBUG: order_fill_location_id_vec duration %d", debug_end - debug_start);
-
   return E_OK;
 }
 
@@ -509,3 +929,193 @@ err_t dump_read_history_bit_vec(struct dump *dump,
   return E_OK;
 }
 
+
+// Partitions history bits by day in a single pass. Each day has a bucket that
+// is spilled to its own file once it holds `bucket_cap` bits, or when the
+// buckets hold `total_cap` bits altogether, then each day is read back on its
+// own with history_spill_read_day.
+// NOTE: spill files are internal, bits are written as raw structs
+struct history_spill_bucket {
+  struct date date;
+  struct history_bit_vec bits;
+  bool spilled;  // the spill file of the day was created
+};
+
+IMPLEMENT_VEC(struct history_spill_bucket, history_spill_bucket)
+
+struct history_spill {
+  struct string path_prefix;
+  size_t bucket_cap;
+  size_t total_cap;
+  size_t total_len;  // bits buffered in the buckets
+  struct history_spill_bucket_vec buckets;
+  struct uint64_size_map index;  // date key -> bucket
+};
+
+uint64_t history_spill_date_key(struct date date) {
+  return (uint64_t) date.year << 16 | date.day;
+}
+
+struct string history_spill_path(struct history_spill *spill, struct date date,
+                                 char buf[DUMP_PATH_LEN_MAX]) {
+  return string_fmt(buf, DUMP_PATH_LEN_MAX, "%.*s-%" PRIu16 "-%" PRIu16,
+                    (int) spill->path_prefix.len, spill->path_prefix.buf, date.year, date.day);
+}
+
+void history_spill_init(struct history_spill *spill, struct string path_prefix,
+                        size_t bucket_cap, size_t total_cap) {
+  assert(spill != NULL);
+  assert(bucket_cap >= 1 && total_cap >= bucket_cap);
+  *spill = (struct history_spill) {
+    .path_prefix = path_prefix,
+    .bucket_cap = bucket_cap,
+    .total_cap = total_cap,
+    .buckets = { .cap = 512 },
+  };
+}
+
+// Append the bits buffered in `bucket` to the spill file of its day
+err_t history_spill_flush_bucket(struct history_spill *spill,
+                                 struct history_spill_bucket *bucket) {
+  if (bucket->bits.len == 0) return E_OK;
+  char path_buf[DUMP_PATH_LEN_MAX];
+  struct string path = history_spill_path(spill, bucket->date, path_buf);
+  // a spill file left by a previous run is truncated
+  FILE *file = fopen(path.buf, bucket->spilled ? "ab" : "wb");
+  if (file == NULL) {
+    errmsg_fmt("fopen %s: %s", path.buf, strerror(errno));
+    return E_ERR;
+  }
+  size_t written = fwrite(bucket->bits.buf, sizeof(struct history_bit), bucket->bits.len, file);
+  if (fclose(file) != 0 || written != bucket->bits.len) {
+    errmsg_fmt("fwrite/fclose %s: %s", path.buf, strerror(errno));
+    return E_ERR;
+  }
+  bucket->spilled = true;
+  spill->total_len -= bucket->bits.len;
+  bucket->bits.len = 0;
+  return E_OK;
+}
+
+err_t history_spill_push(struct history_spill *spill, struct history_bit bit) {
+  assert(spill != NULL);
+  uint64_t key = history_spill_date_key(bit.date);
+  size_t idx;
+  err_t err = uint64_size_map_get(&spill->index, key, &idx);
+  if (err == E_NOT_FOUND) {
+    idx = spill->buckets.len;
+    struct history_spill_bucket bucket = { .date = bit.date, .bits = { .cap = 64 } };
+    err = history_spill_bucket_vec_push(&spill->buckets, bucket);
+    if (err != E_OK) {
+      errmsg_prefix("history_spill_bucket_vec_push: ");
+      return E_ERR;
+    }
+    err = uint64_size_map_put(&spill->index, key, idx);
+    if (err != E_OK) {
+      spill->buckets.len -= 1;
+      errmsg_prefix("uint64_size_map_put: ");
+      return E_ERR;
+    }
+  }
+
+  struct history_spill_bucket *bucket = &spill->buckets.buf[idx];
+  err = history_bit_vec_push(&bucket->bits, bit);
+  if (err != E_OK) {
+    errmsg_prefix("history_bit_vec_push: ");
+    return E_ERR;
+  }
+  spill->total_len += 1;
+
+  if (bucket->bits.len >= spill->bucket_cap) {
+    err = history_spill_flush_bucket(spill, bucket);
+    if (err != E_OK) {
+      errmsg_prefix("history_spill_flush_bucket: ");
+      return E_ERR;
+    }
+  } else if (spill->total_len >= spill->total_cap) {
+    for (size_t i = 0; i < spill->buckets.len; ++i) {
+      err = history_spill_flush_bucket(spill, &spill->buckets.buf[i]);
+      if (err != E_OK) {
+        errmsg_prefix("history_spill_flush_bucket: ");
+        return E_ERR;
+      }
+    }
+  }
+  return E_OK;
+}
+
+err_t history_spill_push_vec(struct history_spill *spill, const struct history_bit_vec *bit_vec) {
+  assert(bit_vec != NULL);
+  for (size_t i = 0; i < bit_vec->len; ++i) {
+    err_t err = history_spill_push(spill, bit_vec->buf[i]);
+    if (err != E_OK) return E_ERR;
+  }
+  return E_OK;
+}
+
+// Append the bits of `date` to `bit_vec`, in the order they were pushed, and
+// drop them from the spill
+err_t history_spill_read_day(struct history_spill *spill, struct date date,
+                             struct history_bit_vec *bit_vec) {
+  assert(spill != NULL);
+  assert(bit_vec != NULL);
+  size_t idx;
+  err_t err = uint64_size_map_get(&spill->index, history_spill_date_key(date), &idx);
+  if (err == E_NOT_FOUND) return E_OK;
+  struct history_spill_bucket *bucket = &spill->buckets.buf[idx];
+
+  if (bucket->spilled) {
+    char path_buf[DUMP_PATH_LEN_MAX];
+    struct string path = history_spill_path(spill, date, path_buf);
+    FILE *file = fopen(path.buf, "rb");
+    if (file == NULL) {
+      errmsg_fmt("fopen %s: %s", path.buf, strerror(errno));
+      return E_ERR;
+    }
+    struct history_bit chunk[512];
+    size_t read;
+    while ((read = fread(chunk, sizeof(struct history_bit), 512, file)) > 0) {
+      for (size_t i = 0; i < read && err != E_ERR; ++i) {
+        err = history_bit_vec_push(bit_vec, chunk[i]);
+      }
+      if (err == E_ERR) break;
+    }
+    bool failed = ferror(file);
+    fclose(file);
+    if (err == E_ERR) {
+      errmsg_prefix("history_bit_vec_push: ");
+      return E_ERR;
+    } else if (failed) {
+      errmsg_fmt("fread %s: error", path.buf);
+      return E_ERR;
+    }
+    remove(path.buf);
+    bucket->spilled = false;
+  }
+
+  for (size_t i = 0; i < bucket->bits.len; ++i) {
+    err = history_bit_vec_push(bit_vec, bucket->bits.buf[i]);
+    if (err != E_OK) {
+      errmsg_prefix("history_bit_vec_push: ");
+      return E_ERR;
+    }
+  }
+  spill->total_len -= bucket->bits.len;
+  history_bit_vec_destroy(&bucket->bits);
+  return E_OK;
+}
+
+// Remove the spill files that were not read back
+void history_spill_destroy(struct history_spill *spill) {
+  assert(spill != NULL);
+  for (size_t i = 0; i < spill->buckets.len; ++i) {
+    struct history_spill_bucket *bucket = &spill->buckets.buf[i];
+    if (bucket->spilled) {
+      char path_buf[DUMP_PATH_LEN_MAX];
+      remove(history_spill_path(spill, bucket->date, path_buf).buf);
+    }
+    history_bit_vec_destroy(&bucket->bits);
+  }
+  history_spill_bucket_vec_destroy(&spill->buckets);
+  uint64_size_map_destroy(&spill->index);
+}
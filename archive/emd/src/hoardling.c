@@ -124,25 +124,27 @@ struct hoardling_orders_args {
   struct string dump_dir;
   bool history;
   bool structure;
+  size_t concurrency;     // maximum number of page requests in flight
+  size_t order_keyframe;  // seconds between two full order dumps, 0 for no delta dumps
+  bool region_dumps;      // also dump each region as soon as it is downloaded
   struct ptr_fifo *chan_orders_to_locations;
+  struct ptr_fifo *chan_orders_to_region_dumps;  // regions to dump, see hoardling_region_dumps
+  struct ptr_fifo *chan_region_dumps_to_orders;  // regions dumped
   struct ptr_fifo *active_market_request;
   struct ptr_fifo *active_market_response;
 };
 
-err_t hoardling_orders_dump(struct string dump_dir, struct order_vec *order_vec, time_t now) {
-  char dump_path_buf[DUMP_PATH_LEN_MAX];
-  struct string dump_path = string_fmt(dump_path_buf, DUMP_PATH_LEN_MAX, "%.*s/orders-%" PRIu64 ".dump",
-                                       (int) dump_dir.len, dump_dir.buf, now);
-
+err_t hoardling_orders_dump_path(struct string dump_path, const struct order_view *view,
+                                 time_t expiration) {
   struct dump dump;
-  err_t err = dump_open_write(&dump, dump_path, DUMP_TYPE_ORDERS, now + 60 * 5);
+  err_t err = dump_open_write(&dump, dump_path, DUMP_TYPE_ORDERS, expiration);
   if (err != E_OK) {
     errmsg_prefix("dump_open_write: ");
     return E_ERR;
   }
-  err = dump_write_order_table(&dump, order_vec->buf, order_vec->len);
+  err = dump_write_order_view(&dump, view);
   if (err != E_OK) {
-    errmsg_prefix("dump_write_order_table: ");
+    errmsg_prefix("dump_write_order_view: ");
     return E_ERR;
   }
   err = dump_close_write(&dump);
@@ -154,7 +156,205 @@ err_t hoardling_orders_dump(struct string dump_dir, struct order_vec *order_vec,
   return E_OK;
 }
 
-err_t hoardling_orders_send_location_id_vec(struct order_vec *order_vec,
+err_t hoardling_orders_dump(struct string dump_dir, const struct order_view *view, time_t now,
+                            time_t expiration) {
+  char dump_path_buf[DUMP_PATH_LEN_MAX];
+  struct string dump_path = string_fmt(dump_path_buf, DUMP_PATH_LEN_MAX, "%.*s/orders-%" PRIu64 ".dump",
+                                       (int) dump_dir.len, dump_dir.buf, now);
+  return hoardling_orders_dump_path(dump_path, view, expiration);
+}
+
+// A region handed to the region dumps hoardling, handed back once dumped
+struct hoardling_region_dump {
+  const struct order_region *region;
+  time_t now;
+};
+
+// Regions handed to the region dumps hoardling and not handed back yet
+struct hoardling_region_dumps_state {
+  struct ptr_fifo *chan_orders_to_region_dumps;
+  struct ptr_fifo *chan_region_dumps_to_orders;
+  size_t pending;
+};
+
+// order_region_listener handing a downloaded region to the region dumps
+// hoardling, `data` is a hoardling_region_dumps_state. The region is dumped
+// while the download goes on.
+// WARN: the region must not change before it is handed back, see
+// hoardling_orders_wait_region_dumps
+void hoardling_orders_send_region(const struct order_region *region, time_t now, void *data) {
+  struct hoardling_region_dumps_state *state = data;
+  struct hoardling_region_dump *dump = malloc(sizeof(struct hoardling_region_dump));
+  if (dump == NULL) {
+    log_error("orders hoardling: unable to send region %" PRIu64 " to the region dumps "
+              "hoardling: malloc: %s", region->region_id, strerror(errno));
+    return;
+  }
+  *dump = (struct hoardling_region_dump) { .region = region, .now = now };
+
+  // pass ownership of dump to chan_orders_to_region_dumps
+  err_t err = ptr_fifo_push(state->chan_orders_to_region_dumps, dump, 15);
+  if (err != E_OK) {
+    free(dump);
+    log_error("orders hoardling: unable to send region %" PRIu64 " to the region dumps "
+              "hoardling", region->region_id);
+    errmsg_prefix("ptr_fifo_push: ");
+    errmsg_print();
+    return;
+  }
+  state->pending += 1;
+}
+
+// Wait for the region dumps hoardling to hand back every region sent to it
+err_t hoardling_orders_wait_region_dumps(struct hoardling_region_dumps_state *state) {
+  while (state->pending > 0) {
+    struct hoardling_region_dump *dump;
+    err_t err = ptr_fifo_pop(state->chan_region_dumps_to_orders, (void **) &dump, 0);
+    if (err != E_OK) {
+      errmsg_prefix("ptr_fifo_pop: ");
+      return E_ERR;
+    }
+    free(dump);
+    state->pending -= 1;
+  }
+  return E_OK;
+}
+
+// Dump the orders of a region alone
+err_t hoardling_orders_dump_region(struct string dump_dir, const struct order_region *region,
+                                   time_t now) {
+  char dump_path_buf[DUMP_PATH_LEN_MAX];
+  struct string dump_path = string_fmt(dump_path_buf, DUMP_PATH_LEN_MAX,
+                                       "%.*s/orders-region-%" PRIu64 "-%" PRIu64 ".dump",
+                                       (int) dump_dir.len, dump_dir.buf, region->region_id, now);
+  const struct order_table *tables[] = { &region->table };
+  struct order_view view = { .tables = tables, .len = 1 };
+  return hoardling_orders_dump_path(dump_path, &view, region->expires);
+}
+
+struct hoardling_region_dumps_args {
+  struct string dump_dir;
+  struct ptr_fifo *chan_orders_to_region_dumps;
+  struct ptr_fifo *chan_region_dumps_to_orders;
+};
+
+// Dump each region the orders hoardling sends as soon as it is downloaded,
+// out of the thread driving the downloads
+void *hoardling_region_dumps(void *args_ptr) {
+  assert(args_ptr != NULL);
+  struct hoardling_region_dumps_args args = *(struct hoardling_region_dumps_args *) args_ptr;
+
+  while (true) {
+    struct hoardling_region_dump *dump;
+    err_t err = ptr_fifo_pop(args.chan_orders_to_region_dumps, (void **) &dump, 0);
+    if (err != E_OK) {
+      errmsg_prefix("ptr_fifo_pop: ");
+      goto cleanup;
+    }
+    assert(dump != NULL);
+
+    err = hoardling_orders_dump_region(args.dump_dir, dump->region, dump->now);
+    if (err != E_OK) {
+      log_error("region dumps hoardling: unable to emit region %" PRIu64 " order dump",
+                dump->region->region_id);
+      errmsg_prefix("hoardling_orders_dump_region: ");
+      errmsg_print();
+    }
+
+    // pass ownership of dump back to chan_region_dumps_to_orders
+    err = ptr_fifo_push(args.chan_region_dumps_to_orders, dump, 0);
+    if (err != E_OK) {
+      errmsg_prefix("ptr_fifo_push: ");
+      goto cleanup;
+    }
+  }
+
+cleanup:
+  log_warn("region dumps hoardling quitting");
+  errmsg_prefix("hoardling_region_dumps: ");
+  errmsg_print();
+
+  kill(getpid(), SIGTERM);
+  return NULL;
+}
+
+// Dump the changes of the regions since the last order_region_snapshot,
+// taken with the dump of `prev_at`
+err_t hoardling_orders_dump_delta(struct string dump_dir, const struct order_region *regions,
+                                  time_t prev_at, time_t now, time_t expiration) {
+  struct order_delta delta = {0};
+  err_t err = order_region_delta_compute(&delta, regions, global_regions_len);
+  if (err != E_OK) {
+    order_delta_destroy(&delta);
+    errmsg_prefix("order_region_delta_compute: ");
+    return E_ERR;
+  }
+  log_print("orders hoardling: %zu orders added, %zu removed, %zu changed",
+            delta.added.len, delta.removed.len, delta.changed.len);
+
+  char dump_path_buf[DUMP_PATH_LEN_MAX];
+  struct string dump_path = string_fmt(dump_path_buf, DUMP_PATH_LEN_MAX, "%.*s/orders-delta-%" PRIu64 ".dump",
+                                       (int) dump_dir.len, dump_dir.buf, now);
+
+  struct dump dump;
+  err = dump_open_write(&dump, dump_path, DUMP_TYPE_ORDERS_DELTA, expiration);
+  if (err != E_OK) {
+    errmsg_prefix("dump_open_write: ");
+    goto cleanup;
+  }
+  err = dump_write_order_delta(&dump, prev_at, &delta);
+  if (err != E_OK) {
+    errmsg_prefix("dump_write_order_delta: ");
+    goto cleanup;
+  }
+  err = dump_close_write(&dump);
+  if (err != E_OK) {
+    errmsg_prefix("dump_close_write: ");
+    goto cleanup;
+  }
+
+cleanup:
+  order_delta_destroy(&delta);
+  return err;
+}
+
+// Dump the market summaries of `table`
+err_t hoardling_orders_dump_summaries(struct string dump_dir, const struct order_view *view,
+                                      time_t now, time_t expiration) {
+  struct market_summary_vec summary_vec = { .cap = 1024 };
+  err_t err = market_summary_compute(&summary_vec, view);
+  if (err != E_OK) {
+    errmsg_prefix("market_summary_compute: ");
+    goto cleanup;
+  }
+
+  char dump_path_buf[DUMP_PATH_LEN_MAX];
+  struct string dump_path = string_fmt(dump_path_buf, DUMP_PATH_LEN_MAX, "%.*s/summaries-%" PRIu64 ".dump",
+                                       (int) dump_dir.len, dump_dir.buf, now);
+
+  struct dump dump;
+  err = dump_open_write(&dump, dump_path, DUMP_TYPE_SUMMARIES, expiration);
+  if (err != E_OK) {
+    errmsg_prefix("dump_open_write: ");
+    goto cleanup;
+  }
+  err = dump_write_market_summary_vec(&dump, &summary_vec);
+  if (err != E_OK) {
+    errmsg_prefix("dump_write_market_summary_vec: ");
+    goto cleanup;
+  }
+  err = dump_close_write(&dump);
+  if (err != E_OK) {
+    errmsg_prefix("dump_close_write: ");
+    goto cleanup;
+  }
+
+cleanup:
+  market_summary_vec_destroy(&summary_vec);
+  return err;
+}
+
+err_t hoardling_orders_send_location_id_vec(const struct order_view *view,
                                             struct ptr_fifo *chan_orders_to_locations) {
   struct uint64_vec *locid_vec = malloc(sizeof(struct uint64_vec));
   if (locid_vec == NULL) {
@@ -163,7 +363,7 @@ err_t hoardling_orders_send_location_id_vec(struct order_vec *order_vec,
   }
   *locid_vec = (struct uint64_vec) { .cap = 2048 };
 
-  err_t err = order_fill_location_id_vec(locid_vec, order_vec);
+  err_t err = order_fill_location_id_vec(locid_vec, view);
   if (err != E_OK) {
     uint64_vec_destroy(locid_vec);
     free(locid_vec);
@@ -183,7 +383,26 @@ err_t hoardling_orders_send_location_id_vec(struct order_vec *order_vec,
   return E_OK;
 }
 
-err_t hoardling_orders_respond_to_histories_hoardling(struct order_vec *order_vec,
+err_t hoardling_orders_answer_histories_hoardling(const struct order_region *regions,
+                                                  struct history_market_vec *market_vec,
+                                                  struct ptr_fifo *active_market_response) {
+  assert(market_vec != NULL);
+  err_t err = order_fill_active_market_vec(market_vec, regions, global_regions_len);
+  if (err != E_OK) {
+    errmsg_prefix("order_fill_active_market_vec: ");
+    return E_ERR;
+  }
+
+  err = ptr_fifo_push(active_market_response, (void *) market_vec, 15);
+  if (err != E_OK) {
+    errmsg_prefix("ptr_fifo_push: ");
+    return E_ERR;
+  }
+
+  return E_OK;
+}
+
+err_t hoardling_orders_respond_to_histories_hoardling(const struct order_region *regions,
                                                       struct ptr_fifo *active_market_request,
                                                       struct ptr_fifo *active_market_response) {
   struct history_market_vec *market_vec;
@@ -195,66 +414,140 @@ err_t hoardling_orders_respond_to_histories_hoardling(struct order_vec *order_ve
     return E_ERR;
   }
 
-  assert(market_vec != NULL);
-  err = order_fill_active_market_vec(market_vec, order_vec);
-  if (err != E_OK) {
-    errmsg_prefix("order_fill_active_market_vec: ");
-    return E_ERR;
-  }
-
-  err = ptr_fifo_push(active_market_response, (void *) market_vec, 15);
+  err = hoardling_orders_answer_histories_hoardling(regions, market_vec,
+                                                    active_market_response);
   if (err != E_OK) {
-    errmsg_prefix("ptr_fifo_push: ");
+    errmsg_prefix("hoardling_orders_answer_histories_hoardling: ");
     return E_ERR;
   }
 
   return E_OK;
 }
 
+// Wait until `deadline`. Active market requests from the histories hoardling
+// are answered in the meantime instead of waiting for the next download.
+void hoardling_orders_wait(struct hoardling_orders_args *args, const struct order_region *regions,
+                           time_t deadline) {
+  while (true) {
+    time_t now = time(NULL);
+    if (now >= deadline) return;
+    if (!args->history) {
+      sleep(deadline - now);
+      return;
+    }
+
+    struct history_market_vec *market_vec;
+    err_t err = ptr_fifo_pop(args->active_market_request, (void **) &market_vec, deadline - now);
+    if (err == E_EMPTY) {
+      return;
+    } else if (err != E_OK) {
+      log_error("orders hoardling: unable to wait for histories hoardling");
+      errmsg_prefix("ptr_fifo_pop: ");
+      errmsg_print();
+      sleep(1);
+      continue;
+    }
+
+    err = hoardling_orders_answer_histories_hoardling(regions, market_vec,
+                                                      args->active_market_response);
+    if (err != E_OK) {
+      log_error("orders hoardling: unable to respond to histories hoardling");
+      errmsg_prefix("hoardling_orders_answer_histories_hoardling: ");
+      errmsg_print();
+    }
+  }
+}
+
 void *hoardling_orders(void *args_ptr) {
   assert(args_ptr != NULL);
   struct hoardling_orders_args args = *(struct hoardling_orders_args *) args_ptr;
 
-  struct order_vec order_vec = {0};
-  time_t expiration = 0;
-
-  err_t err = order_vec_create(&order_vec, 2048);
+  // each region is refreshed as soon as esi expires it, `universe` sees the
+  // orders of all the regions without copying them
+  struct order_region *regions = NULL;
+  struct order_view universe = {0};
+  // the order dumps are full every args.order_keyframe seconds, in between
+  // they only hold the changes since the previous dump, kept by the regions
+  // that changed (see order_region_snapshot)
+  time_t dumped_at = 0;  // 0 if nothing was dumped yet
+  time_t keyframe_at = 0;
+  struct hoardling_region_dumps_state region_dumps = {
+    .chan_orders_to_region_dumps = args.chan_orders_to_region_dumps,
+    .chan_region_dumps_to_orders = args.chan_region_dumps_to_orders,
+  };
+  struct order_region_listener region_listener = {
+    .updated = hoardling_orders_send_region,
+    .data = &region_dumps,
+  };
+
+  err_t err = order_region_create_all(&regions, global_regions, global_regions_len);
   if (err != E_OK) {
-    errmsg_prefix("order_vec_create: ");
+    errmsg_prefix("order_region_create_all: ");
+    goto cleanup;
+  }
+  err = order_region_view(&universe, regions, global_regions_len);
+  if (err != E_OK) {
+    errmsg_prefix("order_region_view: ");
     goto cleanup;
   }
 
   while (true) {
     time_t now = time(NULL);
-    if (now < expiration) {
-      log_print("orders hoardling: up to date");
-      sleep(expiration - now);
+    time_t refresh = order_region_next_refresh(regions, global_regions_len);
+    if (now < refresh) {
+      log_print("orders hoardling: up to date, next refresh in %" PRIu64 "s",
+                (uint64_t) (refresh - now));
+      hoardling_orders_wait(&args, regions, refresh);
       continue;
     }
 
-    log_print("orders hoardling: downloading orders and locations");
-    order_vec.len = 0;
+    // the regions of the previous download might still be being dumped
+    err = hoardling_orders_wait_region_dumps(&region_dumps);
+    if (err != E_OK) {
+      errmsg_prefix("hoardling_orders_wait_region_dumps: ");
+      goto cleanup;
+    }
 
-    err = order_download_universe(&order_vec, global_regions, global_regions_len);
+    log_print("orders hoardling: downloading orders and locations");
+    err = order_download_regions(regions, global_regions_len, now, args.concurrency,
+                                 args.region_dumps ? &region_listener : NULL);
     if (err != E_OK) {
       log_print("orders hoardling: 2 minutes backoff");
-      errmsg_prefix("order_download_universe: ");
+      errmsg_prefix("order_download_regions: ");
       errmsg_print();
-      sleep(2 * 60);
+      hoardling_orders_wait(&args, regions, time(NULL) + 2 * 60);
       continue;
     }
 
-    err = hoardling_orders_dump(args.dump_dir, &order_vec, now);
+    time_t expiration = order_region_next_refresh(regions, global_regions_len);
+    bool keyframe = args.order_keyframe == 0 || dumped_at == 0 ||
+                    now - keyframe_at >= (time_t) args.order_keyframe;
+    if (keyframe) {
+      err = hoardling_orders_dump(args.dump_dir, &universe, now, expiration);
+    } else {
+      err = hoardling_orders_dump_delta(args.dump_dir, regions, dumped_at, now, expiration);
+    }
     if (err != E_OK) {
+      // the next delta is computed against the last dump that made it
       log_error("orders hoardling: unable to emit order dump");
-      errmsg_prefix("hoardling_orders_dump: ");
+      errmsg_prefix("hoardling_orders_dump/hoardling_orders_dump_delta: ");
       errmsg_print();
     } else {
-      log_print("orders hoardling: new order dump");
+      log_print("orders hoardling: new order %s", keyframe ? "dump" : "delta dump");
+      if (keyframe) keyframe_at = now;
+      if (args.order_keyframe > 0) dumped_at = now;
+      order_region_snapshot(regions, global_regions_len);
+    }
+
+    err = hoardling_orders_dump_summaries(args.dump_dir, &universe, now, expiration);
+    if (err != E_OK) {
+      log_error("orders hoardling: unable to emit market summary dump");
+      errmsg_prefix("hoardling_orders_dump_summaries: ");
+      errmsg_print();
     }
 
     if (args.structure) {
-      err = hoardling_orders_send_location_id_vec(&order_vec, args.chan_orders_to_locations);
+      err = hoardling_orders_send_location_id_vec(&universe, args.chan_orders_to_locations);
       if (err != E_OK) {
         log_error("orders hoardling: unable to locations id to locations hoardling");
         errmsg_prefix("hoardling_orders_send_location_id_vec: ");
@@ -264,7 +557,7 @@ void *hoardling_orders(void *args_ptr) {
 
     if (args.history) {
       // response to active market requests from histories hoardling
-      err = hoardling_orders_respond_to_histories_hoardling(&order_vec,
+      err = hoardling_orders_respond_to_histories_hoardling(regions,
                                                             args.active_market_request,
                                                             args.active_market_response);
       if (err != E_OK) {
@@ -273,8 +566,6 @@ void *hoardling_orders(void *args_ptr) {
         errmsg_print();
       }
     }
-
-    expiration = now + 60 * 5;
   }
 
 cleanup:
@@ -286,26 +577,49 @@ cleanup:
   return NULL;
 }
 
+// Bits buffered per day of the initial download before the day is spilled,
+// and in total before every day is spilled
+const size_t HOARDLING_HISTORIES_BUCKET_CAP = 4096;
+const size_t HOARDLING_HISTORIES_SPILL_CAP = 1 << 19;
+
+const double HOARDLING_HISTORIES_RETRY_DELAY = 60;  // first delay before a failed market is retried
+// the daily dump is emitted at most this long after the daily download starts,
+// the markets that still fail by then are left out of it
+const double HOARDLING_HISTORIES_DAILY_RETRY_HORIZON = 15 * 60;
+
 struct hoardling_histories_args {
   struct string dump_dir;
+  size_t concurrency;  // maximum number of history requests in flight
   struct ptr_fifo *active_market_request;
   struct ptr_fifo *active_market_response;
 };
 
+// NOTE: builds that counted the days of date_utc from 1 named the daily dump
+// of a day after the next day, so the dump of `date` might be found under
+// the name of the next day in a dump dir written by such a build
 bool hoardling_histories_dump_does_exist(struct string dump_dir, struct date date) {
   char dump_path_buf[DUMP_PATH_LEN_MAX];
   struct string last_dump_path = string_fmt(dump_path_buf, DUMP_PATH_LEN_MAX, "%.*s/history-day-%" PRIu16 "-%" PRIu16 ".dump",
                                             (int) dump_dir.len, dump_dir.buf, date.year, date.day);
+  if (dump_does_exist(last_dump_path)) return true;
+  date_incr(&date);
+  last_dump_path = string_fmt(dump_path_buf, DUMP_PATH_LEN_MAX, "%.*s/history-day-%" PRIu16 "-%" PRIu16 ".dump",
+                              (int) dump_dir.len, dump_dir.buf, date.year, date.day);
   return dump_does_exist(last_dump_path);
 }
 
-err_t hoardling_histories_dump(struct string dump_dir, struct history_bit_vec *bit_vec, struct date date) {
+// Returns E_FULL if there is already a dump of `date`, unless `replace`
+err_t hoardling_histories_dump(struct string dump_dir, struct history_bit_vec *bit_vec, struct date date,
+                               bool replace) {
   char dump_path_buf[DUMP_PATH_LEN_MAX];
   struct string dump_path = string_fmt(dump_path_buf, DUMP_PATH_LEN_MAX, "%.*s/history-day-%" PRIu16 "-%" PRIu16 ".dump",
                                        (int) dump_dir.len, dump_dir.buf, date.year, date.day);
   if (dump_does_exist(dump_path)) {
-    errmsg_fmt("there is already a dump at %.*s", dump_path.len, dump_path.buf);
-    return E_FULL;
+    if (!replace) {
+      errmsg_fmt("there is already a dump at %.*s", dump_path.len, dump_path.buf);
+      return E_FULL;
+    }
+    log_warn("histories hoardling: replacing the dump at %.*s", (int) dump_path.len, dump_path.buf);
   }
 
   struct dump dump;
@@ -328,6 +642,107 @@ err_t hoardling_histories_dump(struct string dump_dir, struct history_bit_vec *b
   return E_OK;
 }
 
+// Commit the blocks appended to the history store and compact it when it
+// holds too many blocks. The store is a secondary output, so failures are
+// only logged
+void hoardling_histories_store_commit(struct history_store *store) {
+  err_t err = history_store_commit(store);
+  if (err != E_OK) {
+    log_error("histories hoardling: unable to commit the history store");
+    errmsg_prefix("history_store_commit: ");
+    errmsg_print();
+    return;
+  }
+  if (history_store_needs_compaction(store)) {
+    log_print("histories hoardling: compacting the history store");
+    err = history_store_compact(store);
+    if (err != E_OK) {
+      log_error("histories hoardling: unable to compact the history store");
+      errmsg_prefix("history_store_compact: ");
+      errmsg_print();
+    }
+  }
+}
+
+// State of the initial download, the bits are partitioned by day into `spill`
+// and appended to `store` (NULL without store)
+struct hoardling_histories_backfill {
+  struct history_spill *spill;
+  struct history_store *store;
+  struct date first_day;  // year is 0 until a bit is downloaded
+  struct date last_day;
+};
+
+err_t hoardling_histories_backfill_push(struct history_market market,
+                                        const struct history_bit_vec *bit_vec, void *data) {
+  (void) market;
+  struct hoardling_histories_backfill *backfill = data;
+  if (bit_vec->len == 0) return E_OK;
+
+  // esi histories are sorted by date
+  struct date history_first_day = bit_vec->buf[0].date;
+  struct date history_last_day = bit_vec->buf[bit_vec->len-1].date;
+  if (backfill->first_day.year == 0 || date_is_before(history_first_day, backfill->first_day)) {
+    backfill->first_day = history_first_day;
+  }
+  if (backfill->last_day.year == 0 || date_is_after(history_last_day, backfill->last_day)) {
+    backfill->last_day = history_last_day;
+  }
+
+  err_t err = history_spill_push_vec(backfill->spill, bit_vec);
+  if (err != E_OK) {
+    errmsg_prefix("history_spill_push_vec: ");
+    return E_ERR;
+  }
+
+  if (backfill->store != NULL) {
+    err = history_store_append(backfill->store, bit_vec);
+    if (err != E_OK) {
+      log_error("histories hoardling: unable to append to the history store, giving up on it");
+      errmsg_prefix("history_store_append: ");
+      errmsg_print();
+      backfill->store = NULL;
+    }
+  }
+  return E_OK;
+}
+
+// Receives the bit of the day of each market, see history_parse_day
+err_t hoardling_histories_daily_push(struct history_market market,
+                                     const struct history_bit_vec *bit_vec, void *data) {
+  (void) market;
+  struct history_bit_vec *day_bit_vec = data;
+  for (size_t i = 0; i < bit_vec->len; ++i) {
+    err_t err = history_bit_vec_push(day_bit_vec, bit_vec->buf[i]);
+    if (err != E_OK) {
+      errmsg_prefix("history_bit_vec_push: ");
+      return E_ERR;
+    }
+  }
+  return E_OK;
+}
+
+void hoardling_histories_negative_path(struct string dump_dir, char buf[DUMP_PATH_LEN_MAX],
+                                       struct string *path) {
+  *path = string_fmt(buf, DUMP_PATH_LEN_MAX, "%.*s/history-negative.dump",
+                     (int) dump_dir.len, dump_dir.buf);
+}
+
+// Save the negative cache if it changed, a failure only costs requests
+void hoardling_histories_negative_save(struct string dump_dir,
+                                       struct history_negative_cache *negative) {
+  if (!negative->dirty) return;
+  char path_buf[DUMP_PATH_LEN_MAX];
+  struct string path;
+  hoardling_histories_negative_path(dump_dir, path_buf, &path);
+  err_t err = history_negative_cache_save(negative, path, time(NULL));
+  if (err != E_OK) {
+    log_error("histories hoardling: unable to save the negative cache");
+    errmsg_prefix("history_negative_cache_save: ");
+    errmsg_print();
+  }
+}
+
 err_t hoardling_histories_request_active_markets(struct history_market_vec *market_vec,
                                                  struct ptr_fifo *active_market_request,
                                                  struct ptr_fifo *active_market_response) {
@@ -354,6 +769,30 @@ void *hoardling_histories(void *args_ptr) {
   struct hoardling_histories_args args = *(struct hoardling_histories_args *) args_ptr;
 
   time_t now = time(NULL);
+
+  // markets without history, as of the previous runs
+  struct history_negative_cache negative;
+  char negative_path_buf[DUMP_PATH_LEN_MAX];
+  struct string negative_path;
+  hoardling_histories_negative_path(args.dump_dir, negative_path_buf, &negative_path);
+  err = history_negative_cache_load(&negative, negative_path, now);
+  if (err != E_OK) {
+    log_warn("histories hoardling: unable to load the negative cache, starting without it");
+    errmsg_prefix("history_negative_cache_load: ");
+    errmsg_print();
+  }
+
+  // per market series of the histories, see series.c, NULL if it can't be used
+  struct history_store store_buf;
+  struct history_store *store = &store_buf;
+  err = history_store_open(store, args.dump_dir);
+  if (err != E_OK) {
+    log_error("histories hoardling: unable to open the history store, going on without it");
+    errmsg_prefix("history_store_open: ");
+    errmsg_print();
+    store = NULL;
+  }
+
   time_t eleven_fifteen_today = time_eleven_fifteen_today(now);
   time_t eleven_fifteen_tomorrow = time_eleven_fifteen_tomorrow(now);
   time_t expiration = now < eleven_fifteen_today ? eleven_fifteen_today : eleven_fifteen_tomorrow;
@@ -376,133 +815,49 @@ void *hoardling_histories(void *args_ptr) {
       goto cleanup;
     }
 
-    struct dump snapshot_dump;
-    struct string snapshot_dump_path = string_new("/tmp/emd_snapshot_dump");
-    err = dump_open_write(&snapshot_dump, snapshot_dump_path, DUMP_TYPE_INTERNAL, 0);
+    // the bits are partitioned by day as they are downloaded, the days that
+    // grow too large are spilled to /tmp
+    struct history_spill spill;
+    history_spill_init(&spill, string_new("/tmp/emd_snapshot_day"),
+                       HOARDLING_HISTORIES_BUCKET_CAP, HOARDLING_HISTORIES_SPILL_CAP);
+
+    struct hoardling_histories_backfill backfill = { .spill = &spill, .store = store };
+    struct history_listener backfill_listener = {
+      .downloaded = hoardling_histories_backfill_push,
+      .data = &backfill,
+    };
+    err = history_download_markets(market_vec.buf, market_vec.len, (struct date) {0},
+                                   args.concurrency, HOARDLING_HISTORIES_RETRY_DELAY, 0,
+                                   &negative, &backfill_listener);
     if (err != E_OK) {
-      errmsg_prefix("dump_open_write: ");
+      errmsg_prefix("history_download_markets: ");
       goto cleanup;
     }
-
-    struct date first_day = {0};
-    struct date last_day = {0};
-    struct history_bit_vec bit_vec = { .cap = 512 };
-    for (size_t i = 0; i < market_vec.len; ++i) {
-      struct history_market market = market_vec.buf[i];
-      bit_vec.len = 0;
-
-      int try = 1;
-      while (1) {
-        err = history_download(&bit_vec, market);
-        if (err == E_OK || err == E_NOT_FOUND) {
-          break;
-        } else if (try <= 6) {
-          try += 1;
-          errmsg_prefix("history_download: ");
-          errmsg_print();
-          time_t backoff;
-          switch (try) {
-            case 1:
-            case 2:
-            case 3:
-              log_error("histories hoardling: history download failed, retrying in 5 minutes");
-              backoff = 5 * TIME_MINUTE;
-              break;
-            case 4:
-            case 5:
-              log_error("histories hoardling: history download failed, retrying in 30 minutes");
-              backoff = 30 * TIME_MINUTE;
-              break;
-            case 6:
-              log_error("histories hoardling: history download failed, retrying in 2 hours");
-              backoff = 2 * TIME_HOUR;
-              break;
-          }
-          sleep(backoff);
-        } else {
-          log_error("histories hoardling: history download failed, out of trails");
-          errmsg_prefix("history_download: ");
-          goto cleanup;
-        }
-      }
-
-      if (err == E_NOT_FOUND) {
-        // skip it
-        continue;
-      }
-
-      if (bit_vec.len > 0) {
-        struct date history_first_day = bit_vec.buf[0].date;
-        struct date history_last_day = bit_vec.buf[bit_vec.len-1].date;
-        if (first_day.year == 0 || date_is_before(history_first_day, first_day)) {
-          first_day = history_first_day;
-        }
-        if (last_day.year == 0 || date_is_after(history_last_day, last_day)) {
-          last_day = history_last_day;
-        }
-
-        err = dump_write_history_bit_vec(&snapshot_dump, &bit_vec);
-        if (err != E_OK) {
-          errmsg_prefix("dump_write_history_bit_vec: ");
-          goto cleanup;
-        }
-      }
-    }
+    hoardling_histories_negative_save(args.dump_dir, &negative);
+    struct date first_day = backfill.first_day;
+    struct date last_day = backfill.last_day;
+    history_market_vec_destroy(&market_vec);
+    if (backfill.store != NULL) hoardling_histories_store_commit(store);
 
     if (first_day.year == 0 || last_day.year == 0) {
-      assert(bit_vec.len == 0);
-      errmsg_fmt("bit_vec is empty");
+      errmsg_fmt("no history was downloaded");
       goto cleanup;
     }
 
     log_print("histories hoardling: initial download finished");
 
-    err = dump_close_write(&snapshot_dump);
-    if (err != E_OK) {
-      errmsg_prefix("dump_close_write: ");
-      goto cleanup;
-    }
-    err = dump_open_read(&snapshot_dump, snapshot_dump_path);
-    if (err != E_OK) {
-      errmsg_prefix("dump_open_read: ");
-      goto cleanup;
-    }
-
-    struct history_bit_vec bit_chunk = { .cap = 10000 };
+    struct history_bit_vec bit_vec = { .cap = 512 };
     for (struct date date = first_day;
          date_is_before(date, last_day) || date_is_equal(date, last_day);
          date_incr(&date)) {
       bit_vec.len = 0;
-      err = dump_seek_start(&snapshot_dump);
+      err = history_spill_read_day(&spill, date, &bit_vec);
       if (err != E_OK) {
-        errmsg_prefix("dump_seek_start: ");
+        errmsg_prefix("history_spill_read_day: ");
         goto cleanup;
       }
 
-      bool eof = false;
-      while (!eof) {
-        bit_chunk.len = 0;
-        err = dump_read_history_bit_vec(&snapshot_dump, &bit_chunk, 10000);
-        if (err == E_EOF) {
-          eof = true;
-        } else if (err != E_OK) {
-          errmsg_prefix("dump_read_history_bit_vec: ");
-          goto cleanup;
-        }
-
-        for (size_t i = 0; i < bit_chunk.len; ++i) {
-          if (date_is_equal(date, bit_chunk.buf[i].date)) {
-            // log_print("date match: (%" PRIu64 ", %" PRIu64 ")", bit_chunk.buf[i].date.year, bit_chunk.buf[i].date.day);
-            err = history_bit_vec_push(&bit_vec, bit_chunk.buf[i]);
-            if (err != E_OK) {
-              errmsg_prefix("history_bit_vec_push: ");
-              goto cleanup;
-            }
-          }
-        }
-      }
-
-      err = hoardling_histories_dump(args.dump_dir, &bit_vec, date);
+      err = hoardling_histories_dump(args.dump_dir, &bit_vec, date, false);
       if (err == E_FULL) {
         log_warn("histories hoardling: unable to emit history dump because there is already a dump at this path");
       } else if (err != E_OK) {
@@ -514,16 +869,15 @@ void *hoardling_histories(void *args_ptr) {
       }
     }
 
-    err = dump_close_read(&snapshot_dump);
-    if (err != E_OK) {
-      errmsg_prefix("dump_close_read: ");
-      goto cleanup;
-    }
-
+    history_spill_destroy(&spill);
     history_bit_vec_destroy(&bit_vec);
-    history_bit_vec_destroy(&bit_chunk);
   }
 
+  // The daily dump of a day might already exist under the name a build that
+  // counted the days of date_utc from 1 gave to the dump of the previous day,
+  // it is replaced rather than the day skipped. A start never meets the dump
+  // of its first day otherwise, the first cycle is the next 11:15
+  bool is_first_daily_dump = true;
   while (1) {
     time_t now = time(NULL);
     if (now < expiration) {
@@ -547,63 +901,33 @@ void *hoardling_histories(void *args_ptr) {
     struct date date = now < eleven_fifteen_today ? date_utc(now - 2*TIME_DAY) : date_utc(now - TIME_DAY);
     log_print("histories hoardling: downloading histories of day (%" PRIu64 ", %" PRIu64 ")", date.year, date.day);
 
-    struct history_bit_vec bit_vec = { .cap = 4096 };
-    struct history_bit_vec market_bit_vec = { .cap = 512 };
-    for (size_t i = 0; i < market_vec.len; ++i) {
-      struct history_market market = market_vec.buf[i];
-      market_bit_vec.len = 0;
-
-      int try = 1;
-      while (1) {
-        err = history_download(&bit_vec, market);
-        if (err == E_OK || err == E_NOT_FOUND) {
-          break;
-        } else if (try <= 6) {
-          try += 1;
-          errmsg_prefix("history_download: ");
-          errmsg_print();
-          time_t backoff;
-          switch (try) {
-            case 1:
-            case 2:
-            case 3:
-              log_error("histories hoardling: history download failed, retrying in 5 minutes");
-              backoff = 5 * TIME_MINUTE;
-              break;
-            case 4:
-            case 5:
-              log_error("histories hoardling: history download failed, retrying in 30 minutes");
-              backoff = 30 * TIME_MINUTE;
-              break;
-            case 6:
-              log_error("histories hoardling: history download failed, retrying in 2 hours");
-              backoff = 2 * TIME_HOUR;
-              break;
-          }
-          sleep(backoff);
-        } else {
-          log_error("histories hoardling: history download failed, out of trails");
-          errmsg_prefix("history_download: ");
-          goto cleanup;
-        }
-      }
-
-      // NOTE: this could be done quicker
-      for (size_t i = 0; i < market_bit_vec.len; ++i) {
-        if (date_is_equal(market_bit_vec.buf[i].date, date)) {
-          err = history_bit_vec_push(&bit_vec, market_bit_vec.buf[i]);
-          if (err != E_OK) {
-            errmsg_prefix("history_bit_vec_push: ");
-            goto cleanup;
-          }
-        }
-      }
+    // a market has at most one bit per day
+    struct history_bit_vec bit_vec;
+    err = history_bit_vec_create(&bit_vec, market_vec.len + 1);
+    if (err != E_OK) {
+      errmsg_prefix("history_bit_vec_create: ");
+      goto cleanup;
     }
+    struct history_listener daily_listener = {
+      .downloaded = hoardling_histories_daily_push,
+      .data = &bit_vec,
+    };
+    err = history_download_markets(market_vec.buf, market_vec.len, date, args.concurrency,
+                                   HOARDLING_HISTORIES_RETRY_DELAY,
+                                   HOARDLING_HISTORIES_DAILY_RETRY_HORIZON, &negative,
+                                   &daily_listener);
+    if (err != E_OK) {
+      errmsg_prefix("history_download_markets: ");
+      goto cleanup;
+    }
+    hoardling_histories_negative_save(args.dump_dir, &negative);
+    history_market_vec_destroy(&market_vec);
 
     log_print("histories hoardling: history download finished");
 
     // dump it like it's hot
-    err = hoardling_histories_dump(args.dump_dir, &bit_vec, date);
+    err = hoardling_histories_dump(args.dump_dir, &bit_vec, date, is_first_daily_dump);
+    is_first_daily_dump = false;
     if (err == E_FULL) {
       log_warn("histories hoardling: unable to emit history dump because there is already a dump at this path");
     } else if (err != E_OK) {
@@ -614,8 +938,17 @@ void *hoardling_histories(void *args_ptr) {
       log_print("histories hoardling: new history dump");
     }
 
+    if (store != NULL) {
+      err = history_store_append(store, &bit_vec);
+      if (err != E_OK) {
+        log_error("histories hoardling: unable to append to the history store");
+        errmsg_prefix("history_store_append: ");
+        errmsg_print();
+      }
+      hoardling_histories_store_commit(store);
+    }
+
     expiration += TIME_DAY;
-    history_bit_vec_destroy(&market_bit_vec);
     history_bit_vec_destroy(&bit_vec);
   }
 
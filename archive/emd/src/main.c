@@ -7,7 +7,9 @@
 #include "systems.c"
 #include "locations.c"
 #include "orders.c"
+#include "summaries.c"
 #include "histories.c"
+#include "series.c"
 #include "server.c"
 #include "hoardling.c"
 
@@ -27,13 +29,34 @@ const char* MAN =
 "\t--history BOOLEAN\n"
 "\t\tEnable histories update (default true)\n"
 "\t--structure BOOLEAN\n"
-"\t\tEnable fetching of public player structures (requires ssoClientId, ssoClientSecret and ssoRefreshToken secrets) (default true)\n";
+"\t\tEnable fetching of public player structures (requires ssoClientId, ssoClientSecret and ssoRefreshToken secrets) (default true)\n"
+"\t--concurrency INTEGER\n"
+"\t\tMaximum number of order pages, and of market histories, downloaded at the same time, between 1 and 64 (default 16)\n"
+"\t--esi_record STRING\n"
+"\t\tRecord every esi response to the given corpus file\n"
+"\t--esi_replay STRING\n"
+"\t\tAnswer esi requests from the given corpus file instead of contacting esi\n"
+"\t--esi_replay_latency INTEGER\n"
+"\t\tMilliseconds added to each replayed request (default 0)\n"
+"\t--esi_replay_errors INTEGER\n"
+"\t\tPercentage of replayed requests answered with an injected 420, 429 or 504 (default 0)\n"
+"\t--order_keyframe INTEGER\n"
+"\t\tSeconds between two full order dumps, the order dumps in between only hold the changes since the previous one, 0 to always dump every order (default 3600)\n"
+"\t--region_dumps BOOLEAN\n"
+"\t\tAlso dump the orders of each region as soon as they are downloaded, in orders-region-<region_id>-<timestamp>.dump files (default true)\n";
 
 struct args {
   struct string secrets;
   struct string dump_dir;
   bool history;
   bool structure;
+  size_t concurrency;
+  struct string esi_record;  // empty if not recording
+  struct string esi_replay;  // empty if not replaying
+  size_t esi_replay_latency;
+  size_t esi_replay_errors;
+  size_t order_keyframe;
+  bool region_dumps;
 };
 
 err_t args_parse(int argc, char *argv[], struct args *args) {
@@ -42,6 +65,13 @@ err_t args_parse(int argc, char *argv[], struct args *args) {
     .dump_dir = string_new("."),
     .history = true,
     .structure = true,
+    .concurrency = 16,
+    .esi_record = {0},
+    .esi_replay = {0},
+    .esi_replay_latency = 0,
+    .esi_replay_errors = 0,
+    .order_keyframe = 60 * 60,
+    .region_dumps = true,
   };
 
   struct option opt_table[] = {
@@ -49,6 +79,13 @@ err_t args_parse(int argc, char *argv[], struct args *args) {
     { .name = "dump_dir", .has_arg = required_argument },
     { .name = "history", .has_arg = optional_argument },
     { .name = "structure", .has_arg = optional_argument },
+    { .name = "concurrency", .has_arg = required_argument },
+    { .name = "esi_record", .has_arg = required_argument },
+    { .name = "esi_replay", .has_arg = required_argument },
+    { .name = "esi_replay_latency", .has_arg = required_argument },
+    { .name = "esi_replay_errors", .has_arg = required_argument },
+    { .name = "order_keyframe", .has_arg = required_argument },
+    { .name = "region_dumps", .has_arg = optional_argument },
     { 0 },  // shitty api
   };
 
@@ -81,6 +118,46 @@ err_t args_parse(int argc, char *argv[], struct args *args) {
           return E_ERR;
         }
         break;
+      case 4:
+        if (asgs_prase_uint(&args->concurrency, optarg) != E_OK ||
+            args->concurrency < 1 || args->concurrency > ESI_CONCURRENCY_MAX) {
+          printf("--concurrency takes an INTEGER between 1 and %zu\n\n%s",
+                 ESI_CONCURRENCY_MAX, MAN);
+          return E_ERR;
+        }
+        break;
+      case 5:
+        args->esi_record = string_new(optarg);
+        break;
+      case 6:
+        args->esi_replay = string_new(optarg);
+        break;
+      case 7:
+        if (asgs_prase_uint(&args->esi_replay_latency, optarg) != E_OK ||
+            args->esi_replay_latency > 60 * 1000) {
+          printf("--esi_replay_latency takes an INTEGER between 0 and 60000\n\n%s", MAN);
+          return E_ERR;
+        }
+        break;
+      case 8:
+        if (asgs_prase_uint(&args->esi_replay_errors, optarg) != E_OK ||
+            args->esi_replay_errors > 100) {
+          printf("--esi_replay_errors takes an INTEGER between 0 and 100\n\n%s", MAN);
+          return E_ERR;
+        }
+        break;
+      case 9:
+        if (asgs_prase_uint(&args->order_keyframe, optarg) != E_OK) {
+          printf("--order_keyframe takes an INTEGER value\n\n%s", MAN);
+          return E_ERR;
+        }
+        break;
+      case 10:
+        if (asgs_prase_bool(&args->region_dumps, optarg) != E_OK) {
+          printf("--region_dumps takes a BOOLEAN value\n\n%s", MAN);
+          return E_ERR;
+        }
+        break;
       default:
         panic("unreachable");
     }
@@ -90,6 +167,10 @@ err_t args_parse(int argc, char *argv[], struct args *args) {
     printf("Unrecognized or malformed options\n\n%s", MAN);
     return E_ERR;
   }
+  if (args->esi_record.len > 0 && args->esi_replay.len > 0) {
+    printf("--esi_record and --esi_replay can't be used together\n\n%s", MAN);
+    return E_ERR;
+  }
   return E_OK;
 }
 
@@ -104,7 +185,12 @@ err_t global_init(void) {
     errmsg_fmt("curl_global_init: error %d", (int) crv);
     return E_ERR;
   }
-  err_t err = timezone_set("GMT");
+  err_t err = esi_share_create();
+  if (err != E_OK) {
+    errmsg_prefix("esi_share_create: ");
+    return E_ERR;
+  }
+  err = timezone_set("GMT");
   if (err != E_OK) {
     errmsg_prefix("timezone_set: ");
     return E_ERR;
@@ -157,9 +243,27 @@ int main(int argc, char *argv[]) {
     goto print_error_and_exit;
   }
 
+  if (args.esi_record.len > 0) {
+    err = esi_corpus_record_open(args.esi_record);
+    if (err != E_OK) {
+      errmsg_prefix("esi_corpus_record_open: ");
+      goto print_error_and_exit;
+    }
+  }
+  if (args.esi_replay.len > 0) {
+    err = esi_corpus_replay_load(args.esi_replay, args.esi_replay_latency,
+                                 args.esi_replay_errors / 100.0);
+    if (err != E_OK) {
+      errmsg_prefix("esi_corpus_replay_load: ");
+      goto print_error_and_exit;
+    }
+  }
+
   struct ptr_fifo chan_orders_to_locations = {0};
   struct ptr_fifo active_market_request = {0};
   struct ptr_fifo active_market_response = {0};
+  struct ptr_fifo chan_orders_to_region_dumps = {0};
+  struct ptr_fifo chan_region_dumps_to_orders = {0};
   err = ptr_fifo_init(&chan_orders_to_locations, 32);
   if (err != E_OK) {
     errmsg_prefix("ptr_fifo_init: ");
@@ -175,6 +279,17 @@ int main(int argc, char *argv[]) {
     errmsg_prefix("ptr_fifo_init: ");
     goto print_error_and_exit;
   }
+  // a region is sent at most once per download, sending never blocks
+  err = ptr_fifo_init(&chan_orders_to_region_dumps, global_regions_len);
+  if (err != E_OK) {
+    errmsg_prefix("ptr_fifo_init: ");
+    goto print_error_and_exit;
+  }
+  err = ptr_fifo_init(&chan_region_dumps_to_orders, global_regions_len);
+  if (err != E_OK) {
+    errmsg_prefix("ptr_fifo_init: ");
+    goto print_error_and_exit;
+  }
 
   // first block sigint and sigterm so worker threads inherit from that sigmask
   sigset_t blocker_mask;
@@ -193,7 +308,12 @@ int main(int argc, char *argv[]) {
     .dump_dir = args.dump_dir,
     .history = args.history,
     .structure = args.structure,
+    .concurrency = args.concurrency,
+    .order_keyframe = args.order_keyframe,
+    .region_dumps = args.region_dumps,
     .chan_orders_to_locations = &chan_orders_to_locations,
+    .chan_orders_to_region_dumps = &chan_orders_to_region_dumps,
+    .chan_region_dumps_to_orders = &chan_region_dumps_to_orders,
     .active_market_request = &active_market_request,
     .active_market_response = &active_market_response,
   };
@@ -220,8 +340,24 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  struct hoardling_region_dumps_args hoardling_region_dumps_args = {
+    .dump_dir = args.dump_dir,
+    .chan_orders_to_region_dumps = &chan_orders_to_region_dumps,
+    .chan_region_dumps_to_orders = &chan_region_dumps_to_orders,
+  };
+  pthread_t hoardling_region_dumps_thread;
+  if (args.region_dumps) {
+    rv = pthread_create(&hoardling_region_dumps_thread, NULL, hoardling_region_dumps,
+                        &hoardling_region_dumps_args);
+    if (rv != 0) {
+      errmsg_fmt("pthread_create: %s", strerror(errno));
+      goto print_error_and_exit;
+    }
+  }
+
   struct hoardling_histories_args hoardling_histories_args = {
     .dump_dir = args.dump_dir,
+    .concurrency = args.concurrency,
     .active_market_request = &active_market_request,
     .active_market_response = &active_market_response,
   };
@@ -246,6 +382,10 @@ int main(int argc, char *argv[]) {
     rv = pthread_kill(hoardling_locations_thread, SIGTERM);
     if (rv != 0 && rv != ESRCH) log_error("locations hoardling thread kill failed: %s", strerror(errno));
   }
+  if (args.region_dumps) {
+    rv = pthread_kill(hoardling_region_dumps_thread, SIGTERM);
+    if (rv != 0 && rv != ESRCH) log_error("region dumps hoardling thread kill failed: %s", strerror(errno));
+  }
   if (args.history) {
     rv = pthread_kill(hoardling_histories_thread, SIGTERM);
     if (rv != 0 && rv != ESRCH) log_error("histories hoardling thread kill failed: %s", strerror(errno));
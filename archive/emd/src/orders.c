@@ -15,7 +15,254 @@ struct order {
   double   price;
 };
 
-IMPLEMENT_VEC(struct order, order)
+// Order table
+//
+// The orders are stored column by column, with the narrowest type esi allows
+// for each field (esi gives int32 ids, volumes and durations). A scan of a
+// few fields (location or market extraction) only touches their columns, and
+// a universe snapshot takes 60 bytes per order instead of 96.
+// `struct order` remains the row view of the table, see order_table_get.
+
+enum {
+  ORDER_FLAG_BUY = 1 << 0,
+};
+
+#define ORDER_TABLE_COLUMNS(X) \
+  X(uint64_t, order_id) \
+  X(uint64_t, location_id) \
+  X(uint64_t, issued) \
+  X(double,   price) \
+  X(uint32_t, volume_remain) \
+  X(uint32_t, volume_total) \
+  X(uint32_t, min_volume) \
+  X(uint32_t, type_id) \
+  X(uint32_t, region_id) \
+  X(uint32_t, system_id) \
+  X(uint16_t, duration) \
+  X(int8_t,   range) \
+  X(uint8_t,  flags)
+
+struct order_table {
+#define X(col_type, col_name) col_type *col_name;
+  ORDER_TABLE_COLUMNS(X)
+#undef X
+  size_t len;
+  size_t cap;
+};
+
+// size of one order in a packed table, see order_table_pack
+#define X(col_type, col_name) + sizeof(col_type)
+const size_t ORDER_TABLE_ROW_SIZE = 0 ORDER_TABLE_COLUMNS(X);
+#undef X
+
+// Grow the columns to hold at least `cap` orders
+err_t order_table_reserve(struct order_table *table, size_t cap) {
+  assert(table != NULL);
+  if (table->order_id != NULL && cap <= table->cap) return E_OK;
+  if (cap == 0) cap = 4;
+  // NOTE: a column realloced before a failure is only bigger than needed
+#define X(col_type, col_name) { \
+    col_type *col = realloc(table->col_name, cap * sizeof(col_type)); \
+    if (col == NULL) { \
+      errmsg_fmt("realloc error: %s", strerror(errno)); \
+      return E_ERR; \
+    } \
+    table->col_name = col; \
+  }
+  ORDER_TABLE_COLUMNS(X)
+#undef X
+  table->cap = cap;
+  return E_OK;
+}
+
+// NOTE: a order_table_create call is not necessary, a zeroed table will
+// initialize itself at the first push
+err_t order_table_create(struct order_table *table, size_t cap) {
+  assert(table != NULL);
+  *table = (struct order_table) {0};
+  return order_table_reserve(table, cap);
+}
+
+void order_table_destroy(struct order_table *table) {
+  assert(table != NULL);
+#define X(col_type, col_name) free(table->col_name);
+  ORDER_TABLE_COLUMNS(X)
+#undef X
+  *table = (struct order_table) {0};
+}
+
+// make room for `len` more orders
+err_t order_table_grow(struct order_table *table, size_t len) {
+  if (table->order_id == NULL) {
+    size_t cap = table->cap;
+    table->cap = 0;
+    return order_table_reserve(table, cap > table->len + len ? cap : table->len + len);
+  }
+  if (table->len + len <= table->cap) return E_OK;
+  size_t cap = 2 * table->cap;
+  return order_table_reserve(table, cap > table->len + len ? cap : table->len + len);
+}
+
+err_t order_table_push(struct order_table *table, const struct order *order) {
+  assert(table != NULL);
+  assert(order != NULL);
+  if (order->duration > UINT16_MAX || order->min_volume > UINT32_MAX ||
+      order->volume_remain > UINT32_MAX || order->volume_total > UINT32_MAX ||
+      order->type_id > UINT32_MAX || order->region_id > UINT32_MAX ||
+      order->system_id > UINT32_MAX) {
+    errmsg_fmt("order %" PRIu64 " does not fit in the order table", order->order_id);
+    return E_ERR;
+  }
+  err_t err = order_table_grow(table, 1);
+  if (err != E_OK) {
+    errmsg_prefix("order_table_grow: ");
+    return E_ERR;
+  }
+  size_t i = table->len;
+  table->order_id[i] = order->order_id;
+  table->location_id[i] = order->location_id;
+  table->issued[i] = order->issued;
+  table->price[i] = order->price;
+  table->volume_remain[i] = order->volume_remain;
+  table->volume_total[i] = order->volume_total;
+  table->min_volume[i] = order->min_volume;
+  table->type_id[i] = order->type_id;
+  table->region_id[i] = order->region_id;
+  table->system_id[i] = order->system_id;
+  table->duration[i] = order->duration;
+  table->range[i] = order->range;
+  table->flags[i] = order->is_buy_order ? ORDER_FLAG_BUY : 0;
+  table->len += 1;
+  return E_OK;
+}
+
+struct order order_table_get(const struct order_table *table, size_t i) {
+  assert(table != NULL);
+  if (i >= table->len) {
+    panic("out of bounds");
+  }
+  return (struct order) {
+    .is_buy_order = table->flags[i] & ORDER_FLAG_BUY,
+    .range = table->range[i],
+    .duration = table->duration[i],
+    .issued = table->issued[i],
+    .min_volume = table->min_volume[i],
+    .volume_remain = table->volume_remain[i],
+    .volume_total = table->volume_total[i],
+    .location_id = table->location_id[i],
+    .system_id = table->system_id[i],
+    .type_id = table->type_id[i],
+    .region_id = table->region_id[i],
+    .order_id = table->order_id[i],
+    .price = table->price[i],
+  };
+}
+
+// Append the orders [start, start + len) of `src` to `table`
+err_t order_table_push_slice(struct order_table *table, const struct order_table *src,
+                             size_t start, size_t len) {
+  assert(table != NULL);
+  assert(src != NULL);
+  assert(start + len <= src->len);
+  if (len == 0) return E_OK;
+  err_t err = order_table_grow(table, len);
+  if (err != E_OK) {
+    errmsg_prefix("order_table_grow: ");
+    return E_ERR;
+  }
+#define X(col_type, col_name) \
+  memcpy(table->col_name + table->len, src->col_name + start, len * sizeof(col_type));
+  ORDER_TABLE_COLUMNS(X)
+#undef X
+  table->len += len;
+  return E_OK;
+}
+
+// Write the orders [start, start + len) of `table` in `buf`, column after
+// column. `buf` should hold len * ORDER_TABLE_ROW_SIZE bytes.
+void order_table_pack(const struct order_table *table, size_t start, size_t len, char *buf) {
+  assert(table != NULL);
+  assert(start + len <= table->len);
+#define X(col_type, col_name) \
+  if (len > 0) memcpy(buf, table->col_name + start, len * sizeof(col_type)); \
+  buf += len * sizeof(col_type);
+  ORDER_TABLE_COLUMNS(X)
+#undef X
+}
+
+// Append the orders packed in `packed` by order_table_pack
+err_t order_table_push_packed(struct order_table *table, struct string packed) {
+  assert(table != NULL);
+  if (packed.len % ORDER_TABLE_ROW_SIZE != 0) {
+    errmsg_fmt("packed orders of invalid length %zu", packed.len);
+    return E_ERR;
+  }
+  size_t len = packed.len / ORDER_TABLE_ROW_SIZE;
+  if (len == 0) return E_OK;
+  err_t err = order_table_grow(table, len);
+  if (err != E_OK) {
+    errmsg_prefix("order_table_grow: ");
+    return E_ERR;
+  }
+  const char *buf = packed.buf;
+#define X(col_type, col_name) \
+  memcpy(table->col_name + table->len, buf, len * sizeof(col_type)); \
+  buf += len * sizeof(col_type);
+  ORDER_TABLE_COLUMNS(X)
+#undef X
+  table->len += len;
+  return E_OK;
+}
+
+// Drop the orders whose order_id already appears earlier in `table`, the
+// other orders keep their position relative to each other. `dropped` is set
+// to the number of dropped orders.
+err_t order_table_dedup(struct order_table *table, size_t *dropped) {
+  assert(table != NULL);
+  assert(dropped != NULL);
+  struct uint64_set seen;
+  err_t err = uint64_set_create(&seen, table->len * 2);
+  if (err != E_OK) {
+    errmsg_prefix("uint64_set_create: ");
+    return E_ERR;
+  }
+  size_t len = 0;
+  for (size_t i = 0; i < table->len; ++i) {
+    bool inserted;
+    err = uint64_set_insert(&seen, table->order_id[i], &inserted);
+    if (err != E_OK) {
+      uint64_set_destroy(&seen);
+      errmsg_prefix("uint64_set_insert: ");
+      return E_ERR;
+    }
+    if (!inserted) continue;
+    if (len != i) {
+#define X(col_type, col_name) table->col_name[len] = table->col_name[i];
+      ORDER_TABLE_COLUMNS(X)
+#undef X
+    }
+    len += 1;
+  }
+  uint64_set_destroy(&seen);
+  *dropped = table->len - len;
+  table->len = len;
+  return E_OK;
+}
+
+// Several order tables seen as one, the orders of tables[0] first, without
+// copying them. The universe is a view over the tables of the regions.
+struct order_view {
+  const struct order_table **tables;
+  size_t len;  // number of tables
+};
+
+// total number of orders of the view
+size_t order_view_len(const struct order_view *view) {
+  assert(view != NULL);
+  size_t len = 0;
+  for (size_t t = 0; t < view->len; ++t) len += view->tables[t]->len;
+  return len;
+}
 
 void order_print(struct order *order) {
   assert(order != NULL);
@@ -68,7 +315,7 @@ err_t order_range_str_to_code(const char *str, int8_t *code) {
   return E_OK;
 }
 
-err_t order_parse_page(struct order_vec *order_vec, struct string raw,
+err_t order_parse_page(struct order_table *table, struct string raw,
                        uint64_t region_id) {
   err_t res = E_ERR;
   json_error_t json_err;
@@ -200,9 +447,9 @@ err_t order_parse_page(struct order_vec *order_vec, struct string raw,
     }
 
     time_t issued;
-    err = time_parse(ESI_TIME, json_string_value(json_issued), &issued);
+    err = time_parse_iso(string_new((char *) json_string_value(json_issued)), &issued);
     if (err != E_OK) {
-      errmsg_prefix("time_parse: ");
+      errmsg_prefix("time_parse_iso: ");
       goto cleanup;
     }
 
@@ -222,9 +469,9 @@ err_t order_parse_page(struct order_vec *order_vec, struct string raw,
       .price = json_real_value(json_price),
     };
 
-    err = order_vec_push(order_vec, order);
+    err = order_table_push(table, &order);
     if (err != E_OK) {
-      errmsg_prefix("order_vec_push: ");
+      errmsg_prefix("order_table_push: ");
       goto cleanup;
     }
   }
@@ -236,11 +483,377 @@ cleanup:
   return res;
 }
 
+// Streaming parser
+//
+// order_stream decodes the body of /markets/{region_id}/orders in chunks of
+// any size (the parse workers feed it whole pages). The bytes of each order object are accumulated in `object`
+// and the object is decoded as soon as its closing brace arrives, without
+// building any json DOM. It only understands the flat objects of the esi
+// order schema.
+
+#define ORDER_STREAM_OBJECT_LEN_MAX 1024
+
+enum order_stream_state {
+  ORDER_STREAM_START,   // waiting for '['
+  ORDER_STREAM_ARRAY,   // between two objects
+  ORDER_STREAM_OBJECT,  // inside an object
+  ORDER_STREAM_END,     // after ']'
+};
+
+struct order_stream {
+  struct order_table *table;
+  uint64_t region_id;
+  enum order_stream_state state;
+  bool in_string;
+  bool escaped;
+  size_t object_len;
+  char object[ORDER_STREAM_OBJECT_LEN_MAX + 1];  // null terminated
+};
+
+// decoded orders are pushed to `table`
+void order_stream_init(struct order_stream *stream, struct order_table *table,
+                       uint64_t region_id) {
+  assert(stream != NULL);
+  assert(table != NULL);
+  stream->table = table;
+  stream->region_id = region_id;
+  stream->state = ORDER_STREAM_START;
+  stream->in_string = false;
+  stream->escaped = false;
+  stream->object_len = 0;
+}
+
+bool order_object_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+void order_object_skip_space(const char *obj, size_t *i) {
+  while (order_object_is_space(obj[*i])) *i += 1;
+}
+
+// WARN: escape sequences are not supported, none of the order fields needs
+// them
+err_t order_object_read_string(const char *obj, size_t *i, struct string *str) {
+  if (obj[*i] != '"') {
+    errmsg_fmt("json error: expected a string");
+    return E_ERR;
+  }
+  size_t begin = *i + 1;
+  size_t end = begin;
+  while (obj[end] != '"') {
+    if (obj[end] == '\0' || obj[end] == '\\') {
+      errmsg_fmt("json error: unterminated or escaped string");
+      return E_ERR;
+    }
+    end += 1;
+  }
+  *str = (struct string) { .buf = (char *) obj + begin, .len = end - begin };
+  *i = end + 1;
+  return E_OK;
+}
+
+err_t order_object_read_uint(const char *obj, size_t *i, uint64_t max,
+                             uint64_t *n) {
+  if (!isdigit((unsigned char) obj[*i])) {
+    errmsg_fmt("json error: expected a positive integer");
+    return E_ERR;
+  }
+  uint64_t value = 0;
+  while (isdigit((unsigned char) obj[*i])) {
+    uint64_t digit = obj[*i] - '0';
+    if (value > (max - digit) / 10) {
+      errmsg_fmt("json error: integer out of range");
+      return E_ERR;
+    }
+    value = value * 10 + digit;
+    *i += 1;
+  }
+  if (obj[*i] == '.' || obj[*i] == 'e' || obj[*i] == 'E') {
+    errmsg_fmt("json error: expected an integer");
+    return E_ERR;
+  }
+  *n = value;
+  return E_OK;
+}
+
+err_t order_object_read_real(const char *obj, size_t *i, double *x) {
+  char *endptr;
+  *x = strtod(obj + *i, &endptr);
+  if (endptr == obj + *i) {
+    errmsg_fmt("json error: expected a number");
+    return E_ERR;
+  }
+  *i = endptr - obj;
+  return E_OK;
+}
+
+err_t order_object_read_bool(const char *obj, size_t *i, bool *b) {
+  if (strncmp(obj + *i, "true", 4) == 0) {
+    *b = true;
+    *i += 4;
+  } else if (strncmp(obj + *i, "false", 5) == 0) {
+    *b = false;
+    *i += 5;
+  } else {
+    errmsg_fmt("json error: expected a boolean");
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+// skip a scalar value of an unknown field
+err_t order_object_skip_value(const char *obj, size_t *i) {
+  if (obj[*i] == '"') {
+    struct string str;
+    return order_object_read_string(obj, i, &str);
+  }
+  size_t begin = *i;
+  while (obj[*i] != ',' && obj[*i] != '}' && obj[*i] != '\0' &&
+         !order_object_is_space(obj[*i])) {
+    if (obj[*i] == '{' || obj[*i] == '[') {
+      errmsg_fmt("json error: unexpected nested value");
+      return E_ERR;
+    }
+    *i += 1;
+  }
+  if (*i == begin) {
+    errmsg_fmt("json error: expected a value");
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+bool order_object_key_is(struct string key, const char *name) {
+  size_t name_len = strlen(name);
+  return key.len == name_len && memcmp(key.buf, name, name_len) == 0;
+}
+
+// decode one null terminated order object
+err_t order_parse_object(const char *obj, uint64_t region_id,
+                         struct order *order) {
+  assert(obj != NULL);
+  assert(order != NULL);
+
+  enum {
+    FIELD_DURATION      = 1 << 0,
+    FIELD_IS_BUY_ORDER  = 1 << 1,
+    FIELD_ISSUED        = 1 << 2,
+    FIELD_LOCATION_ID   = 1 << 3,
+    FIELD_MIN_VOLUME    = 1 << 4,
+    FIELD_ORDER_ID      = 1 << 5,
+    FIELD_PRICE         = 1 << 6,
+    FIELD_RANGE         = 1 << 7,
+    FIELD_SYSTEM_ID     = 1 << 8,
+    FIELD_TYPE_ID       = 1 << 9,
+    FIELD_VOLUME_REMAIN = 1 << 10,
+    FIELD_VOLUME_TOTAL  = 1 << 11,
+    FIELD_ALL           = (1 << 12) - 1,
+  };
+
+  *order = (struct order) { .region_id = region_id };
+  unsigned fields = 0;
+  size_t i = 0;
+  err_t err;
+
+  order_object_skip_space(obj, &i);
+  if (obj[i] != '{') {
+    errmsg_fmt("json error: json_order is not an object");
+    return E_ERR;
+  }
+  i += 1;
+
+  while (true) {
+    order_object_skip_space(obj, &i);
+    if (obj[i] == '}' && fields == 0) break;  // empty object
+
+    struct string key;
+    err = order_object_read_string(obj, &i, &key);
+    if (err != E_OK) {
+      errmsg_prefix("order_object_read_string: ");
+      return E_ERR;
+    }
+    order_object_skip_space(obj, &i);
+    if (obj[i] != ':') {
+      errmsg_fmt("json error: expected ':'");
+      return E_ERR;
+    }
+    i += 1;
+    order_object_skip_space(obj, &i);
+
+    uint64_t n;
+    struct string str;
+    if (order_object_key_is(key, "duration")) {
+      err = order_object_read_uint(obj, &i, UINT32_MAX, &n);
+      order->duration = n;
+      fields |= FIELD_DURATION;
+    } else if (order_object_key_is(key, "is_buy_order")) {
+      err = order_object_read_bool(obj, &i, &order->is_buy_order);
+      fields |= FIELD_IS_BUY_ORDER;
+    } else if (order_object_key_is(key, "issued")) {
+      err = order_object_read_string(obj, &i, &str);
+      if (err == E_OK) {
+        time_t issued;
+        err = time_parse_iso(str, &issued);
+        order->issued = issued;
+      }
+      fields |= FIELD_ISSUED;
+    } else if (order_object_key_is(key, "location_id")) {
+      err = order_object_read_uint(obj, &i, UINT64_MAX, &order->location_id);
+      fields |= FIELD_LOCATION_ID;
+    } else if (order_object_key_is(key, "min_volume")) {
+      err = order_object_read_uint(obj, &i, UINT64_MAX, &order->min_volume);
+      fields |= FIELD_MIN_VOLUME;
+    } else if (order_object_key_is(key, "order_id")) {
+      err = order_object_read_uint(obj, &i, UINT64_MAX, &order->order_id);
+      fields |= FIELD_ORDER_ID;
+    } else if (order_object_key_is(key, "price")) {
+      err = order_object_read_real(obj, &i, &order->price);
+      fields |= FIELD_PRICE;
+    } else if (order_object_key_is(key, "range")) {
+      err = order_object_read_string(obj, &i, &str);
+      if (err == E_OK) {
+        const size_t RANGE_LEN_MAX = 16;
+        char range_nt[RANGE_LEN_MAX];
+        if (str.len >= RANGE_LEN_MAX) {
+          errmsg_fmt("json error: range is too long");
+          return E_ERR;
+        }
+        string_null_terminate(str, range_nt, RANGE_LEN_MAX);
+        err = order_range_str_to_code(range_nt, &order->range);
+        if (err != E_OK) errmsg_fmt("invalid range \"%s\"", range_nt);
+      }
+      fields |= FIELD_RANGE;
+    } else if (order_object_key_is(key, "system_id")) {
+      err = order_object_read_uint(obj, &i, UINT64_MAX, &order->system_id);
+      fields |= FIELD_SYSTEM_ID;
+    } else if (order_object_key_is(key, "type_id")) {
+      err = order_object_read_uint(obj, &i, UINT64_MAX, &order->type_id);
+      fields |= FIELD_TYPE_ID;
+    } else if (order_object_key_is(key, "volume_remain")) {
+      err = order_object_read_uint(obj, &i, UINT64_MAX, &order->volume_remain);
+      fields |= FIELD_VOLUME_REMAIN;
+    } else if (order_object_key_is(key, "volume_total")) {
+      err = order_object_read_uint(obj, &i, UINT64_MAX, &order->volume_total);
+      fields |= FIELD_VOLUME_TOTAL;
+    } else {
+      err = order_object_skip_value(obj, &i);
+    }
+    if (err != E_OK) {
+      errmsg_prefix("field ");
+      return E_ERR;
+    }
+
+    order_object_skip_space(obj, &i);
+    if (obj[i] == ',') {
+      i += 1;
+    } else if (obj[i] == '}') {
+      break;
+    } else {
+      errmsg_fmt("json error: expected ',' or '}'");
+      return E_ERR;
+    }
+  }
+
+  if (fields != FIELD_ALL) {
+    errmsg_fmt("json error: order is missing fields (0x%x)", fields);
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+err_t order_stream_feed(struct order_stream *stream, const char *buf,
+                        size_t len) {
+  assert(stream != NULL);
+  assert(buf != NULL || len == 0);
+
+  for (size_t i = 0; i < len; ++i) {
+    char c = buf[i];
+    switch (stream->state) {
+      case ORDER_STREAM_START:
+        if (c == '[') {
+          stream->state = ORDER_STREAM_ARRAY;
+        } else if (!order_object_is_space(c)) {
+          errmsg_fmt("json error: root is not an array");
+          return E_ERR;
+        }
+        break;
+
+      case ORDER_STREAM_ARRAY:
+        if (c == '{') {
+          stream->state = ORDER_STREAM_OBJECT;
+          stream->in_string = false;
+          stream->escaped = false;
+          stream->object[0] = '{';
+          stream->object_len = 1;
+        } else if (c == ']') {
+          stream->state = ORDER_STREAM_END;
+        } else if (c != ',' && !order_object_is_space(c)) {
+          errmsg_fmt("json error: json_order is not an object");
+          return E_ERR;
+        }
+        break;
+
+      case ORDER_STREAM_OBJECT:
+        if (stream->object_len >= ORDER_STREAM_OBJECT_LEN_MAX) {
+          errmsg_fmt("json error: order object longer than %d bytes",
+                     ORDER_STREAM_OBJECT_LEN_MAX);
+          return E_ERR;
+        }
+        stream->object[stream->object_len++] = c;
+
+        if (stream->in_string) {
+          if (stream->escaped) {
+            stream->escaped = false;
+          } else if (c == '\\') {
+            stream->escaped = true;
+          } else if (c == '"') {
+            stream->in_string = false;
+          }
+        } else if (c == '"') {
+          stream->in_string = true;
+        } else if (c == '}') {
+          stream->object[stream->object_len] = '\0';
+          struct order order;
+          err_t err = order_parse_object(stream->object, stream->region_id, &order);
+          if (err != E_OK) {
+            errmsg_prefix("order_parse_object: ");
+            return E_ERR;
+          }
+          err = order_table_push(stream->table, &order);
+          if (err != E_OK) {
+            errmsg_prefix("order_table_push: ");
+            return E_ERR;
+          }
+          stream->state = ORDER_STREAM_ARRAY;
+        }
+        break;
+
+      case ORDER_STREAM_END:
+        if (!order_object_is_space(c)) {
+          errmsg_fmt("json error: trailing data after root array");
+          return E_ERR;
+        }
+        break;
+    }
+  }
+  return E_OK;
+}
+
+// must be called once the whole body has been fed
+err_t order_stream_finish(struct order_stream *stream) {
+  assert(stream != NULL);
+  if (stream->state != ORDER_STREAM_END) {
+    errmsg_fmt("json error: truncated body");
+    return E_ERR;
+  }
+  return E_OK;
+}
+
 // page_count can be NULL. If it's not NULL, order_download_page will error in case 
 // esi_fetch return a 0 page_count
-err_t order_download_page(struct order_vec *order_vec, uint64_t region_id,
+err_t order_download_page(struct order_table *table, uint64_t region_id,
                           size_t page, size_t *page_count) {
-  assert(order_vec != NULL);
+  assert(table != NULL);
   assert(page >= 1);
 
   // log_print("order_download region %" PRIu64 " page %zu", region_id, page);
@@ -260,7 +873,7 @@ err_t order_download_page(struct order_vec *order_vec, uint64_t region_id,
     goto cleanup;
   }
 
-  err = order_parse_page(order_vec, response.body, region_id);
+  err = order_parse_page(table, response.body, region_id);
   if (err != E_OK) {
     errmsg_prefix("order_parse_page: ");
     goto cleanup;
@@ -278,109 +891,1662 @@ cleanup:
   return res;
 }
 
-// order_vec is empty on error
-// out_expiration is the expiration date of the returned data
-err_t order_download_universe(struct order_vec *order_vec, uint64_t regions[],
-                              size_t regions_len) {
-  err_t res = E_ERR;
+struct order_page {
+  size_t region_idx;  // index in the `regions` array of order_download_regions
+  size_t page;
+};
 
-  for (size_t i = 0; i < regions_len; ++i) {
-    uint64_t region_id = regions[i];
-    size_t region_page_count;
+IMPLEMENT_VEC(struct order_page, order_page)
 
-    err_t err = order_download_page(order_vec, region_id, 1, &region_page_count);
-    if (err != E_OK) {
-      errmsg_prefix("order_download_page: ");
-      goto cleanup;
-    }
+struct order_request {
+  struct esi_request esi;
+  struct order_page page;
+  bool busy;
+};
 
-    for (size_t page = 2; page <= region_page_count; ++page) {
-      size_t page_count;
+err_t order_request_add(struct esi_multi *multi, struct order_request *req,
+                        struct order_page page, uint64_t region_id) {
+  assert(req != NULL);
+  assert(!req->busy);
 
-      err_t err = order_download_page(order_vec, region_id, page, &page_count);
-      if (err != E_OK) {
-        errmsg_prefix("order_download_page: ");
-        goto cleanup;
-      }
+  const size_t URI_LEN_MAX = 2048;
+  char uri_buf[URI_LEN_MAX];
+  struct string uri = string_fmt(uri_buf, URI_LEN_MAX,
+                                 "/markets/%" PRIu64 "/orders?page=%zu",
+                                 region_id, page.page);
+  err_t err = esi_request_prepare(&req->esi, string_new("GET"), uri,
+                                  (struct string) {0}, false, 5);
+  if (err != E_OK) {
+    errmsg_prefix("esi_request_prepare: ");
+    return E_ERR;
+  }
+  err = esi_request_use_cache(&req->esi, uri);
+  if (err != E_OK) {
+    errmsg_prefix("esi_request_use_cache: ");
+    return E_ERR;
+  }
+  req->esi.data = req;
+  req->page = page;
 
-      if (page_count != region_page_count) {
-        log_warn("order_download: page_count changed during the download");
-        region_page_count = page_count;
-      }
-    }
+  err = esi_multi_add(multi, &req->esi);
+  if (err != E_OK) {
+    errmsg_prefix("esi_multi_add: ");
+    return E_ERR;
   }
+  req->busy = true;
+  return E_OK;
+}
 
-  res = E_OK;
+// Refresh state of a region
+struct order_region {
+  uint64_t region_id;
+  struct order_table table;   // orders of the region as of its last download
+  time_t expires;             // expiry of the region's orders, 0 if never downloaded
+  time_t modified;            // Last-Modified of the region's orders, 0 if unknown
+  struct uint64_vec markets;  // distinct market keys of `table`, see order_market_key
+  bool changed;               // `table` changed since the last order_region_snapshot
+  struct order_table snapshot;  // orders as of the last order_region_snapshot if changed
+};
 
-cleanup:
-  if (res != E_OK) order_vec->len = 0;
-  return res;
+// Pack a (region_id, type_id) market in a single key. Both ids fit in 32 bits.
+uint64_t order_market_key(uint64_t region_id, uint64_t type_id) {
+  assert(region_id <= UINT32_MAX && type_id <= UINT32_MAX);
+  return region_id << 32 | type_id;
 }
 
-// locid_vec should be initialized
-// NOTE: using a struct of array for order_vec would improve the performances here
-err_t order_fill_location_id_vec(struct uint64_vec *locid_vec,
-                                 struct order_vec *order_vec) {
-  assert(locid_vec != NULL);
-  assert(order_vec != NULL);
+uint64_t order_market_key_region_id(uint64_t key) {
+  return key >> 32;
+}
 
-  // TODO: remove
-  time_t debug_start = time(NULL);
+uint64_t order_market_key_type_id(uint64_t key) {
+  return key & UINT32_MAX;
+}
+
+// Fill `key_vec` with the distinct market keys of `table`, in order of
+// first appearance.
+err_t order_fill_market_key_vec(struct uint64_vec *key_vec, const struct order_table *table) {
+  assert(key_vec != NULL);
+  assert(table != NULL);
+  key_vec->len = 0;
 
-  for (size_t i = 0; i < order_vec->len; ++i) {
-    size_t j;
-    for (j = 0; j < locid_vec->len; ++j) {
-      if (locid_vec->buf[j] == order_vec->buf[i].location_id) break;
+  struct uint64_set seen = {0};
+  err_t err = uint64_set_create(&seen, 1024);
+  if (err != E_OK) {
+    errmsg_prefix("uint64_set_create: ");
+    return E_ERR;
+  }
+  for (size_t i = 0; i < table->len; ++i) {
+    uint64_t key = order_market_key(table->region_id[i], table->type_id[i]);
+    bool inserted;
+    err = uint64_set_insert(&seen, key, &inserted);
+    if (err != E_OK) {
+      errmsg_prefix("uint64_set_insert: ");
+      goto cleanup;
     }
-    if (j >= locid_vec->len) {
-      err_t err = uint64_vec_push(locid_vec, order_vec->buf[i].location_id);
+    if (inserted) {
+      err = uint64_vec_push(key_vec, key);
       if (err != E_OK) {
         errmsg_prefix("uint64_vec_push: ");
-        return E_ERR;
+        goto cleanup;
       }
     }
   }
 
-  // TODO: remove
-  time_t debug_end = time(NULL);
-  log_print("DEBUG: order_fill_location_id_vec duration %d", debug_end - debug_start);
+cleanup:
+  uint64_set_destroy(&seen);
+  if (err != E_OK) key_vec->len = 0;
+  return err;
+}
+
+const time_t ORDER_REFRESH_DEFAULT = 60 * 5;  // used when esi gives no Expires
+const time_t ORDER_REFRESH_MIN = 10;          // guards against clock skew
+const time_t ORDER_REFRESH_GATHER = 10;       // see order_region_next_refresh
 
+// WARN: You then need to destroy the regions with order_region_destroy_all
+err_t order_region_create_all(struct order_region **regions, uint64_t region_ids[],
+                              size_t regions_len) {
+  assert(regions != NULL);
+  *regions = calloc(regions_len, sizeof(struct order_region));
+  if (*regions == NULL) {
+    errmsg_fmt("calloc: %s", strerror(errno));
+    return E_ERR;
+  }
+  for (size_t i = 0; i < regions_len; ++i) {
+    (*regions)[i] = (struct order_region) {
+      .region_id = region_ids[i],
+      .table = { .cap = 256 },
+      .expires = 0,
+      .markets = { .cap = 256 },
+    };
+  }
   return E_OK;
 }
 
-err_t dump_write_order(struct dump *dump, struct order *order) {
-  assert(order != NULL);
-  if (dump_write_uint8(dump, order->is_buy_order) != E_OK) goto error;
-  if (dump_write_int8(dump, order->range) != E_OK) goto error;
-  if (dump_write_uint32(dump, order->duration) != E_OK) goto error;
-  if (dump_write_uint64(dump, order->issued) != E_OK) goto error;
-  if (dump_write_uint64(dump, order->min_volume) != E_OK) goto error;
-  if (dump_write_uint64(dump, order->volume_remain) != E_OK) goto error;
-  if (dump_write_uint64(dump, order->volume_total) != E_OK) goto error;
-  if (dump_write_uint64(dump, order->location_id) != E_OK) goto error;
-  if (dump_write_uint64(dump, order->system_id) != E_OK) goto error;
-  if (dump_write_uint64(dump, order->type_id) != E_OK) goto error;
-  if (dump_write_uint64(dump, order->region_id) != E_OK) goto error;
-  if (dump_write_uint64(dump, order->order_id) != E_OK) goto error;
-  if (dump_write_float64(dump, order->price) != E_OK) goto error;
+void order_region_destroy_all(struct order_region *regions, size_t regions_len) {
+  if (regions == NULL) return;
+  for (size_t i = 0; i < regions_len; ++i) {
+    order_table_destroy(&regions[i].table);
+    order_table_destroy(&regions[i].snapshot);
+    uint64_vec_destroy(&regions[i].markets);
+  }
+  free(regions);
+}
+
+// The tables of `regions` seen as one
+// WARN: You then need to destroy the view with order_view_destroy. It stays
+// valid as long as `regions` does, the tables are swapped in place.
+err_t order_region_view(struct order_view *view, const struct order_region *regions,
+                        size_t regions_len) {
+  assert(view != NULL);
+  view->tables = malloc((regions_len + 1) * sizeof(struct order_table *));
+  if (view->tables == NULL) {
+    errmsg_fmt("malloc: %s", strerror(errno));
+    return E_ERR;
+  }
+  for (size_t i = 0; i < regions_len; ++i) view->tables[i] = &regions[i].table;
+  view->len = regions_len;
   return E_OK;
+}
 
-error:
-  errmsg_prefix("dump_write_uint8/int8/uint64/float64: ");
-  return E_ERR;
+void order_view_destroy(struct order_view *view) {
+  assert(view != NULL);
+  free(view->tables);
+  *view = (struct order_view) {0};
 }
 
-err_t dump_write_order_table(struct dump *dump, struct order *order,
-                             size_t order_len) {
-  if (dump_write_uint64(dump, order_len) != E_OK) {
-    errmsg_prefix("dump_write_uint64: ");
-    return E_ERR;
+// Take the current orders of the regions as the base of the next
+// order_region_delta_compute, the orders kept for the previous one are dropped
+void order_region_snapshot(struct order_region *regions, size_t regions_len) {
+  for (size_t i = 0; i < regions_len; ++i) {
+    order_table_destroy(&regions[i].snapshot);
+    regions[i].changed = false;
+  }
+}
+
+// Time at which the next regions should be downloaded.
+// ESI tends to expire the regions a few seconds apart. Rather than waking up
+// for each of them, regions expiring within ORDER_REFRESH_GATHER seconds of
+// the first one are refreshed together, one second after the last of them
+// expired (the Expires header only has a one second resolution).
+time_t order_region_next_refresh(const struct order_region *regions, size_t regions_len) {
+  assert(regions_len > 0);
+  time_t first = regions[0].expires;
+  for (size_t i = 1; i < regions_len; ++i) {
+    if (regions[i].expires < first) first = regions[i].expires;
+  }
+  if (first == 0) {
+    return 0;  // some region was never downloaded
+  }
+  time_t last = first;
+  for (size_t i = 0; i < regions_len; ++i) {
+    if (regions[i].expires <= first + ORDER_REFRESH_GATHER && regions[i].expires > last) {
+      last = regions[i].expires;
+    }
   }
-  for (size_t i = 0; i < order_len; ++i) {
-    if (dump_write_order(dump, order + i) != E_OK) {
-      errmsg_prefix("dump_write_order :");
+  return last + 1;
+}
+
+bool order_region_is_due(const struct order_region *region, time_t now) {
+  return region->expires == 0 || region->expires < now;
+}
+
+// Whether the region did not change since its last download, given the
+// Last-Modified of its fresh first page
+bool order_region_is_carried(const struct order_region *region, time_t fresh_modified) {
+  return region->expires != 0 && region->modified != 0 && region->modified == fresh_modified;
+}
+
+// table is empty on error
+err_t order_region_concat(struct order_table *table, const struct order_region *regions,
+                          size_t regions_len) {
+  assert(table != NULL);
+  table->len = 0;
+  for (size_t i = 0; i < regions_len; ++i) {
+    err_t err = order_table_push_slice(table, &regions[i].table, 0, regions[i].table.len);
+    if (err != E_OK) {
+      table->len = 0;
+      errmsg_prefix("order_table_push_slice: ");
       return E_ERR;
     }
   }
   return E_OK;
 }
+
+// A page body handed to the parse workers, and the orders decoded from it
+struct order_parse_job {
+  struct order_page page;
+  size_t fetch;                   // the page might be fetched again before it is parsed
+  uint64_t region_id;
+  struct string body;             // order page json
+  struct string cache_uri;        // empty if the page is not cached
+  char etag[ESI_ETAG_LEN_MAX + 1];
+  size_t pages;
+  struct order_table table;       // decoded orders, filled by the worker
+  err_t err;                      // outcome of the parse, set by the worker
+};
+
+void order_parse_job_destroy(struct order_parse_job *job) {
+  string_destroy(&job->body);
+  string_destroy(&job->cache_uri);
+  order_table_destroy(&job->table);
+  free(job);
+}
+
+// Decode the page of `job` and store the decoded orders in the esi cache.
+// Errors are reported in `job->err`.
+void order_parse_job_run(struct order_parse_job *job) {
+  struct order_stream stream;
+  order_stream_init(&stream, &job->table, job->region_id);
+  job->err = order_stream_feed(&stream, job->body.buf, job->body.len);
+  if (job->err == E_OK) job->err = order_stream_finish(&stream);
+  if (job->err != E_OK) {
+    log_warn("order_parse: region %" PRIu64 " page %zu", job->region_id, job->page.page);
+    errmsg_prefix("order_stream_feed/order_stream_finish: ");
+    errmsg_print();
+    return;
+  }
+  if (job->cache_uri.buf == NULL) return;
+
+  struct string payload = {
+    .buf = malloc(job->table.len * ORDER_TABLE_ROW_SIZE + 1),
+    .len = job->table.len * ORDER_TABLE_ROW_SIZE,
+  };
+  if (payload.buf == NULL) {
+    log_warn("order_parse: malloc: %s", strerror(errno));
+    return;  // not a big deal, the page will be decoded next time
+  }
+  order_table_pack(&job->table, 0, job->table.len, payload.buf);
+  err_t err = esi_cache_put(job->cache_uri, job->etag, job->pages, payload);
+  free(payload.buf);
+  if (err != E_OK) {
+    errmsg_prefix("esi_cache_put: ");
+    errmsg_print();
+  }
+}
+
+// Pool of threads decoding order pages while order_download_regions keeps
+// downloading. At most ORDER_PARSE_PENDING_MAX jobs are submitted and not
+// collected yet, so that neither fifo ever blocks.
+struct order_parser {
+  struct ptr_fifo jobs;
+  struct ptr_fifo results;
+  pthread_t *workers;
+  size_t workers_len;
+  size_t pending;  // jobs submitted and not collected
+};
+
+#define ORDER_PARSE_WORKERS_MAX 16
+const size_t ORDER_PARSE_PENDING_MAX = 64;
+struct order_parse_job order_parse_stop;  // asks a worker to quit
+
+// one worker per core
+size_t order_parse_worker_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) return 1;
+  if (cores > ORDER_PARSE_WORKERS_MAX) return ORDER_PARSE_WORKERS_MAX;
+  return cores;
+#else
+  return 4;
+#endif
+}
+
+void *order_parse_worker(void *data) {
+  struct order_parser *parser = data;
+  while (true) {
+    void *ptr;
+    err_t err = ptr_fifo_pop(&parser->jobs, &ptr, 60);
+    if (err == E_EMPTY) {
+      continue;
+    } else if (err != E_OK) {
+      errmsg_prefix("order_parse_worker: ptr_fifo_pop: ");
+      errmsg_print();
+      continue;
+    }
+    struct order_parse_job *job = ptr;
+    if (job == &order_parse_stop) return NULL;
+    order_parse_job_run(job);
+    err = ptr_fifo_push(&parser->results, job, 5);
+    if (err != E_OK) panic("results can't be full");
+  }
+}
+
+void order_parser_stop(struct order_parser *parser);
+
+err_t order_parser_start(struct order_parser *parser, size_t workers_len) {
+  assert(parser != NULL);
+  assert(workers_len >= 1 && workers_len <= ORDER_PARSE_WORKERS_MAX);
+  *parser = (struct order_parser) {0};
+
+  err_t err = ptr_fifo_init(&parser->jobs, ORDER_PARSE_PENDING_MAX + ORDER_PARSE_WORKERS_MAX);
+  if (err != E_OK) {
+    errmsg_prefix("ptr_fifo_init: ");
+    return E_ERR;
+  }
+  err = ptr_fifo_init(&parser->results, ORDER_PARSE_PENDING_MAX);
+  if (err != E_OK) {
+    ptr_fifo_destroy(&parser->jobs);
+    errmsg_prefix("ptr_fifo_init: ");
+    return E_ERR;
+  }
+  parser->workers = calloc(workers_len, sizeof(pthread_t));
+  if (parser->workers == NULL) {
+    errmsg_fmt("calloc: %s", strerror(errno));
+    order_parser_stop(parser);
+    return E_ERR;
+  }
+  for (; parser->workers_len < workers_len; ++parser->workers_len) {
+    int rv = pthread_create(&parser->workers[parser->workers_len], NULL, order_parse_worker,
+                            parser);
+    if (rv != 0) {
+      errmsg_fmt("pthread_create: %s", strerror(rv));
+      order_parser_stop(parser);
+      return E_ERR;
+    }
+  }
+  return E_OK;
+}
+
+// Ownership of `job` is passed to the parser
+// WARN: the parser must have less than ORDER_PARSE_PENDING_MAX pending jobs
+err_t order_parser_submit(struct order_parser *parser, struct order_parse_job *job) {
+  assert(parser->pending < ORDER_PARSE_PENDING_MAX);
+  err_t err = ptr_fifo_push(&parser->jobs, job, 5);
+  if (err != E_OK) {
+    errmsg_prefix("ptr_fifo_push: ");
+    return E_ERR;
+  }
+  parser->pending += 1;
+  return E_OK;
+}
+
+// Take a parsed job back, in the order they are parsed. Waits for one if
+// `wait`, returns E_EMPTY otherwise if none is parsed yet.
+// WARN: You then need to call order_parse_job_destroy
+err_t order_parser_collect(struct order_parser *parser, struct order_parse_job **job,
+                           bool wait) {
+  assert(parser->pending > 0);
+  void *ptr;
+  err_t err;
+  do {
+    err = wait ? ptr_fifo_pop(&parser->results, &ptr, 60)
+               : ptr_fifo_try_pop(&parser->results, &ptr);
+  } while (wait && err == E_EMPTY);
+  if (err == E_EMPTY) {
+    return E_EMPTY;
+  } else if (err != E_OK) {
+    errmsg_prefix("ptr_fifo_pop: ");
+    return E_ERR;
+  }
+  parser->pending -= 1;
+  *job = ptr;
+  return E_OK;
+}
+
+// Stop the workers once they are done with the submitted jobs, and drop the
+// jobs that were not collected
+void order_parser_stop(struct order_parser *parser) {
+  for (size_t i = 0; i < parser->workers_len; ++i) {
+    err_t err = ptr_fifo_push(&parser->jobs, &order_parse_stop, 5);
+    if (err != E_OK) panic("jobs can't be full");
+  }
+  for (size_t i = 0; i < parser->workers_len; ++i) {
+    pthread_join(parser->workers[i], NULL);
+  }
+  while (parser->pending > 0) {
+    struct order_parse_job *job;
+    err_t err = order_parser_collect(parser, &job, false);
+    if (err != E_OK) panic("the workers are done with every job");
+    order_parse_job_destroy(job);
+  }
+  free(parser->workers);
+  ptr_fifo_destroy(&parser->results);
+  ptr_fifo_destroy(&parser->jobs);
+}
+
+// A downloaded page of a region within order_download_regions
+struct order_region_page {
+  struct order_table table;  // orders of the page
+  time_t modified;           // last modification of the page, 0 if unknown
+  size_t fetch;              // number of responses received for the page
+};
+
+// Download state of a region within order_download_regions
+struct order_region_download {
+  bool due;
+  bool failed;               // a page of the region could not be downloaded
+  size_t page_count;         // 0 until known
+  size_t outstanding;        // pages of the region queued, in flight or being parsed
+  struct order_region_page *pages;  // merged in page order into `table`
+  size_t pages_len;
+  size_t refetches;          // pages fetched again because they were out of date
+  bool inconsistent;         // the region ran out of refetches
+  struct order_table table;  // fresh orders of the region
+  time_t expires;            // expiry of the first page
+  time_t modified;           // last modification of the newest page
+};
+
+// Called by order_download_regions with each region whose orders changed,
+// as soon as they are swapped in
+// WARN: called from the download loop, the transfers in flight are held up
+// until it returns
+struct order_region_listener {
+  void (*updated)(const struct order_region *region, time_t now, void *data);
+  void *data;
+};
+
+struct order_download_stats {
+  size_t due;
+  size_t carried;
+  size_t failed;
+  size_t pages;
+  size_t not_modified;
+  size_t refetched;
+  size_t duplicates;
+  size_t inconsistent;
+};
+
+const time_t ORDER_REGION_RETRY = 30;  // delay before downloading a failed region again
+const size_t ORDER_REGION_REFETCH_MAX = 16;  // out of date pages fetched again per region
+
+void order_region_download_drop_pages(struct order_region_download *dl) {
+  for (size_t p = 0; p < dl->pages_len; ++p) {
+    order_table_destroy(&dl->pages[p].table);
+  }
+  free(dl->pages);
+  dl->pages = NULL;
+  dl->pages_len = 0;
+}
+
+// The state of the page `page` of `dl`
+err_t order_region_download_page(struct order_region_download *dl, size_t page,
+                                 struct order_region_page **slot) {
+  assert(page >= 1);
+  if (page > dl->pages_len) {
+    struct order_region_page *pages = realloc(dl->pages, page * sizeof(struct order_region_page));
+    if (pages == NULL) {
+      errmsg_fmt("realloc: %s", strerror(errno));
+      return E_ERR;
+    }
+    memset(pages + dl->pages_len, 0, (page - dl->pages_len) * sizeof(struct order_region_page));
+    dl->pages = pages;
+    dl->pages_len = page;
+  }
+  *slot = &dl->pages[page - 1];
+  return E_OK;
+}
+
+// Queue `page` of `dl` again because it is older than the other pages.
+// Returns E_FULL once the region used up its ORDER_REGION_REFETCH_MAX refetches.
+err_t order_region_refetch(struct order_page_vec *queue, struct order_region_download *dl,
+                           struct order_page page, struct order_download_stats *stats) {
+  if (dl->refetches >= ORDER_REGION_REFETCH_MAX) return E_FULL;
+  err_t err = order_page_vec_push(queue, page);
+  if (err != E_OK) {
+    errmsg_prefix("order_page_vec_push: ");
+    return E_ERR;
+  }
+  dl->refetches += 1;
+  dl->outstanding += 1;
+  stats->refetched += 1;
+  return E_OK;
+}
+
+// esi rebuilds the pages of a region while they are walked, a page whose
+// Last-Modified differs from the others holds another version of the orders,
+// some of them shifted to other pages. The older pages are fetched again
+// until every page has the same version, so that no order is missed.
+// `slot` just received a response last modified at `modified`.
+err_t order_region_check_page(struct order_page_vec *queue, struct order_region *region,
+                              struct order_region_download *dl, struct order_page page,
+                              time_t modified, struct order_download_stats *stats) {
+  if (modified == 0 || dl->modified == 0 || modified == dl->modified) return E_OK;
+
+  err_t err = E_OK;
+  if (modified < dl->modified) {
+    err = order_region_refetch(queue, dl, page, stats);
+  } else {
+    dl->modified = modified;
+    for (size_t p = 1; p <= dl->pages_len && err == E_OK; ++p) {
+      struct order_region_page *slot = &dl->pages[p - 1];
+      if (p == page.page || slot->modified == 0 || slot->modified >= modified) continue;
+      struct order_page stale = { .region_idx = page.region_idx, .page = p };
+      err = order_region_refetch(queue, dl, stale, stats);
+      if (err == E_OK) slot->modified = 0;  // do not queue it twice
+    }
+  }
+  if (err == E_FULL) {
+    if (dl->inconsistent) return E_OK;  // only warn once
+    log_warn("order_download: region %" PRIu64 " keeps changing, its pages might be "
+             "inconsistent", region->region_id);
+    stats->inconsistent += 1;
+    dl->inconsistent = true;
+    return E_OK;
+  } else if (err != E_OK) {
+    errmsg_prefix("order_region_refetch: ");
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+// Swap the fresh orders of a region in once all its pages are done, or
+// schedule a retry of the region if one of them failed
+err_t order_region_finish(struct order_region *region, struct order_region_download *dl,
+                          time_t now, const struct order_region_listener *listener,
+                          struct order_download_stats *stats) {
+  assert(dl->due && dl->outstanding == 0);
+  dl->due = false;
+  if (dl->failed) {
+    order_region_download_drop_pages(dl);
+    log_warn("order_download: region %" PRIu64 " failed, retrying in %lds",
+             region->region_id, (long) ORDER_REGION_RETRY);
+    region->expires = now + ORDER_REGION_RETRY;
+    stats->failed += 1;
+    return E_OK;
+  }
+
+  // the markets of a carried over region did not change either
+  bool carried = order_region_is_carried(region, dl->modified);
+  if (!carried) {
+    // pages past page_count are left from before the region shrank
+    for (size_t p = 0; p < dl->pages_len && p < dl->page_count; ++p) {
+      const struct order_table *page = &dl->pages[p].table;
+      err_t err = order_table_push_slice(&dl->table, page, 0, page->len);
+      if (err != E_OK) {
+        errmsg_prefix("order_table_push_slice: ");
+        return E_ERR;
+      }
+    }
+    order_region_download_drop_pages(dl);
+    // orders that moved between two pages while they were fetched
+    size_t duplicates;
+    err_t err = order_table_dedup(&dl->table, &duplicates);
+    if (err != E_OK) {
+      errmsg_prefix("order_table_dedup: ");
+      return E_ERR;
+    }
+    if (duplicates > 0 || dl->refetches > 0) {
+      log_print("order_download: region %" PRIu64 ", %zu pages fetched again, %zu duplicate "
+                "orders dropped", region->region_id, dl->refetches, duplicates);
+    }
+    stats->duplicates += duplicates;
+    struct uint64_vec markets = { .cap = region->markets.len + 16 };
+    err = order_fill_market_key_vec(&markets, &dl->table);
+    if (err != E_OK) {
+      uint64_vec_destroy(&markets);
+      errmsg_prefix("order_fill_market_key_vec: ");
+      return E_ERR;
+    }
+    uint64_vec_destroy(&region->markets);
+    region->markets = markets;
+  }
+  struct order_table old_table = region->table;
+  region->table = dl->table;
+  region->expires = dl->expires;
+  region->modified = dl->modified;
+  if (!carried && !region->changed) {
+    // the base of the next delta, see order_region_delta_compute
+    region->snapshot = old_table;
+    region->changed = true;
+    dl->table = (struct order_table) {0};
+  } else {
+    dl->table = old_table;
+  }
+
+  if (!carried && listener != NULL) {
+    listener->updated(region, now, listener->data);
+  }
+  return E_OK;
+}
+
+// Account for a page of `dl` leaving the queue, the region is finished with
+// its last page
+err_t order_region_page_done(struct order_region *region, struct order_region_download *dl,
+                             time_t now, const struct order_region_listener *listener,
+                             struct order_download_stats *stats) {
+  assert(dl->outstanding > 0);
+  dl->outstanding -= 1;
+  if (dl->outstanding > 0) return E_OK;
+  return order_region_finish(region, dl, now, listener, stats);
+}
+
+// Hand the body of a downloaded page to the parser, or push the orders of a
+// not modified page to its region, and queue the next pages of the region.
+// `parsing` is set if the page is left to the parser. An error fails the
+// region only.
+err_t order_download_page_handle(struct order_page_vec *queue, struct order_parser *parser,
+                                 struct order_region *region, struct order_region_download *dl,
+                                 struct order_request *req, time_t now,
+                                 struct order_download_stats *stats, bool *parsing) {
+  struct esi_request *done = &req->esi;
+  struct order_page page = req->page;
+  if (done->err != E_OK) {
+    errmsg_prefix("esi_fetch: ");
+    return E_ERR;
+  }
+
+  size_t page_count = done->response.pages;
+  if (page.page == 1) {
+    time_t expires = done->response.expires;
+    if (expires == 0) {
+      expires = now + ORDER_REFRESH_DEFAULT;
+    } else if (expires < now + ORDER_REFRESH_MIN) {
+      expires = now + ORDER_REFRESH_MIN;
+    }
+    dl->expires = expires;
+    if (dl->page_count == 0) dl->modified = done->response.modified;
+  }
+  stats->pages += 1;
+  if (page_count == 0) {
+    errmsg_fmt("page_count is null, that likely mean esi_fetch could not get page_count");
+    return E_ERR;
+  }
+
+  // esi rebuilds all the pages of a region at once, if the region was not
+  // modified since its last download its orders are carried over instead of
+  // fetching the other pages (see order_region_is_carried)
+  err_t err;
+  if (page.page == 1 && dl->page_count == 0 && order_region_is_carried(region, dl->modified)) {
+    dl->table.len = 0;
+    err = order_table_push_slice(&dl->table, &region->table, 0, region->table.len);
+    if (err != E_OK) {
+      errmsg_prefix("order_table_push_slice: ");
+      return E_ERR;
+    }
+    dl->page_count = page_count;
+    stats->carried += 1;
+    return E_OK;
+  }
+
+  struct order_region_page *slot;
+  err = order_region_download_page(dl, page.page, &slot);
+  if (err != E_OK) {
+    errmsg_prefix("order_region_download_page: ");
+    return E_ERR;
+  }
+  err = order_region_check_page(queue, region, dl, page, done->response.modified, stats);
+  if (err != E_OK) {
+    errmsg_prefix("order_region_check_page: ");
+    return E_ERR;
+  }
+  slot->modified = done->response.modified;
+  slot->fetch += 1;
+
+  if (done->response.code == 304) {
+    stats->not_modified += 1;
+    slot->table.len = 0;
+    err = order_table_push_packed(&slot->table, done->response.body);
+    if (err != E_OK) {
+      errmsg_prefix("order_table_push_packed: ");
+      return E_ERR;
+    }
+  } else {
+    struct order_parse_job *job = calloc(1, sizeof(struct order_parse_job));
+    if (job == NULL) {
+      errmsg_fmt("calloc: %s", strerror(errno));
+      return E_ERR;
+    }
+    job->page = page;
+    job->fetch = slot->fetch;
+    job->region_id = region->region_id;
+    job->body = done->response.body;  // the job takes the body over
+    done->response.body = (struct string) {0};
+    strcpy(job->etag, done->response.etag);
+    job->pages = page_count;
+    if (done->cache_uri.buf != NULL) {
+      err = string_alloc_cpy(&job->cache_uri, done->cache_uri);
+      if (err != E_OK) {
+        order_parse_job_destroy(job);
+        errmsg_prefix("string_alloc_cpy: ");
+        return E_ERR;
+      }
+    }
+    err = order_parser_submit(parser, job);
+    if (err != E_OK) {
+      order_parse_job_destroy(job);
+      errmsg_prefix("order_parser_submit: ");
+      return E_ERR;
+    }
+    *parsing = true;
+  }
+
+  // queue the next pages
+  if (page.page != 1 && page_count != dl->page_count) {
+    log_warn("order_download: page_count changed during the download");
+  }
+  for (size_t p = dl->page_count < 1 ? 2 : dl->page_count + 1; p <= page_count; ++p) {
+    err = order_page_vec_push(queue, (struct order_page) { .region_idx = page.region_idx, .page = p });
+    if (err != E_OK) {
+      errmsg_prefix("order_page_vec_push: ");
+      return E_ERR;
+    }
+    dl->outstanding += 1;
+  }
+  dl->page_count = page_count;
+  return E_OK;
+}
+
+// Push the orders of the pages parsed so far to their region. Waits for at
+// least one page if `wait`.
+err_t order_download_collect(struct order_parser *parser, struct order_region regions[],
+                             struct order_region_download dls[], time_t now,
+                             const struct order_region_listener *listener,
+                             struct order_download_stats *stats, bool wait) {
+  while (parser->pending > 0) {
+    struct order_parse_job *job;
+    err_t err = order_parser_collect(parser, &job, wait);
+    if (err == E_EMPTY) {
+      return E_OK;
+    } else if (err != E_OK) {
+      errmsg_prefix("order_parser_collect: ");
+      return E_ERR;
+    }
+    wait = false;
+
+    struct order_region *region = &regions[job->page.region_idx];
+    struct order_region_download *dl = &dls[job->page.region_idx];
+    struct order_region_page *slot;
+    if (job->err != E_OK) {
+      log_warn("order_download: region %" PRIu64 " page %zu failed", region->region_id,
+               job->page.page);
+      dl->failed = true;
+    } else if (!dl->failed) {
+      err = order_region_download_page(dl, job->page.page, &slot);
+      if (err != E_OK) {
+        log_warn("order_download: region %" PRIu64 " page %zu failed", region->region_id,
+                 job->page.page);
+        errmsg_prefix("order_region_download_page: ");
+        errmsg_print();
+        dl->failed = true;
+      } else if (job->fetch == slot->fetch) {
+        struct order_table parsed = job->table;
+        job->table = slot->table;
+        slot->table = parsed;
+      }
+    }
+    order_parse_job_destroy(job);
+    err = order_region_page_done(region, dl, now, listener, stats);
+    if (err != E_OK) {
+      errmsg_prefix("order_region_page_done: ");
+      return E_ERR;
+    }
+  }
+  return E_OK;
+}
+
+// Download the regions that are due at `now` (see order_region_is_due) and
+// update their orders, markets and expiry.
+// Pages are downloaded with up to `concurrency` requests in flight. The pages
+// 2..N of a region are queued as soon as its first page tells us N.
+// Page bodies are decoded by a pool of parse workers (see order_parser) while
+// the next pages download, and the orders of a region are merged in page
+// order. Parsed pages are kept in the esi cache, a page that did not change
+// since the previous download (304) is served from there without being
+// decoded.
+// A region whose first page has the same Last-Modified as its previous
+// download keeps its orders and its other pages are not fetched.
+// Each region is swapped in as soon as its last page is done, and handed to
+// `listener` (can be NULL) if its orders changed. A region with a failed page
+// keeps its previous orders and is due again in ORDER_REGION_RETRY seconds,
+// the other regions are not affected. The regions that were swapped in stay
+// so on error.
+err_t order_download_regions(struct order_region regions[], size_t regions_len,
+                             time_t now, size_t concurrency,
+                             const struct order_region_listener *listener) {
+  assert(regions != NULL);
+  assert(concurrency >= 1 && concurrency <= ESI_CONCURRENCY_MAX);
+
+  err_t res = E_ERR;
+  struct esi_multi multi = {0};
+  struct order_page_vec queue = { .cap = 256 };
+  struct order_request *reqs = NULL;
+  struct order_region_download *dls = NULL;
+  struct order_download_stats stats = {0};
+  struct order_parser parser;
+  bool parser_started = false;
+  // WARN: do not call return passed this line, set `res` and goto cleanup
+
+  reqs = calloc(concurrency, sizeof(struct order_request));
+  dls = calloc(regions_len, sizeof(struct order_region_download));
+  if (reqs == NULL || dls == NULL) {
+    errmsg_fmt("calloc: %s", strerror(errno));
+    goto cleanup;
+  }
+  for (size_t i = 0; i < concurrency; ++i) {
+    err_t err = esi_request_create(&reqs[i].esi);
+    if (err != E_OK) {
+      errmsg_prefix("esi_request_create: ");
+      goto cleanup;
+    }
+  }
+  err_t err = esi_multi_create(&multi, concurrency);
+  if (err != E_OK) {
+    errmsg_prefix("esi_multi_create: ");
+    goto cleanup;
+  }
+  err = order_parser_start(&parser, order_parse_worker_count());
+  if (err != E_OK) {
+    errmsg_prefix("order_parser_start: ");
+    goto cleanup;
+  }
+  parser_started = true;
+
+  for (size_t i = 0; i < regions_len; ++i) {
+    if (!order_region_is_due(&regions[i], now)) continue;
+    dls[i] = (struct order_region_download) {
+      .due = true,
+      .outstanding = 1,
+      .table = { .cap = regions[i].table.len + 256 },
+    };
+    stats.due += 1;
+    err = order_page_vec_push(&queue, (struct order_page) { .region_idx = i, .page = 1 });
+    if (err != E_OK) {
+      errmsg_prefix("order_page_vec_push: ");
+      goto cleanup;
+    }
+  }
+
+  size_t queue_idx = 0;
+  while (true) {
+    // fill up the free requests, as far as the esi governor allows
+    double wait_secs = 0;
+    for (size_t i = 0; i < concurrency && queue_idx < queue.len &&
+                       !esi_multi_is_full(&multi); ++i) {
+      if (reqs[i].busy) continue;
+      struct order_page page = queue.buf[queue_idx];
+      struct order_region_download *dl = &dls[page.region_idx];
+      if (dl->failed || (page.page > 1 && page.page > dl->page_count)) {
+        // the region failed or shrank since this page was queued
+        queue_idx += 1;
+        err = order_region_page_done(&regions[page.region_idx], dl, now, listener, &stats);
+        if (err != E_OK) {
+          errmsg_prefix("order_region_page_done: ");
+          goto cleanup;
+        }
+        continue;
+      }
+      wait_secs = esi_governor_try_acquire();
+      if (wait_secs > 0) break;  // the requests in flight go on meanwhile
+      queue_idx += 1;
+      err = order_request_add(&multi, reqs + i, page, regions[page.region_idx].region_id);
+      if (err != E_OK) {
+        errmsg_prefix("order_request_add: ");
+        goto cleanup;
+      }
+    }
+
+    // push the parsed pages, there must be room for one more in the parser
+    err = order_download_collect(&parser, regions, dls, now, listener, &stats,
+                                 parser.pending >= ORDER_PARSE_PENDING_MAX);
+    if (err != E_OK) {
+      errmsg_prefix("order_download_collect: ");
+      goto cleanup;
+    }
+
+    struct esi_request *done;
+    err = esi_multi_next(&multi, &done, wait_secs);
+    if (err == E_EMPTY) {
+      // only skipped pages were left or the governor held the queue
+      if (queue_idx < queue.len || multi.len > 0) continue;
+      if (parser.pending == 0) break;
+      err = order_download_collect(&parser, regions, dls, now, listener, &stats, true);
+      if (err != E_OK) {
+        errmsg_prefix("order_download_collect: ");
+        goto cleanup;
+      }
+      continue;
+    } else if (err != E_OK) {
+      errmsg_prefix("esi_multi_next: ");
+      goto cleanup;
+    }
+
+    struct order_request *req = done->data;
+    struct order_page page = req->page;
+    struct order_region *region = &regions[page.region_idx];
+    struct order_region_download *dl = &dls[page.region_idx];
+    req->busy = false;
+    bool parsing = false;
+    if (!dl->failed) {
+      err = order_download_page_handle(&queue, &parser, region, dl, req, now, &stats,
+                                       &parsing);
+      if (err != E_OK) {
+        log_warn("order_download: region %" PRIu64 " page %zu failed", region->region_id,
+                 page.page);
+        errmsg_prefix("order_download_page_handle: ");
+        errmsg_print();
+        dl->failed = true;
+      }
+    }
+    esi_response_destroy(&done->response);
+    if (parsing) continue;  // done once parsed
+    err = order_region_page_done(region, dl, now, listener, &stats);
+    if (err != E_OK) {
+      errmsg_prefix("order_region_page_done: ");
+      goto cleanup;
+    }
+  }
+
+  struct esi_governor_state governor = esi_governor_state_get();
+  log_print("order_download: %zu regions (%zu carried over, %zu failed, %zu inconsistent), "
+            "%zu pages (%zu not modified, %zu fetched again), %zu duplicate orders, "
+            "esi concurrency %zu, esi error budget %ld", stats.due, stats.carried,
+            stats.failed, stats.inconsistent, stats.pages, stats.not_modified,
+            stats.refetched, stats.duplicates, governor.concurrency, governor.budget_remain);
+  res = E_OK;
+
+cleanup:
+  if (reqs != NULL) {
+    for (size_t i = 0; i < concurrency; ++i) {
+      if (reqs[i].busy) esi_multi_abort(&multi, &reqs[i].esi);
+      esi_request_destroy(&reqs[i].esi);
+    }
+  }
+  esi_multi_destroy(&multi);
+  if (parser_started) order_parser_stop(&parser);
+  if (dls != NULL) {
+    for (size_t i = 0; i < regions_len; ++i) {
+      order_table_destroy(&dls[i].table);
+      order_region_download_drop_pages(&dls[i]);
+    }
+  }
+  free(reqs);
+  free(dls);
+  order_page_vec_destroy(&queue);
+  return res;
+}
+
+// table is empty on error
+err_t order_download_universe(struct order_table *table, uint64_t region_ids[],
+                              size_t regions_len, size_t concurrency) {
+  assert(table != NULL);
+  table->len = 0;
+
+  struct order_region *regions;
+  err_t err = order_region_create_all(&regions, region_ids, regions_len);
+  if (err != E_OK) {
+    errmsg_prefix("order_region_create_all: ");
+    return E_ERR;
+  }
+  err = order_download_regions(regions, regions_len, time(NULL), concurrency, NULL);
+  if (err != E_OK) {
+    errmsg_prefix("order_download_regions: ");
+    order_region_destroy_all(regions, regions_len);
+    return E_ERR;
+  }
+  err = order_region_concat(table, regions, regions_len);
+  order_region_destroy_all(regions, regions_len);
+  if (err != E_OK) {
+    errmsg_prefix("order_region_concat: ");
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+// Append to `locid_vec` the distinct location ids of `view`, in order of
+// first appearance.
+err_t order_fill_location_id_vec(struct uint64_vec *locid_vec,
+                                 const struct order_view *view) {
+  assert(locid_vec != NULL);
+  assert(view != NULL);
+
+  struct uint64_set seen = {0};
+  err_t err = uint64_set_create(&seen, 2 * locid_vec->len + 1024);
+  if (err != E_OK) {
+    errmsg_prefix("uint64_set_create: ");
+    return E_ERR;
+  }
+  for (size_t i = 0; i < locid_vec->len; ++i) {
+    err = uint64_set_insert(&seen, locid_vec->buf[i], NULL);
+    if (err != E_OK) {
+      errmsg_prefix("uint64_set_insert: ");
+      goto cleanup;
+    }
+  }
+
+  for (size_t t = 0; t < view->len; ++t) {
+    const struct order_table *table = view->tables[t];
+    for (size_t i = 0; i < table->len; ++i) {
+      bool inserted;
+      err = uint64_set_insert(&seen, table->location_id[i], &inserted);
+      if (err != E_OK) {
+        errmsg_prefix("uint64_set_insert: ");
+        goto cleanup;
+      }
+      if (inserted) {
+        err = uint64_vec_push(locid_vec, table->location_id[i]);
+        if (err != E_OK) {
+          errmsg_prefix("uint64_vec_push: ");
+          goto cleanup;
+        }
+      }
+    }
+  }
+
+cleanup:
+  uint64_set_destroy(&seen);
+  return err;
+}
+
+// Compact order table encoding (dump version 2)
+//
+// The orders are sorted by (region_id, type_id, location_id, order_id) so
+// that consecutive orders share most of their ids, which are then written as
+// small deltas. Integers are varints (see dump_write_varint).
+//   varint  order count
+//   varint  location count, then the sorted location ids, delta encoded
+//   varint  system count, then the sorted system ids, delta encoded
+//   for each order:
+//     varint  region_id, delta with the previous order
+//     varint  type_id, delta with the previous order of the same region
+//     varint  location index, delta with the previous order of the same market
+//     varint  system index
+//     zigzag  order_id, delta with the previous order
+//     uint8   is_buy_order (bit 0), range code (bits 1-4), duration code (bits 5-7)
+//     varint  duration, only for ORDER_DURATION_OTHER
+//     zigzag  issued, delta with the previous order
+//     varint  volume_remain
+//     zigzag  volume_total - volume_remain
+//     varint  min_volume
+//     varint  price in cents << 1, or 1 followed by the float64 price when it
+//             is not a whole number of cents
+// Version 1 tables are a uint64 count followed by the fields of each order in
+// fixed size big endian, see dump_read_order_v1.
+
+const int8_t   ORDER_RANGES[] = { -2, -1, 0, 1, 2, 3, 4, 5, 10, 20, 30, 40 };
+const uint16_t ORDER_DURATIONS[] = { 1, 3, 7, 14, 30, 90, 365 };
+#define ORDER_RANGES_LEN (sizeof(ORDER_RANGES) / sizeof(ORDER_RANGES[0]))
+#define ORDER_DURATIONS_LEN (sizeof(ORDER_DURATIONS) / sizeof(ORDER_DURATIONS[0]))
+#define ORDER_DURATION_OTHER 7
+
+struct order_sort_key {
+  uint32_t region_id;
+  uint32_t type_id;
+  uint64_t location_id;
+  uint64_t order_id;
+  uint32_t table;  // index of the order's table in the view
+  uint32_t idx;    // index of the order in its table
+};
+
+int order_sort_key_cmp(const void *a_ptr, const void *b_ptr) {
+  const struct order_sort_key *a = a_ptr;
+  const struct order_sort_key *b = b_ptr;
+  if (a->region_id != b->region_id) return a->region_id < b->region_id ? -1 : 1;
+  if (a->type_id != b->type_id) return a->type_id < b->type_id ? -1 : 1;
+  if (a->location_id != b->location_id) return a->location_id < b->location_id ? -1 : 1;
+  if (a->order_id != b->order_id) return a->order_id < b->order_id ? -1 : 1;
+  return 0;
+}
+
+// The sort key of every order of `view`, sorted by order_sort_key_cmp
+// WARN: You then need to free keys
+err_t order_view_sort_keys(const struct order_view *view, struct order_sort_key **keys) {
+  assert(view != NULL);
+  assert(view->len <= UINT32_MAX);
+  *keys = malloc((order_view_len(view) + 1) * sizeof(struct order_sort_key));
+  if (*keys == NULL) {
+    errmsg_fmt("malloc: %s", strerror(errno));
+    return E_ERR;
+  }
+  size_t k = 0;
+  for (size_t t = 0; t < view->len; ++t) {
+    const struct order_table *table = view->tables[t];
+    assert(table->len <= UINT32_MAX);
+    for (size_t i = 0; i < table->len; ++i) {
+      (*keys)[k++] = (struct order_sort_key) {
+        .region_id = table->region_id[i],
+        .type_id = table->type_id[i],
+        .location_id = table->location_id[i],
+        .order_id = table->order_id[i],
+        .table = (uint32_t) t,
+        .idx = (uint32_t) i,
+      };
+    }
+  }
+  qsort(*keys, k, sizeof(struct order_sort_key), order_sort_key_cmp);
+  return E_OK;
+}
+
+int uint64_cmp(const void *a_ptr, const void *b_ptr) {
+  uint64_t a = *(const uint64_t *) a_ptr;
+  uint64_t b = *(const uint64_t *) b_ptr;
+  return a < b ? -1 : a > b;
+}
+
+// Sorted distinct values of `col` in `dict`, and the index of each of them
+// in `index`
+// WARN: You then need to free dict and destroy index
+err_t order_dict_build(uint64_t **dict, size_t *dict_len, struct uint64_size_map *index,
+                       const uint64_t *col, size_t len) {
+  *dict = malloc((len + 1) * sizeof(uint64_t));
+  if (*dict == NULL) {
+    errmsg_fmt("malloc: %s", strerror(errno));
+    return E_ERR;
+  }
+  if (len > 0) memcpy(*dict, col, len * sizeof(uint64_t));
+  qsort(*dict, len, sizeof(uint64_t), uint64_cmp);
+  *dict_len = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (*dict_len == 0 || (*dict)[*dict_len - 1] != (*dict)[i]) {
+      (*dict)[(*dict_len)++] = (*dict)[i];
+    }
+  }
+  *index = (struct uint64_size_map) {0};
+  for (size_t i = 0; i < *dict_len; ++i) {
+    if (uint64_size_map_put(index, (*dict)[i], i) != E_OK) {
+      errmsg_prefix("uint64_size_map_put: ");
+      return E_ERR;
+    }
+  }
+  return E_OK;
+}
+
+err_t dump_write_order_dict(struct dump *dump, const uint64_t *dict, size_t dict_len) {
+  if (dump_write_varint(dump, dict_len) != E_OK) goto error;
+  for (size_t i = 0; i < dict_len; ++i) {
+    if (dump_write_varint(dump, i == 0 ? dict[i] : dict[i] - dict[i - 1]) != E_OK) goto error;
+  }
+  return E_OK;
+error:
+  errmsg_prefix("dump_write_varint: ");
+  return E_ERR;
+}
+
+uint8_t order_codes(const struct order_table *table, size_t i) {
+  uint8_t range_code = 0;
+  while (range_code < ORDER_RANGES_LEN && ORDER_RANGES[range_code] != table->range[i]) {
+    range_code += 1;
+  }
+  assert(range_code < ORDER_RANGES_LEN);  // ensured by order_range_str_to_code
+  uint8_t duration_code = 0;
+  while (duration_code < ORDER_DURATIONS_LEN &&
+         ORDER_DURATIONS[duration_code] != table->duration[i]) {
+    duration_code += 1;
+  }
+  return (table->flags[i] & ORDER_FLAG_BUY) | range_code << 1 | duration_code << 5;
+}
+
+err_t dump_write_order_price(struct dump *dump, double price) {
+  if (price >= 0 && price < 1e16) {
+    uint64_t cents = (uint64_t) (price * 100 + 0.5);
+    if ((double) cents / 100 == price) return dump_write_varint(dump, cents << 1);
+  }
+  if (dump_write_varint(dump, 1) != E_OK) return E_ERR;
+  return dump_write_float64(dump, price);
+}
+
+err_t dump_read_order_price(struct dump *dump, double *price) {
+  uint64_t n;
+  if (dump_read_varint(dump, &n) != E_OK) return E_ERR;
+  if (n == 1) return dump_read_float64(dump, price);
+  *price = (double) (n >> 1) / 100;
+  return E_OK;
+}
+
+// Write the orders of every table of `view` as a single order table
+err_t dump_write_order_view(struct dump *dump, const struct order_view *view) {
+  assert(view != NULL);
+
+  err_t res = E_ERR;
+  struct order_sort_key *keys = NULL;
+  uint64_t *locations = NULL;
+  uint64_t *systems = NULL;
+  uint64_t *col = NULL;
+  struct uint64_size_map location_index = {0};
+  struct uint64_size_map system_index = {0};
+  size_t locations_len, systems_len;
+  size_t len = order_view_len(view);
+  // WARN: do not call return passed this line, set `res` and goto cleanup
+
+  col = malloc((len + 1) * sizeof(uint64_t));
+  if (col == NULL) {
+    errmsg_fmt("malloc: %s", strerror(errno));
+    goto cleanup;
+  }
+  err_t err = order_view_sort_keys(view, &keys);
+  if (err != E_OK) {
+    errmsg_prefix("order_view_sort_keys: ");
+    goto cleanup;
+  }
+
+  // the location then the system column of the whole view
+  size_t c = 0;
+  for (size_t t = 0; t < view->len; ++t) {
+    const struct order_table *table = view->tables[t];
+    if (table->len > 0) memcpy(col + c, table->location_id, table->len * sizeof(uint64_t));
+    c += table->len;
+  }
+  err = order_dict_build(&locations, &locations_len, &location_index, col, len);
+  if (err == E_OK) {
+    c = 0;
+    for (size_t t = 0; t < view->len; ++t) {
+      const struct order_table *table = view->tables[t];
+      for (size_t i = 0; i < table->len; ++i) col[c++] = table->system_id[i];
+    }
+    err = order_dict_build(&systems, &systems_len, &system_index, col, len);
+  }
+  if (err != E_OK) {
+    errmsg_prefix("order_dict_build: ");
+    goto cleanup;
+  }
+
+  if (dump_write_varint(dump, len) != E_OK ||
+      dump_write_order_dict(dump, locations, locations_len) != E_OK ||
+      dump_write_order_dict(dump, systems, systems_len) != E_OK) {
+    errmsg_prefix("dump_write_varint/dump_write_order_dict: ");
+    goto cleanup;
+  }
+
+  struct order_sort_key prev_key = {0};
+  size_t prev_location = 0;
+  uint64_t prev_issued = 0;
+  for (size_t k = 0; k < len; ++k) {
+    const struct order_table *table = view->tables[keys[k].table];
+    size_t i = keys[k].idx;
+    size_t location, system;
+    uint64_size_map_get(&location_index, table->location_id[i], &location);
+    uint64_size_map_get(&system_index, table->system_id[i], &system);
+    bool same_region = k > 0 && table->region_id[i] == prev_key.region_id;
+    bool same_market = same_region && table->type_id[i] == prev_key.type_id;
+    uint8_t codes = order_codes(table, i);
+
+    if (dump_write_varint(dump, table->region_id[i] - prev_key.region_id) != E_OK) goto error;
+    if (dump_write_varint(dump, table->type_id[i] - (same_region ? prev_key.type_id : 0)) != E_OK) goto error;
+    if (dump_write_varint(dump, location - (same_market ? prev_location : 0)) != E_OK) goto error;
+    if (dump_write_varint(dump, system) != E_OK) goto error;
+    if (dump_write_zigzag(dump, (int64_t) (table->order_id[i] - prev_key.order_id)) != E_OK) goto error;
+    if (dump_write_uint8(dump, codes) != E_OK) goto error;
+    if (codes >> 5 == ORDER_DURATION_OTHER) {
+      if (dump_write_varint(dump, table->duration[i]) != E_OK) goto error;
+    }
+    if (dump_write_zigzag(dump, (int64_t) (table->issued[i] - prev_issued)) != E_OK) goto error;
+    if (dump_write_varint(dump, table->volume_remain[i]) != E_OK) goto error;
+    if (dump_write_zigzag(dump, (int64_t) table->volume_total[i] - table->volume_remain[i]) != E_OK) goto error;
+    if (dump_write_varint(dump, table->min_volume[i]) != E_OK) goto error;
+    if (dump_write_order_price(dump, table->price[i]) != E_OK) goto error;
+
+    prev_key = keys[k];
+    prev_location = location;
+    prev_issued = table->issued[i];
+  }
+  res = E_OK;
+  goto cleanup;
+
+error:
+  errmsg_prefix("dump_write_varint/zigzag/uint8/float64: ");
+
+cleanup:
+  free(keys);
+  free(locations);
+  free(systems);
+  free(col);
+  uint64_size_map_destroy(&location_index);
+  uint64_size_map_destroy(&system_index);
+  return res;
+}
+
+err_t dump_write_order_table(struct dump *dump, const struct order_table *table) {
+  assert(table != NULL);
+  const struct order_table *tables[] = { table };
+  struct order_view view = { .tables = tables, .len = 1 };
+  return dump_write_order_view(dump, &view);
+}
+
+err_t dump_read_order_v1(struct dump *dump, struct order *order) {
+  assert(order != NULL);
+  err_t err;
+  uint8_t is_buy_order;
+  if ((err = dump_read_uint8(dump, &is_buy_order)) != E_OK) return err;
+  order->is_buy_order = is_buy_order;
+  if ((err = dump_read_int8(dump, &order->range)) != E_OK) return err;
+  if ((err = dump_read_uint32(dump, &order->duration)) != E_OK) return err;
+  if ((err = dump_read_uint64(dump, &order->issued)) != E_OK) return err;
+  if ((err = dump_read_uint64(dump, &order->min_volume)) != E_OK) return err;
+  if ((err = dump_read_uint64(dump, &order->volume_remain)) != E_OK) return err;
+  if ((err = dump_read_uint64(dump, &order->volume_total)) != E_OK) return err;
+  if ((err = dump_read_uint64(dump, &order->location_id)) != E_OK) return err;
+  if ((err = dump_read_uint64(dump, &order->system_id)) != E_OK) return err;
+  if ((err = dump_read_uint64(dump, &order->type_id)) != E_OK) return err;
+  if ((err = dump_read_uint64(dump, &order->region_id)) != E_OK) return err;
+  if ((err = dump_read_uint64(dump, &order->order_id)) != E_OK) return err;
+  if ((err = dump_read_float64(dump, &order->price)) != E_OK) return err;
+  return E_OK;
+}
+
+// WARN: You then need to free dict
+err_t dump_read_order_dict(struct dump *dump, uint64_t **dict, size_t *dict_len,
+                           size_t order_len) {
+  uint64_t len;
+  err_t err = dump_read_varint(dump, &len);
+  if (err != E_OK) return err;
+  if (len > order_len) {
+    errmsg_fmt("dictionary longer than the order table");
+    return E_ERR;
+  }
+  *dict = malloc((len + 1) * sizeof(uint64_t));
+  if (*dict == NULL) {
+    errmsg_fmt("malloc: %s", strerror(errno));
+    return E_ERR;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    uint64_t delta;
+    if ((err = dump_read_varint(dump, &delta)) != E_OK) return err;
+    (*dict)[i] = i == 0 ? delta : (*dict)[i - 1] + delta;
+  }
+  *dict_len = len;
+  return E_OK;
+}
+
+err_t dump_read_order_v2(struct dump *dump, struct order *order, struct order *prev,
+                         size_t *location, const uint64_t *locations, size_t locations_len,
+                         const uint64_t *systems, size_t systems_len, bool first) {
+  err_t err;
+  uint64_t n;
+  int64_t z;
+  if ((err = dump_read_varint(dump, &n)) != E_OK) return err;
+  order->region_id = prev->region_id + n;
+  bool same_region = !first && order->region_id == prev->region_id;
+  if ((err = dump_read_varint(dump, &n)) != E_OK) return err;
+  order->type_id = (same_region ? prev->type_id : 0) + n;
+  bool same_market = same_region && order->type_id == prev->type_id;
+  if ((err = dump_read_varint(dump, &n)) != E_OK) return err;
+  *location = (same_market ? *location : 0) + n;
+  if ((err = dump_read_varint(dump, &n)) != E_OK) return err;
+  if (*location >= locations_len || n >= systems_len) {
+    errmsg_fmt("location or system index out of range");
+    return E_ERR;
+  }
+  order->location_id = locations[*location];
+  order->system_id = systems[n];
+  if ((err = dump_read_zigzag(dump, &z)) != E_OK) return err;
+  order->order_id = prev->order_id + (uint64_t) z;
+
+  uint8_t codes;
+  if ((err = dump_read_uint8(dump, &codes)) != E_OK) return err;
+  order->is_buy_order = codes & ORDER_FLAG_BUY;
+  if (((codes >> 1) & 0xf) >= ORDER_RANGES_LEN) {
+    errmsg_fmt("invalid range code");
+    return E_ERR;
+  }
+  order->range = ORDER_RANGES[(codes >> 1) & 0xf];
+  if (codes >> 5 == ORDER_DURATION_OTHER) {
+    if ((err = dump_read_varint(dump, &n)) != E_OK) return err;
+    order->duration = n;
+  } else {
+    order->duration = ORDER_DURATIONS[codes >> 5];
+  }
+
+  if ((err = dump_read_zigzag(dump, &z)) != E_OK) return err;
+  order->issued = prev->issued + (uint64_t) z;
+  if ((err = dump_read_varint(dump, &order->volume_remain)) != E_OK) return err;
+  if ((err = dump_read_zigzag(dump, &z)) != E_OK) return err;
+  order->volume_total = order->volume_remain + (uint64_t) z;
+  if ((err = dump_read_varint(dump, &order->min_volume)) != E_OK) return err;
+  return dump_read_order_price(dump, &order->price);
+}
+
+// Append the orders of an order table written by dump_write_order_table, of
+// any dump version
+err_t dump_read_order_table(struct dump *dump, struct order_table *table) {
+  assert(dump != NULL);
+  assert(table != NULL);
+
+  if (dump->version == 1) {
+    uint64_t len;
+    err_t err = dump_read_uint64(dump, &len);
+    if (err != E_OK) return err;
+    for (uint64_t i = 0; i < len; ++i) {
+      struct order order;
+      if ((err = dump_read_order_v1(dump, &order)) != E_OK) return err;
+      if ((err = order_table_push(table, &order)) != E_OK) return err;
+    }
+    return E_OK;
+  }
+
+  err_t res = E_ERR;
+  uint64_t *locations = NULL;
+  uint64_t *systems = NULL;
+  size_t locations_len, systems_len;
+  // WARN: do not call return passed this line, set `res` and goto cleanup
+
+  uint64_t len;
+  if ((res = dump_read_varint(dump, &len)) != E_OK) goto cleanup;
+  // NOTE: a dictionary can't be longer than the table, which bounds the allocations
+  if ((res = dump_read_order_dict(dump, &locations, &locations_len, len)) != E_OK) goto cleanup;
+  if ((res = dump_read_order_dict(dump, &systems, &systems_len, len)) != E_OK) goto cleanup;
+
+  struct order prev = {0};
+  size_t location = 0;
+  for (uint64_t i = 0; i < len; ++i) {
+    struct order order;
+    res = dump_read_order_v2(dump, &order, &prev, &location, locations, locations_len,
+                             systems, systems_len, i == 0);
+    if (res != E_OK) goto cleanup;
+    res = order_table_push(table, &order);
+    if (res != E_OK) {
+      errmsg_prefix("order_table_push: ");
+      goto cleanup;
+    }
+    prev = order;
+  }
+  res = E_OK;
+
+cleanup:
+  free(locations);
+  free(systems);
+  return res;
+}
+
+// Order delta
+//
+// The difference between two snapshots of the orders, matched by order_id.
+// Modifying an order on the market updates its price and resets its issued
+// date, those are recorded as changes along with the volume_remain. An order
+// whose other fields differ is recorded as removed then added.
+
+struct order_change {
+  uint64_t order_id;
+  uint64_t issued;
+  uint32_t volume_remain;
+  double   price;
+};
+
+IMPLEMENT_VEC(struct order_change, order_change)
+
+struct order_delta {
+  struct order_table added;
+  struct uint64_vec removed;  // order ids
+  struct order_change_vec changed;
+};
+
+void order_delta_destroy(struct order_delta *delta) {
+  assert(delta != NULL);
+  order_table_destroy(&delta->added);
+  uint64_vec_destroy(&delta->removed);
+  order_change_vec_destroy(&delta->changed);
+}
+
+bool order_delta_is_same_order(const struct order_table *prev, size_t i,
+                           const struct order_table *cur, size_t j) {
+  return prev->location_id[i] == cur->location_id[j] && prev->type_id[i] == cur->type_id[j] &&
+         prev->region_id[i] == cur->region_id[j] && prev->system_id[i] == cur->system_id[j] &&
+         prev->volume_total[i] == cur->volume_total[j] &&
+         prev->min_volume[i] == cur->min_volume[j] && prev->duration[i] == cur->duration[j] &&
+         prev->range[i] == cur->range[j] && prev->flags[i] == cur->flags[j];
+}
+
+// Compute the delta turning `prev` into `cur`, appended to `delta`.
+// WARN: You then need to destroy the delta with order_delta_destroy
+err_t order_delta_compute(struct order_delta *delta, const struct order_table *prev,
+                          const struct order_table *cur) {
+  assert(delta != NULL);
+  assert(prev != NULL);
+  assert(cur != NULL);
+
+  err_t res = E_ERR;
+  struct uint64_size_map index = {0};
+  bool *matched = NULL;
+  // WARN: do not call return passed this line, set `res` and goto cleanup
+
+  err_t err = uint64_size_map_create(&index, 2 * prev->len);
+  if (err != E_OK) {
+    errmsg_prefix("uint64_size_map_create: ");
+    goto cleanup;
+  }
+  matched = calloc(prev->len + 1, sizeof(bool));
+  if (matched == NULL) {
+    errmsg_fmt("calloc: %s", strerror(errno));
+    goto cleanup;
+  }
+  for (size_t i = 0; i < prev->len; ++i) {
+    err = uint64_size_map_put(&index, prev->order_id[i], i);
+    if (err != E_OK) {
+      errmsg_prefix("uint64_size_map_put: ");
+      goto cleanup;
+    }
+  }
+
+  for (size_t j = 0; j < cur->len; ++j) {
+    size_t i;
+    err = uint64_size_map_get(&index, cur->order_id[j], &i);
+    if (err == E_OK && order_delta_is_same_order(prev, i, cur, j)) {
+      matched[i] = true;
+      if (prev->price[i] == cur->price[j] && prev->volume_remain[i] == cur->volume_remain[j] &&
+          prev->issued[i] == cur->issued[j]) {
+        continue;
+      }
+      struct order_change change = {
+        .order_id = cur->order_id[j],
+        .issued = cur->issued[j],
+        .volume_remain = cur->volume_remain[j],
+        .price = cur->price[j],
+      };
+      err = order_change_vec_push(&delta->changed, change);
+      if (err != E_OK) {
+        errmsg_prefix("order_change_vec_push: ");
+        goto cleanup;
+      }
+      continue;
+    }
+    // new order, or an order that changed beyond a market modification and
+    // that is removed below
+    err = order_table_push_slice(&delta->added, cur, j, 1);
+    if (err != E_OK) {
+      errmsg_prefix("order_table_push_slice: ");
+      goto cleanup;
+    }
+  }
+
+  for (size_t i = 0; i < prev->len; ++i) {
+    if (matched[i]) continue;
+    err = uint64_vec_push(&delta->removed, prev->order_id[i]);
+    if (err != E_OK) {
+      errmsg_prefix("uint64_vec_push: ");
+      goto cleanup;
+    }
+  }
+  res = E_OK;
+
+cleanup:
+  uint64_size_map_destroy(&index);
+  free(matched);
+  return res;
+}
+
+// Compute the delta of the universe since the last order_region_snapshot,
+// region by region: a region that did not change since has nothing to add
+// and no previous orders are kept for it. `delta` should be zeroed.
+// WARN: You then need to destroy the delta with order_delta_destroy
+err_t order_region_delta_compute(struct order_delta *delta, const struct order_region *regions,
+                                 size_t regions_len) {
+  assert(delta != NULL);
+  for (size_t i = 0; i < regions_len; ++i) {
+    if (!regions[i].changed) continue;
+    err_t err = order_delta_compute(delta, &regions[i].snapshot, &regions[i].table);
+    if (err != E_OK) {
+      errmsg_prefix("order_delta_compute: ");
+      return E_ERR;
+    }
+  }
+  return E_OK;
+}
+
+// Rebuild in `table` the snapshot `delta` was computed for from the `prev`
+// snapshot. The orders of prev come first, then the added orders.
+err_t order_delta_apply(struct order_table *table, const struct order_table *prev,
+                        const struct order_delta *delta) {
+  assert(table != NULL);
+  assert(prev != NULL);
+  assert(delta != NULL);
+
+  err_t res = E_ERR;
+  struct uint64_set removed = {0};
+  struct uint64_size_map changed = {0};
+  // WARN: do not call return passed this line, set `res` and goto cleanup
+
+  table->len = 0;
+  for (size_t i = 0; i < delta->removed.len; ++i) {
+    if (uint64_set_insert(&removed, delta->removed.buf[i], NULL) != E_OK) {
+      errmsg_prefix("uint64_set_insert: ");
+      goto cleanup;
+    }
+  }
+  for (size_t i = 0; i < delta->changed.len; ++i) {
+    if (uint64_size_map_put(&changed, delta->changed.buf[i].order_id, i) != E_OK) {
+      errmsg_prefix("uint64_size_map_put: ");
+      goto cleanup;
+    }
+  }
+
+  for (size_t i = 0; i < prev->len; ++i) {
+    if (uint64_set_contains(&removed, prev->order_id[i])) continue;
+    if (order_table_push_slice(table, prev, i, 1) != E_OK) {
+      errmsg_prefix("order_table_push_slice: ");
+      goto cleanup;
+    }
+    size_t c;
+    if (uint64_size_map_get(&changed, prev->order_id[i], &c) == E_OK) {
+      const struct order_change *change = delta->changed.buf + c;
+      table->issued[table->len - 1] = change->issued;
+      table->volume_remain[table->len - 1] = change->volume_remain;
+      table->price[table->len - 1] = change->price;
+    }
+  }
+  if (order_table_push_slice(table, &delta->added, 0, delta->added.len) != E_OK) {
+    errmsg_prefix("order_table_push_slice: ");
+    goto cleanup;
+  }
+  res = E_OK;
+
+cleanup:
+  if (res != E_OK) table->len = 0;
+  uint64_set_destroy(&removed);
+  uint64_size_map_destroy(&changed);
+  return res;
+}
+
+// `base` is the date of the dump the delta applies to
+err_t dump_write_order_delta(struct dump *dump, time_t base, const struct order_delta *delta) {
+  assert(delta != NULL);
+  if (dump_write_uint64(dump, (uint64_t) base) != E_OK) goto error;
+  if (dump_write_order_table(dump, &delta->added) != E_OK) {
+    errmsg_prefix("dump_write_order_table: ");
+    return E_ERR;
+  }
+  if (dump_write_uint64(dump, delta->removed.len) != E_OK) goto error;
+  for (size_t i = 0; i < delta->removed.len; ++i) {
+    if (dump_write_uint64(dump, delta->removed.buf[i]) != E_OK) goto error;
+  }
+  if (dump_write_uint64(dump, delta->changed.len) != E_OK) goto error;
+  for (size_t i = 0; i < delta->changed.len; ++i) {
+    const struct order_change *change = delta->changed.buf + i;
+    if (dump_write_uint64(dump, change->order_id) != E_OK) goto error;
+    if (dump_write_uint64(dump, change->issued) != E_OK) goto error;
+    if (dump_write_uint64(dump, change->volume_remain) != E_OK) goto error;
+    if (dump_write_float64(dump, change->price) != E_OK) goto error;
+  }
+  return E_OK;
+
+error:
+  errmsg_prefix("dump_write_uint64/float64: ");
+  return E_ERR;
+}
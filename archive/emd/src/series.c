@@ -0,0 +1,756 @@
+// Columnar store of the history of each market
+//
+// The store lives in the dump directory:
+// - history-store-<generation>.data holds blocks. A block is a series of days
+//   of one market stored column by column, see dump_write_history_block.
+// - history-store.index lists the blocks sorted by market then by day. It is a
+//   history_store_header followed by fixed size history_store_entry records
+//   in host byte order, so that it is mapped in memory and binary searched as
+//   is.
+// Days are only ever appended to the series of a market. An append writes one
+// block per market at the end of the data file, history_store_compact
+// rewrites the data file with a single block per market so that the series of
+// a market is read with a single pread.
+// NOTE: the index is the source of truth, blocks it does not list (an append
+// that was not committed) are ignored
+
+const char   HISTORY_STORE_MAGIC[8] = "emdhsi1";
+const size_t HISTORY_STORE_BLOCKS_PER_MARKET = 8;  // blocks per market, on average, before compacting
+
+struct history_store_header {
+  char magic[8];
+  uint64_t generation;  // of the data file
+  uint64_t len;         // entries that follow
+};
+
+struct history_store_entry {
+  uint64_t region_id;
+  uint64_t type_id;
+  uint64_t offset;  // of the block in the data file
+  uint32_t size;    // of the block, in bytes
+  uint32_t len;     // days in the block
+  struct date first;
+  struct date last;
+};
+
+IMPLEMENT_VEC(struct history_store_entry, history_store_entry)
+
+struct history_store {
+  struct string dump_dir;
+  uint64_t generation;
+  void *map;  // mapped index, NULL while the store is empty
+  size_t map_len;
+  const struct history_store_entry *entries;  // points into `map`
+  size_t len;
+  size_t markets;                          // distinct markets of `entries`
+  struct history_store_entry_vec pending;  // blocks appended since the last commit
+  struct uint64_size_map pending_index;    // market key -> last block of the market in `pending`
+};
+
+struct string history_store_index_path(const struct history_store *store,
+                                       char buf[DUMP_PATH_LEN_MAX]) {
+  return string_fmt(buf, DUMP_PATH_LEN_MAX, "%.*s/history-store.index",
+                    (int) store->dump_dir.len, store->dump_dir.buf);
+}
+
+struct string history_store_data_path(const struct history_store *store, uint64_t generation,
+                                      char buf[DUMP_PATH_LEN_MAX]) {
+  return string_fmt(buf, DUMP_PATH_LEN_MAX, "%.*s/history-store-%" PRIu64 ".data",
+                    (int) store->dump_dir.len, store->dump_dir.buf, generation);
+}
+
+int history_store_entry_cmp(const void *a_ptr, const void *b_ptr) {
+  const struct history_store_entry *a = a_ptr;
+  const struct history_store_entry *b = b_ptr;
+  if (a->region_id != b->region_id) return a->region_id < b->region_id ? -1 : 1;
+  if (a->type_id != b->type_id) return a->type_id < b->type_id ? -1 : 1;
+  if (date_is_before(a->first, b->first)) return -1;
+  if (date_is_after(a->first, b->first)) return 1;
+  return 0;
+}
+
+int history_bit_cmp(const void *a_ptr, const void *b_ptr) {
+  const struct history_bit *a = a_ptr;
+  const struct history_bit *b = b_ptr;
+  if (a->market.region_id != b->market.region_id) {
+    return a->market.region_id < b->market.region_id ? -1 : 1;
+  }
+  if (a->market.type_id != b->market.type_id) return a->market.type_id < b->market.type_id ? -1 : 1;
+  if (date_is_before(a->date, b->date)) return -1;
+  if (date_is_after(a->date, b->date)) return 1;
+  return 0;
+}
+
+bool history_store_entry_is_of(const struct history_store_entry *entry,
+                               struct history_market market) {
+  return entry->region_id == market.region_id && entry->type_id == market.type_id;
+}
+
+// The entries of `market` are entries[*start..*end), sorted by day
+void history_store_find(const struct history_store *store, struct history_market market,
+                        size_t *start, size_t *end) {
+  size_t lo = 0;
+  size_t hi = store->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const struct history_store_entry *entry = &store->entries[mid];
+    if (entry->region_id < market.region_id ||
+        (entry->region_id == market.region_id && entry->type_id < market.type_id)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *start = lo;
+  while (lo < store->len && history_store_entry_is_of(&store->entries[lo], market)) lo += 1;
+  *end = lo;
+}
+
+// Last day stored for `market`, appended blocks included
+err_t history_store_last_day(const struct history_store *store, struct history_market market,
+                             struct date *last) {
+  size_t idx;
+  err_t err = uint64_size_map_get(&store->pending_index, history_market_key(market), &idx);
+  if (err == E_OK) {
+    *last = store->pending.buf[idx].last;
+    return E_OK;
+  }
+  size_t start, end;
+  history_store_find(store, market, &start, &end);
+  if (start == end) return E_NOT_FOUND;
+  *last = store->entries[end - 1].last;
+  return E_OK;
+}
+
+// Floats are written XORed with the previous value of their column. Prices of
+// consecutive days share their sign, their exponent and often their low
+// mantissa bits, so the XOR is mostly zero bytes. It is written as a header
+// byte, holding the number of significant bytes (0 if the value repeats) and
+// of trailing zero bytes, followed by the significant bytes.
+err_t dump_write_xor_float64(struct dump *dump, double x, uint64_t *prev) {
+  uint64_t bits;
+  memcpy(&bits, &x, 8);  // to pease c aliasing rules
+  uint64_t xor = bits ^ *prev;
+  *prev = bits;
+  if (xor == 0) return dump_write_uint8(dump, 0);
+
+  size_t trailing = 0;
+  while ((xor >> (8 * trailing) & 0xff) == 0) trailing += 1;
+  size_t n = 0;
+  while (trailing + n < 8 && xor >> (8 * (trailing + n)) != 0) n += 1;
+  unsigned char bytes[9];
+  bytes[0] = n << 4 | trailing;
+  for (size_t i = 0; i < n; ++i) {
+    bytes[1 + i] = xor >> (8 * (trailing + i)) & 0xff;
+  }
+  return dump_write(dump, bytes, 1 + n);
+}
+
+err_t dump_read_xor_float64(struct dump *dump, double *x, uint64_t *prev) {
+  uint8_t header;
+  if (dump_read_uint8(dump, &header) != E_OK) return E_ERR;
+  if (header != 0) {
+    size_t n = header >> 4;
+    size_t trailing = header & 0xf;
+    if (n == 0 || n + trailing > 8) {
+      errmsg_fmt("invalid xor float64 header %" PRIu8, header);
+      return E_ERR;
+    }
+    unsigned char bytes[8];
+    if (dump_read(dump, bytes, n) != E_OK) return E_ERR;
+    for (size_t i = 0; i < n; ++i) {
+      *prev ^= (uint64_t) bytes[i] << (8 * (trailing + i));
+    }
+  }
+  memcpy(x, prev, 8);
+  return E_OK;
+}
+
+// A block holds `len` days of a market, sorted and distinct: the length, the
+// first day and the gap in days to each next day, then the average, highest
+// and lowest columns as XORed floats (see dump_write_xor_float64), then the
+// order count and volume columns as varints
+err_t dump_write_history_block(struct dump *dump, const struct history_bit *bits, size_t len) {
+  assert(bits != NULL);
+  assert(len > 0);
+  if (dump_write_varint(dump, len) != E_OK) goto error;
+  if (dump_write_date(dump, bits[0].date) != E_OK) goto error;
+  for (size_t i = 1; i < len; ++i) {
+    int64_t gap = date_to_days(bits[i].date) - date_to_days(bits[i - 1].date);
+    assert(gap > 0);
+    if (dump_write_varint(dump, gap) != E_OK) goto error;
+  }
+  uint64_t prev = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (dump_write_xor_float64(dump, bits[i].stats.average, &prev) != E_OK) goto error;
+  }
+  prev = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (dump_write_xor_float64(dump, bits[i].stats.highest, &prev) != E_OK) goto error;
+  }
+  prev = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (dump_write_xor_float64(dump, bits[i].stats.lowest, &prev) != E_OK) goto error;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    if (dump_write_varint(dump, bits[i].stats.order_count) != E_OK) goto error;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    if (dump_write_varint(dump, bits[i].stats.volume) != E_OK) goto error;
+  }
+  return E_OK;
+
+error:
+  errmsg_prefix("dump_write: ");
+  return E_ERR;
+}
+
+// bit_vec is left as it was on error
+err_t dump_read_history_block(struct dump *dump, struct history_market market,
+                              struct history_bit_vec *bit_vec) {
+  assert(bit_vec != NULL);
+  size_t base = bit_vec->len;
+  uint64_t len, n;
+  struct date date;
+  if (dump_read_varint(dump, &len) != E_OK) goto error;
+  if (dump_read_date(dump, &date) != E_OK) goto error;
+  int64_t days = date_to_days(date);
+  for (uint64_t i = 0; i < len; ++i) {
+    if (i > 0) {
+      if (dump_read_varint(dump, &n) != E_OK) goto error;
+      days += n;
+    }
+    struct history_bit bit = { .date = date_from_days(days), .market = market };
+    if (history_bit_vec_push(bit_vec, bit) != E_OK) {
+      bit_vec->len = base;
+      errmsg_prefix("history_bit_vec_push: ");
+      return E_ERR;
+    }
+  }
+  struct history_bit *bits = bit_vec->buf + base;
+  uint64_t prev = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (dump_read_xor_float64(dump, &bits[i].stats.average, &prev) != E_OK) goto error;
+  }
+  prev = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (dump_read_xor_float64(dump, &bits[i].stats.highest, &prev) != E_OK) goto error;
+  }
+  prev = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (dump_read_xor_float64(dump, &bits[i].stats.lowest, &prev) != E_OK) goto error;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    if (dump_read_varint(dump, &bits[i].stats.order_count) != E_OK) goto error;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    if (dump_read_varint(dump, &bits[i].stats.volume) != E_OK) goto error;
+  }
+  return E_OK;
+
+error:
+  bit_vec->len = base;
+  errmsg_prefix("dump_read: ");
+  return E_ERR;
+}
+
+// Write `bits` as a block at the end of `file` and fill `entry` but its market
+err_t history_store_write_block(FILE *file, const struct history_bit *bits, size_t len,
+                                struct history_store_entry *entry) {
+  char *buf = NULL;
+  size_t buf_len = 0;
+  struct dump dump;
+  err_t err = dump_open_memory_write(&dump, &buf, &buf_len);
+  if (err != E_OK) {
+    errmsg_prefix("dump_open_memory_write: ");
+    return E_ERR;
+  }
+  err = dump_write_history_block(&dump, bits, len);
+  if (dump_close_memory(&dump) != E_OK || err != E_OK) {
+    free(buf);
+    errmsg_prefix("dump_write_history_block: ");
+    return E_ERR;
+  }
+
+  long offset = ftell(file);
+  if (offset < 0) {
+    free(buf);
+    errmsg_fmt("ftell: %s", strerror(errno));
+    return E_ERR;
+  }
+  size_t written = fwrite(buf, 1, buf_len, file);
+  free(buf);
+  if (written != buf_len) {
+    errmsg_fmt("fwrite: %s", strerror(errno));
+    return E_ERR;
+  }
+  *entry = (struct history_store_entry) {
+    .offset = offset,
+    .size = buf_len,
+    .len = len,
+    .first = bits[0].date,
+    .last = bits[len - 1].date,
+  };
+  return E_OK;
+}
+
+// Decode the blocks entries[start..end) of the file `fd` and append their
+// days from `first` to `last` included to `bit_vec`. Blocks that follow each
+// other in the file are read at once.
+err_t history_store_read_blocks(const struct history_store *store, int fd, size_t start,
+                                size_t end, struct date first, struct date last,
+                                struct history_bit_vec *bit_vec) {
+  err_t res = E_ERR;
+  char *buf = NULL;
+  size_t buf_cap = 0;
+  size_t base = bit_vec->len;
+  // WARN: do not call return passed this line, set `res` and goto cleanup
+
+  size_t i = start;
+  while (i < end) {
+    const struct history_store_entry *entry = &store->entries[i];
+    if (date_is_before(entry->last, first) || date_is_after(entry->first, last)) {
+      i += 1;
+      continue;
+    }
+    size_t j = i + 1;
+    size_t span = entry->size;
+    while (j < end && store->entries[j].offset == entry->offset + span &&
+           !date_is_after(store->entries[j].first, last)) {
+      span += store->entries[j].size;
+      j += 1;
+    }
+
+    if (span > buf_cap) {
+      free(buf);
+      buf = malloc(span);
+      if (buf == NULL) {
+        errmsg_fmt("malloc: %s", strerror(errno));
+        goto cleanup;
+      }
+      buf_cap = span;
+    }
+    for (size_t read = 0; read < span;) {
+      ssize_t rv = pread(fd, buf + read, span - read, entry->offset + read);
+      if (rv <= 0) {
+        errmsg_fmt("pread: %s", rv == 0 ? "unexpected end of file" : strerror(errno));
+        goto cleanup;
+      }
+      read += rv;
+    }
+
+    struct dump dump;
+    err_t err = dump_open_memory_read(&dump, buf, span);
+    if (err != E_OK) {
+      errmsg_prefix("dump_open_memory_read: ");
+      goto cleanup;
+    }
+    struct history_market market = { .region_id = entry->region_id, .type_id = entry->type_id };
+    for (size_t k = i; k < j && err == E_OK; ++k) {
+      err = dump_read_history_block(&dump, market, bit_vec);
+    }
+    dump_close_memory(&dump);
+    if (err != E_OK) {
+      errmsg_prefix("dump_read_history_block: ");
+      goto cleanup;
+    }
+    i = j;
+  }
+
+  // keep the days in range
+  size_t kept = base;
+  for (size_t k = base; k < bit_vec->len; ++k) {
+    struct date date = bit_vec->buf[k].date;
+    if (date_is_before(date, first) || date_is_after(date, last)) continue;
+    bit_vec->buf[kept++] = bit_vec->buf[k];
+  }
+  bit_vec->len = kept;
+  res = E_OK;
+
+cleanup:
+  if (res != E_OK) bit_vec->len = base;
+  free(buf);
+  return res;
+}
+
+// Map the index of the store, a missing index is an empty store
+err_t history_store_map(struct history_store *store) {
+  if (store->map != NULL) munmap(store->map, store->map_len);
+  store->map = NULL;
+  store->entries = NULL;
+  store->len = 0;
+  store->markets = 0;
+
+  char path_buf[DUMP_PATH_LEN_MAX];
+  struct string path = history_store_index_path(store, path_buf);
+  int fd = open(path.buf, O_RDONLY);
+  if (fd < 0 && errno == ENOENT) {
+    return E_OK;
+  } else if (fd < 0) {
+    errmsg_fmt("open %s: %s", path.buf, strerror(errno));
+    return E_ERR;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    errmsg_fmt("fstat %s: %s", path.buf, strerror(errno));
+    close(fd);
+    return E_ERR;
+  }
+  size_t map_len = st.st_size;
+  if (map_len < sizeof(struct history_store_header)) {
+    errmsg_fmt("%s is too short", path.buf);
+    close(fd);
+    return E_ERR;
+  }
+  void *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    errmsg_fmt("mmap %s: %s", path.buf, strerror(errno));
+    return E_ERR;
+  }
+
+  const struct history_store_header *header = map;
+  if (memcmp(header->magic, HISTORY_STORE_MAGIC, 8) != 0 ||
+      map_len != sizeof(struct history_store_header) +
+                 header->len * sizeof(struct history_store_entry)) {
+    errmsg_fmt("%s is not a history store index", path.buf);
+    munmap(map, map_len);
+    return E_ERR;
+  }
+  store->map = map;
+  store->map_len = map_len;
+  store->generation = header->generation;
+  store->entries = (const struct history_store_entry *) (header + 1);
+  store->len = header->len;
+  for (size_t i = 0; i < store->len; ++i) {
+    const struct history_store_entry *entry = &store->entries[i];
+    if (i == 0 || entry->region_id != entry[-1].region_id || entry->type_id != entry[-1].type_id) {
+      store->markets += 1;
+    }
+  }
+  return E_OK;
+}
+
+// Replace the index of the store, it is written next to it then renamed over
+err_t history_store_write_index(struct history_store *store, uint64_t generation,
+                                const struct history_store_entry *entries, size_t len) {
+  char path_buf[DUMP_PATH_LEN_MAX];
+  char tmp_path_buf[DUMP_PATH_LEN_MAX];
+  history_store_index_path(store, path_buf);
+  string_fmt(tmp_path_buf, DUMP_PATH_LEN_MAX, "%s.tmp", path_buf);
+
+  FILE *file = fopen(tmp_path_buf, "wb");
+  if (file == NULL) {
+    errmsg_fmt("fopen %s: %s", tmp_path_buf, strerror(errno));
+    return E_ERR;
+  }
+  struct history_store_header header = { .generation = generation, .len = len };
+  memcpy(header.magic, HISTORY_STORE_MAGIC, 8);
+  bool failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+                (len > 0 && fwrite(entries, sizeof(struct history_store_entry), len, file) != len);
+  if (fclose(file) != 0 || failed) {
+    errmsg_fmt("fwrite/fclose %s: %s", tmp_path_buf, strerror(errno));
+    remove(tmp_path_buf);
+    return E_ERR;
+  }
+  if (rename(tmp_path_buf, path_buf) != 0) {
+    errmsg_fmt("rename %s: %s", tmp_path_buf, strerror(errno));
+    remove(tmp_path_buf);
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+// Open the store of `dump_dir`, an empty store if there is none yet
+// WARN: dump_dir must outlive the store
+err_t history_store_open(struct history_store *store, struct string dump_dir) {
+  assert(store != NULL);
+  *store = (struct history_store) {
+    .dump_dir = dump_dir,
+    .pending = { .cap = 1024 },
+  };
+  err_t err = history_store_map(store);
+  if (err != E_OK) {
+    errmsg_prefix("history_store_map: ");
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+// Blocks appended but not committed are lost
+void history_store_close(struct history_store *store) {
+  assert(store != NULL);
+  if (store->map != NULL) munmap(store->map, store->map_len);
+  history_store_entry_vec_destroy(&store->pending);
+  uint64_size_map_destroy(&store->pending_index);
+  *store = (struct history_store) {0};
+}
+
+// Append the bits of `bit_vec` to the series of their market, in any order.
+// The days that are not after the last day stored for their market are
+// dropped. The new blocks are only listed once committed, see
+// history_store_commit.
+err_t history_store_append(struct history_store *store, const struct history_bit_vec *bit_vec) {
+  assert(store != NULL);
+  assert(bit_vec != NULL);
+  if (bit_vec->len == 0) return E_OK;
+
+  err_t res = E_ERR;
+  size_t pending_len = store->pending.len;
+  struct history_bit *bits = NULL;
+  struct history_bit_vec series = { .cap = 512 };
+  FILE *file = NULL;
+  char path_buf[DUMP_PATH_LEN_MAX];
+  // WARN: do not call return passed this line, set `res` and goto cleanup
+
+  bits = malloc(bit_vec->len * sizeof(struct history_bit));
+  if (bits == NULL) {
+    errmsg_fmt("malloc: %s", strerror(errno));
+    goto cleanup;
+  }
+  memcpy(bits, bit_vec->buf, bit_vec->len * sizeof(struct history_bit));
+  qsort(bits, bit_vec->len, sizeof(struct history_bit), history_bit_cmp);
+
+  struct string path = history_store_data_path(store, store->generation, path_buf);
+  file = fopen(path.buf, "ab");
+  if (file == NULL) {
+    errmsg_fmt("fopen %s: %s", path.buf, strerror(errno));
+    goto cleanup;
+  }
+  if (fseek(file, 0, SEEK_END) != 0) {
+    errmsg_fmt("fseek: %s", strerror(errno));
+    goto cleanup;
+  }
+
+  size_t start = 0;
+  while (start < bit_vec->len) {
+    struct history_market market = bits[start].market;
+    size_t end = start + 1;
+    while (end < bit_vec->len && bits[end].market.region_id == market.region_id &&
+           bits[end].market.type_id == market.type_id) {
+      end += 1;
+    }
+
+    struct date last;
+    bool has_last = history_store_last_day(store, market, &last) == E_OK;
+    series.len = 0;
+    for (size_t i = start; i < end; ++i) {
+      if (has_last && !date_is_after(bits[i].date, last)) continue;
+      has_last = true;
+      last = bits[i].date;
+      err_t err = history_bit_vec_push(&series, bits[i]);
+      if (err != E_OK) {
+        errmsg_prefix("history_bit_vec_push: ");
+        goto cleanup;
+      }
+    }
+    start = end;
+    if (series.len == 0) continue;
+
+    struct history_store_entry entry;
+    err_t err = history_store_write_block(file, series.buf, series.len, &entry);
+    if (err != E_OK) {
+      errmsg_prefix("history_store_write_block: ");
+      goto cleanup;
+    }
+    entry.region_id = market.region_id;
+    entry.type_id = market.type_id;
+    err = history_store_entry_vec_push(&store->pending, entry);
+    if (err == E_OK) {
+      err = uint64_size_map_put(&store->pending_index, history_market_key(market),
+                                store->pending.len - 1);
+    }
+    if (err != E_OK) {
+      errmsg_prefix("history_store_entry_vec_push/uint64_size_map_put: ");
+      goto cleanup;
+    }
+  }
+
+  if (fclose(file) != 0) {
+    file = NULL;
+    errmsg_fmt("fclose %s: %s", path.buf, strerror(errno));
+    goto cleanup;
+  }
+  file = NULL;
+  res = E_OK;
+
+cleanup:
+  if (file != NULL) fclose(file);
+  if (res != E_OK && store->pending.len > pending_len) {
+    // forget the blocks of this append, they are ignored in the data file
+    store->pending.len = pending_len;
+    uint64_size_map_clear(&store->pending_index);
+    for (size_t i = 0; i < store->pending.len; ++i) {
+      const struct history_store_entry *entry = &store->pending.buf[i];
+      struct history_market market = { .region_id = entry->region_id, .type_id = entry->type_id };
+      uint64_size_map_put(&store->pending_index, history_market_key(market), i);
+    }
+  }
+  free(bits);
+  history_bit_vec_destroy(&series);
+  return res;
+}
+
+// List the appended blocks in the index
+err_t history_store_commit(struct history_store *store) {
+  assert(store != NULL);
+  if (store->pending.len == 0) return E_OK;
+
+  size_t len = store->len + store->pending.len;
+  struct history_store_entry *entries = malloc(len * sizeof(struct history_store_entry));
+  if (entries == NULL) {
+    errmsg_fmt("malloc: %s", strerror(errno));
+    return E_ERR;
+  }
+  if (store->len > 0) {
+    memcpy(entries, store->entries, store->len * sizeof(struct history_store_entry));
+  }
+  memcpy(entries + store->len, store->pending.buf,
+         store->pending.len * sizeof(struct history_store_entry));
+  qsort(entries, len, sizeof(struct history_store_entry), history_store_entry_cmp);
+
+  err_t err = history_store_write_index(store, store->generation, entries, len);
+  free(entries);
+  if (err != E_OK) {
+    errmsg_prefix("history_store_write_index: ");
+    return E_ERR;
+  }
+  store->pending.len = 0;
+  uint64_size_map_clear(&store->pending_index);
+  err = history_store_map(store);
+  if (err != E_OK) {
+    errmsg_prefix("history_store_map: ");
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+// Append to `bit_vec` the days of `market` from `first` to `last` included,
+// sorted by day. Only committed blocks are read.
+err_t history_store_read(const struct history_store *store, struct history_market market,
+                         struct date first, struct date last, struct history_bit_vec *bit_vec) {
+  assert(store != NULL);
+  assert(bit_vec != NULL);
+  size_t start, end;
+  history_store_find(store, market, &start, &end);
+  if (start == end) return E_OK;
+
+  char path_buf[DUMP_PATH_LEN_MAX];
+  struct string path = history_store_data_path(store, store->generation, path_buf);
+  int fd = open(path.buf, O_RDONLY);
+  if (fd < 0) {
+    errmsg_fmt("open %s: %s", path.buf, strerror(errno));
+    return E_ERR;
+  }
+  err_t err = history_store_read_blocks(store, fd, start, end, first, last, bit_vec);
+  close(fd);
+  if (err != E_OK) {
+    errmsg_prefix("history_store_read_blocks: ");
+    return E_ERR;
+  }
+  return E_OK;
+}
+
+bool history_store_needs_compaction(const struct history_store *store) {
+  return store->len > HISTORY_STORE_BLOCKS_PER_MARKET * store->markets;
+}
+
+// Rewrite the data file with a single block per market, in index order, and
+// remove the previous data file
+// WARN: blocks appended but not committed are lost
+err_t history_store_compact(struct history_store *store) {
+  assert(store != NULL);
+  if (store->len == 0) return E_OK;
+
+  err_t res = E_ERR;
+  uint64_t generation = store->generation + 1;
+  char old_path_buf[DUMP_PATH_LEN_MAX];
+  char new_path_buf[DUMP_PATH_LEN_MAX];
+  struct string old_path = history_store_data_path(store, store->generation, old_path_buf);
+  struct string new_path = history_store_data_path(store, generation, new_path_buf);
+  int fd = -1;
+  FILE *file = NULL;
+  struct history_store_entry_vec entries = {0};
+  struct history_bit_vec series = { .cap = 512 };
+  bool indexed = false;
+  // WARN: do not call return passed this line, set `res` and goto cleanup
+
+  fd = open(old_path.buf, O_RDONLY);
+  if (fd < 0) {
+    errmsg_fmt("open %s: %s", old_path.buf, strerror(errno));
+    goto cleanup;
+  }
+  file = fopen(new_path.buf, "wb");
+  if (file == NULL) {
+    errmsg_fmt("fopen %s: %s", new_path.buf, strerror(errno));
+    goto cleanup;
+  }
+  err_t err = history_store_entry_vec_create(&entries, store->markets + 1);
+  if (err != E_OK) {
+    errmsg_prefix("history_store_entry_vec_create: ");
+    goto cleanup;
+  }
+
+  const struct date FIRST = { .year = 0, .day = 0 };
+  const struct date LAST = { .year = UINT16_MAX, .day = UINT16_MAX };
+  size_t start = 0;
+  while (start < store->len) {
+    const struct history_store_entry *first_entry = &store->entries[start];
+    struct history_market market = {
+      .region_id = first_entry->region_id,
+      .type_id = first_entry->type_id,
+    };
+    size_t end = start + 1;
+    while (end < store->len && history_store_entry_is_of(&store->entries[end], market)) end += 1;
+
+    series.len = 0;
+    err = history_store_read_blocks(store, fd, start, end, FIRST, LAST, &series);
+    if (err != E_OK) {
+      errmsg_prefix("history_store_read_blocks: ");
+      goto cleanup;
+    }
+    struct history_store_entry entry;
+    err = history_store_write_block(file, series.buf, series.len, &entry);
+    if (err != E_OK) {
+      errmsg_prefix("history_store_write_block: ");
+      goto cleanup;
+    }
+    entry.region_id = market.region_id;
+    entry.type_id = market.type_id;
+    err = history_store_entry_vec_push(&entries, entry);
+    if (err != E_OK) {
+      errmsg_prefix("history_store_entry_vec_push: ");
+      goto cleanup;
+    }
+    start = end;
+  }
+
+  int rv = fclose(file);
+  file = NULL;
+  if (rv != 0) {
+    errmsg_fmt("fclose %s: %s", new_path.buf, strerror(errno));
+    goto cleanup;
+  }
+  err = history_store_write_index(store, generation, entries.buf, entries.len);
+  if (err != E_OK) {
+    errmsg_prefix("history_store_write_index: ");
+    goto cleanup;
+  }
+  indexed = true;
+  store->pending.len = 0;
+  uint64_size_map_clear(&store->pending_index);
+  err = history_store_map(store);
+  if (err != E_OK) {
+    errmsg_prefix("history_store_map: ");
+    goto cleanup;
+  }
+  res = E_OK;
+
+cleanup:
+  if (fd >= 0) close(fd);
+  if (file != NULL) fclose(file);
+  remove(indexed ? old_path.buf : new_path.buf);
+  history_store_entry_vec_destroy(&entries);
+  history_bit_vec_destroy(&series);
+  return res;
+}
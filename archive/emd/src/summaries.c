@@ -0,0 +1,177 @@
+// Aggregates of the orders of a side of a market at a location
+struct market_side {
+  uint32_t count;
+  double best;      // highest buy or lowest sell price, 0 without orders
+  uint64_t volume;  // volume remain of the orders within MARKET_SUMMARY_SPREAD of best
+  double average;   // price weighted by volume remain, 0 without orders
+};
+
+// Aggregates of the orders of a market (region and type) at a location
+struct market_summary {
+  uint32_t region_id;
+  uint32_t type_id;
+  uint64_t location_id;
+  struct market_side buy;
+  struct market_side sell;
+};
+
+IMPLEMENT_VEC(struct market_summary, market_summary)
+
+const double MARKET_SUMMARY_SPREAD = 0.05;
+
+// Whether `price` is within MARKET_SUMMARY_SPREAD of the best price of the side
+bool market_side_is_near_best(const struct market_side *side, bool buy, double price) {
+  if (buy) return price >= side->best * (1 - MARKET_SUMMARY_SPREAD);
+  return price <= side->best * (1 + MARKET_SUMMARY_SPREAD);
+}
+
+// Summarize the orders of `view` at keys[start..end), that share their
+// region, type and location
+struct market_summary market_summary_of(const struct order_view *view,
+                                        const struct order_sort_key *keys,
+                                        size_t start, size_t end) {
+  struct market_summary summary = {
+    .region_id = keys[start].region_id,
+    .type_id = keys[start].type_id,
+    .location_id = keys[start].location_id,
+  };
+  double buy_value = 0, sell_value = 0;
+  uint64_t buy_volume = 0, sell_volume = 0;
+  for (size_t k = start; k < end; ++k) {
+    const struct order_table *table = view->tables[keys[k].table];
+    size_t i = keys[k].idx;
+    double price = table->price[i];
+    uint32_t volume = table->volume_remain[i];
+    if (table->flags[i] & ORDER_FLAG_BUY) {
+      if (summary.buy.count == 0 || price > summary.buy.best) summary.buy.best = price;
+      summary.buy.count += 1;
+      buy_value += price * volume;
+      buy_volume += volume;
+    } else {
+      if (summary.sell.count == 0 || price < summary.sell.best) summary.sell.best = price;
+      summary.sell.count += 1;
+      sell_value += price * volume;
+      sell_volume += volume;
+    }
+  }
+  if (buy_volume > 0) summary.buy.average = buy_value / buy_volume;
+  if (sell_volume > 0) summary.sell.average = sell_value / sell_volume;
+
+  // the depth needs the best prices
+  for (size_t k = start; k < end; ++k) {
+    const struct order_table *table = view->tables[keys[k].table];
+    size_t i = keys[k].idx;
+    bool buy = table->flags[i] & ORDER_FLAG_BUY;
+    struct market_side *side = buy ? &summary.buy : &summary.sell;
+    if (market_side_is_near_best(side, buy, table->price[i])) {
+      side->volume += table->volume_remain[i];
+    }
+  }
+  return summary;
+}
+
+// Append to `summary_vec` the summary of every market and location of
+// `view`, sorted by region, type and location
+err_t market_summary_compute(struct market_summary_vec *summary_vec,
+                             const struct order_view *view) {
+  assert(summary_vec != NULL);
+  assert(view != NULL);
+
+  struct order_sort_key *keys;
+  err_t err = order_view_sort_keys(view, &keys);
+  if (err != E_OK) {
+    errmsg_prefix("order_view_sort_keys: ");
+    return E_ERR;
+  }
+
+  size_t len = order_view_len(view);
+  size_t start = 0;
+  for (size_t k = 1; k <= len; ++k) {
+    if (k < len && keys[k].region_id == keys[start].region_id &&
+        keys[k].type_id == keys[start].type_id &&
+        keys[k].location_id == keys[start].location_id) {
+      continue;
+    }
+    err = market_summary_vec_push(summary_vec, market_summary_of(view, keys, start, k));
+    if (err != E_OK) {
+      free(keys);
+      errmsg_prefix("market_summary_vec_push: ");
+      return E_ERR;
+    }
+    start = k;
+  }
+  free(keys);
+  return E_OK;
+}
+
+err_t dump_write_market_side(struct dump *dump, const struct market_side *side) {
+  if (dump_write_varint(dump, side->count) != E_OK) return E_ERR;
+  if (side->count == 0) return E_OK;
+  if (dump_write_order_price(dump, side->best) != E_OK) return E_ERR;
+  if (dump_write_varint(dump, side->volume) != E_OK) return E_ERR;
+  return dump_write_float64(dump, side->average);
+}
+
+// Summaries are written sorted as market_summary_compute gives them, region
+// and type as deltas from the previous summary, prices as in the compact
+// order encoding (see dump_write_order_price)
+err_t dump_write_market_summary_vec(struct dump *dump, const struct market_summary_vec *summary_vec) {
+  assert(summary_vec != NULL);
+  if (dump_write_varint(dump, summary_vec->len) != E_OK) goto error;
+  struct market_summary prev = {0};
+  for (size_t i = 0; i < summary_vec->len; ++i) {
+    const struct market_summary *summary = &summary_vec->buf[i];
+    bool same_region = i > 0 && summary->region_id == prev.region_id;
+    if (dump_write_varint(dump, summary->region_id - prev.region_id) != E_OK) goto error;
+    if (dump_write_varint(dump, summary->type_id - (same_region ? prev.type_id : 0)) != E_OK) goto error;
+    if (dump_write_varint(dump, summary->location_id) != E_OK) goto error;
+    if (dump_write_market_side(dump, &summary->buy) != E_OK) goto error;
+    if (dump_write_market_side(dump, &summary->sell) != E_OK) goto error;
+    prev = *summary;
+  }
+  return E_OK;
+
+error:
+  errmsg_prefix("dump_write: ");
+  return E_ERR;
+}
+
+err_t dump_read_market_side(struct dump *dump, struct market_side *side) {
+  *side = (struct market_side) {0};
+  uint64_t n;
+  if (dump_read_varint(dump, &n) != E_OK) return E_ERR;
+  side->count = n;
+  if (side->count == 0) return E_OK;
+  if (dump_read_order_price(dump, &side->best) != E_OK) return E_ERR;
+  if (dump_read_varint(dump, &side->volume) != E_OK) return E_ERR;
+  return dump_read_float64(dump, &side->average);
+}
+
+err_t dump_read_market_summary_vec(struct dump *dump, struct market_summary_vec *summary_vec) {
+  assert(summary_vec != NULL);
+  summary_vec->len = 0;
+  uint64_t len, n;
+  if (dump_read_varint(dump, &len) != E_OK) goto error;
+  struct market_summary prev = {0};
+  for (size_t i = 0; i < len; ++i) {
+    struct market_summary summary;
+    if (dump_read_varint(dump, &n) != E_OK) goto error;
+    summary.region_id = prev.region_id + n;
+    bool same_region = i > 0 && summary.region_id == prev.region_id;
+    if (dump_read_varint(dump, &n) != E_OK) goto error;
+    summary.type_id = (same_region ? prev.type_id : 0) + n;
+    if (dump_read_varint(dump, &summary.location_id) != E_OK) goto error;
+    if (dump_read_market_side(dump, &summary.buy) != E_OK) goto error;
+    if (dump_read_market_side(dump, &summary.sell) != E_OK) goto error;
+    if (market_summary_vec_push(summary_vec, summary) != E_OK) {
+      errmsg_prefix("market_summary_vec_push: ");
+      return E_ERR;
+    }
+    prev = summary;
+  }
+  return E_OK;
+
+error:
+  errmsg_prefix("dump_read: ");
+  return E_ERR;
+}
@@ -7,7 +7,9 @@
 #include "systems.c"
 #include "locations.c"
 #include "orders.c"
+#include "summaries.c"
 #include "histories.c"
+#include "series.c"
 #include "server.c"
 #include "hoardling.c"
 
@@ -35,17 +37,80 @@ void test_zeroed_vec_with_cap(void) {
   size_vec_destroy(&vec);
 }
 
+void test_uint64_set(void) {
+  struct uint64_set set = {0};
+  bool inserted;
+  for (uint64_t x = 0; x < 1000; ++x) {
+    uint64_set_insert(&set, 60000000 + 3 * x, &inserted);
+    assert(inserted);
+  }
+  uint64_set_insert(&set, 0, &inserted);
+  assert(inserted);
+  uint64_set_insert(&set, 60000003, &inserted);
+  assert(!inserted);
+  assert(set.len == 1001);
+  assert(4 * set.len <= 3 * set.cap);
+  assert(uint64_set_contains(&set, 0));
+  assert(uint64_set_contains(&set, 60000000 + 3 * 999));
+  assert(!uint64_set_contains(&set, 60000001));
+  uint64_set_clear(&set);
+  assert(set.len == 0);
+  assert(!uint64_set_contains(&set, 0));
+  assert(!uint64_set_contains(&set, 60000003));
+  uint64_set_destroy(&set);
+}
+
+void test_active_markets(void) {
+  uint64_t key = order_market_key(10000002, 34);
+  assert(order_market_key_region_id(key) == 10000002);
+  assert(order_market_key_type_id(key) == 34);
+
+  struct order orders[] = {
+    { .region_id = 10000002, .type_id = 34 },
+    { .region_id = 10000002, .type_id = 35 },
+    { .region_id = 10000002, .type_id = 34 },
+    { .region_id = 10000043, .type_id = 34 },
+  };
+  struct order_table table = {0};
+  for (size_t i = 0; i < 4; ++i) order_table_push(&table, orders + i);
+
+  struct history_market_vec market_vec = {0};
+  assert(get_active_markets(&market_vec, &table) == E_OK);
+  assert(market_vec.len == 3);
+  assert(market_vec.buf[0].region_id == 10000002 && market_vec.buf[0].type_id == 34);
+  assert(market_vec.buf[1].region_id == 10000002 && market_vec.buf[1].type_id == 35);
+  assert(market_vec.buf[2].region_id == 10000043 && market_vec.buf[2].type_id == 34);
+
+  uint64_t region_ids[] = {10000002, 10000043};
+  struct order_region *regions;
+  assert(order_region_create_all(&regions, region_ids, 2) == E_OK);
+  order_table_push_slice(&regions[0].table, &table, 0, 3);
+  order_table_push_slice(&regions[1].table, &table, 3, 1);
+  assert(order_fill_market_key_vec(&regions[0].markets, &regions[0].table) == E_OK);
+  assert(order_fill_market_key_vec(&regions[1].markets, &regions[1].table) == E_OK);
+  market_vec.len = 0;
+  assert(order_fill_active_market_vec(&market_vec, regions, 2) == E_OK);
+  assert(market_vec.len == 3);
+  assert(market_vec.buf[1].region_id == 10000002 && market_vec.buf[1].type_id == 35);
+  assert(market_vec.buf[2].region_id == 10000043 && market_vec.buf[2].type_id == 34);
+
+  order_region_destroy_all(regions, 2);
+  history_market_vec_destroy(&market_vec);
+  order_table_destroy(&table);
+}
+
 void test_order_download_page(void) {
-  struct order_vec vec = {0};
+  struct order_table table = {0};
   size_t page_count;
-  err_t err = order_download_page(&vec, 10000002, 1, &page_count);
+  err_t err = order_download_page(&table, 10000002, 1, &page_count);
   assert(err == E_OK);
   assert(page_count > 10);  // we are in jita, there should be more that 10 pages
-  assert(vec.len == 1000);
-  assert(vec.buf[0].region_id == 10000002);
+  assert(table.len == 1000);
+  assert(table.region_id[0] == 10000002);
 
   printf("sample order: ");
-  order_print(vec.buf);
+  struct order order = order_table_get(&table, 0);
+  order_print(&order);
 }
 
 void test_order_download_universe(void) {
@@ -53,23 +118,24 @@ void test_order_download_universe(void) {
   size_t regions_len = sizeof(regions) / sizeof(*regions);
 
   size_t r1_page_count;
-  struct order_vec r1_vec = {0};
-  err_t err = order_download_page(&r1_vec, regions[0], 1, &r1_page_count);
+  struct order_table r1_table = {0};
+  err_t err = order_download_page(&r1_table, regions[0], 1, &r1_page_count);
   assert(err == E_OK);
 
   size_t r2_page_count;
-  struct order_vec r2_vec = {0};
-  err = order_download_page(&r2_vec, regions[1], 1, &r2_page_count);
+  struct order_table r2_table = {0};
+  err = order_download_page(&r2_table, regions[1], 1, &r2_page_count);
   assert(err == E_OK);
 
-  struct order_vec vec = {0};
-  err = order_download_universe(&vec, regions, regions_len);
+  struct order_table table = {0};
+  err = order_download_universe(&table, regions, regions_len, 4);
   assert(err == E_OK);
-  assert((r1_page_count + r2_page_count) * 1000 - 2000 < vec.len);
-  assert((r1_page_count + r2_page_count) * 1000 >= vec.len);
+  assert((r1_page_count + r2_page_count) * 1000 - 2000 < table.len);
+  assert((r1_page_count + r2_page_count) * 1000 >= table.len);
 
   printf("sample order: ");
-  order_print(vec.buf);
+  struct order order = order_table_get(&table, 0);
+  order_print(&order);
 }
 
 void test_unsafe_ptr_fifo(void) {
@@ -144,10 +210,1191 @@ void test_dump_record(void) {
 
 void test_date_parse(void) {
   struct date date;
-  err_t err = date_parse(ESI_DATE, "2024-11-23", &date);
+  err_t err = date_parse(string_new("2024-11-23"), &date);
   assert(err == E_OK);
   assert(date.year == 2024);
   assert(date.day == 327);
+  assert(date_parse(string_new("2023-01-01"), &date) == E_OK);
+  assert(date.year == 2023 && date.day == 0);
+  assert(date_parse(string_new("2024-12-31"), &date) == E_OK);
+  assert(date.day == 365);
+  assert(date_parse(string_new("2023-02-29"), &date) == E_ERR);
+  assert(date_parse(string_new("2024-13-01"), &date) == E_ERR);
+  assert(date_parse(string_new("2024-1-01"), &date) == E_ERR);
+
+  // date_utc and date_incr count days the same way
+  assert(date_parse(string_new("2024-12-31"), &date) == E_OK);
+  assert(date_is_equal(date_utc(1735689599), date));  // 2024-12-31T23:59:59Z
+  date_incr(&date);
+  assert(date.year == 2025 && date.day == 0);
+  assert(date_is_equal(date_utc(1735689600), date));
+}
+
+void test_time_parse_iso(void) {
+  assert(timezone_set("GMT") == E_OK);
+  const char *times[] = {
+    "1970-01-01T00:00:00Z", "2000-02-29T23:59:59Z", "2024-11-23T11:15:00Z",
+    "2100-03-01T00:00:01Z", "2038-01-19T03:14:08Z",
+  };
+  for (size_t i = 0; i < sizeof(times) / sizeof(times[0]); ++i) {
+    time_t expected, time;
+    assert(time_parse("%Y-%m-%dT%H:%M:%SZ", times[i], &expected) == E_OK);
+    assert(time_parse_iso(string_new((char *) times[i]), &time) == E_OK);
+    assert(time == expected);
+  }
+
+  // every hour of a few years
+  char buf[32];
+  struct tm tm;
+  for (time_t t = 1600000000; t < 1700000000; t += TIME_HOUR + 7) {
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    time_t time;
+    assert(time_parse_iso(string_new(buf), &time) == E_OK);
+    assert(time == t);
+  }
+
+  time_t time;
+  assert(time_parse_iso(string_new("2024-11-23T11:15:00"), &time) == E_ERR);
+  assert(time_parse_iso(string_new("2024-11-23 11:15:00Z"), &time) == E_ERR);
+  assert(time_parse_iso(string_new("2024-11-23T24:15:00Z"), &time) == E_ERR);
+  assert(time_parse_iso(string_new("2024-11-2aT11:15:00Z"), &time) == E_ERR);
+}
+
+
+void test_esi_cache(void) {
+  struct string uri = string_new("/markets/10000002/orders?page=1");
+  char etag[ESI_ETAG_LEN_MAX + 1];
+  assert(esi_cache_get_etag(uri, etag) == E_NOT_FOUND);
+  assert(esi_cache_put(uri, "\"abc\"", 3, string_new("payload")) == E_OK);
+  assert(esi_cache_put(uri, "\"def\"", 4, string_new("new payload")) == E_OK);
+  assert(esi_cache.len == 1);
+  assert(esi_cache_get_etag(uri, etag) == E_OK);
+  assert(strcmp(etag, "\"def\"") == 0);
+
+  struct esi_response response = { .code = 304 };
+  assert(esi_cache_load(uri, &response) == E_OK);
+  assert(response.pages == 4);
+  assert(string_cmp(response.body, string_new("new payload")) == 0);
+  esi_response_destroy(&response);
+}
+
+void test_esi_governor(void) {
+  struct esi_governor init = ESI_GOVERNOR_INIT;
+  esi_governor = init;
+
+  // AIMD window
+  struct esi_governor_state state = esi_governor_state_get();
+  assert(state.concurrency == ESI_CONCURRENCY_MAX);
+  esi_governor_feedback(true);
+  esi_governor_feedback(true);  // within the decrease delay, ignored
+  assert(esi_governor_state_get().concurrency == ESI_CONCURRENCY_MAX / 2);
+  for (size_t i = 0; i < ESI_CONCURRENCY_MAX; ++i) {
+    esi_governor_feedback(false);
+  }
+  assert(esi_governor_state_get().concurrency == ESI_CONCURRENCY_MAX / 2 + 1);
+
+  // the rate shrinks with the error budget
+  esi_governor_budget(100, 60);
+  assert(esi_governor_state_get().rate == ESI_GOVERNOR_RATE_MAX);
+  // a spent error (a 404 for instance) does not shrink the window
+  esi_governor_budget(99, 59);
+  assert(esi_governor_state_get().concurrency == ESI_CONCURRENCY_MAX / 2 + 1);
+  esi_governor_budget(25, 50);
+  state = esi_governor_state_get();
+  assert(state.rate == ESI_GOVERNOR_RATE_MAX / 2);
+  assert(state.budget_remain == 25);
+  assert(state.blocked_secs == 0);
+
+  // requests are held once the budget is almost spent
+  esi_governor_budget(5, 30);
+  state = esi_governor_state_get();
+  assert(state.blocked_secs > 29 && state.blocked_secs <= 30);
+  double wait_secs = esi_governor_try_acquire();
+  assert(wait_secs > 29 && wait_secs <= 30);
+
+  // without blocking, the wait is the time to refill a token
+  esi_governor = init;
+  for (size_t i = 0; i < ESI_GOVERNOR_BURST; ++i) {
+    assert(esi_governor_try_acquire() == 0);
+  }
+  wait_secs = esi_governor_try_acquire();
+  assert(wait_secs > 0 && wait_secs <= 1 / ESI_GOVERNOR_RATE_MAX);
+
+  esi_governor = init;
+}
+
+void test_order_region_next_refresh(void) {
+  struct order_region regions[4] = {
+    { .region_id = 10000001, .expires = 1000 },
+    { .region_id = 10000002, .expires = 1008 },
+    { .region_id = 10000003, .expires = 1004 },
+    { .region_id = 10000004, .expires = 1030 },
+  };
+  assert(order_region_next_refresh(regions, 4) == 1009);
+  assert(order_region_is_due(&regions[1], 1009));
+  assert(!order_region_is_due(&regions[3], 1009));
+
+  regions[3].expires = 0;
+  assert(order_region_next_refresh(regions, 4) == 0);
+  assert(order_region_is_due(&regions[3], 1009));
+}
+
+void test_esi_stats(void) {
+  // every value is known within 6%
+  for (uint64_t us = 1; us < 200000000; us = us * 3 / 2 + 1) {
+    size_t idx = esi_histogram_index(us);
+    assert(idx < ESI_HISTOGRAM_LEN);
+    uint64_t value = esi_histogram_value(idx);
+    if (us < ((uint64_t) 1 << (ESI_HISTOGRAM_MSB_MAX + 1))) {
+      assert(value * 100 <= us * 106 && value * 106 >= us * 100);
+    }
+  }
+
+  struct esi_histogram h = {0};
+  for (uint64_t ms = 1; ms <= 100; ++ms) {
+    esi_histogram_record(&h, ms * 1000);
+  }
+  uint64_t p50 = esi_histogram_percentile(&h, 0.5);
+  uint64_t p99 = esi_histogram_percentile(&h, 0.99);
+  assert(p50 > 47000 && p50 < 54000);
+  assert(p99 > 95000 && p99 <= 100000);
+
+  assert(esi_endpoint_of(string_new("/markets/10000002/orders?page=3")) == ESI_ENDPOINT_ORDERS);
+  assert(esi_endpoint_of(string_new("/markets/10000002/history?type_id=34")) == ESI_ENDPOINT_HISTORY);
+  assert(esi_endpoint_of(string_new("/universe/structures/1035466617946")) == ESI_ENDPOINT_STRUCTURES);
+  assert(esi_endpoint_of(string_new("/markets/prices")) == ESI_ENDPOINT_OTHER);
+}
+
+// build a page with the layout of /markets/{region_id}/orders
+// WARN: You then need to destroy the returned string
+// page of the orders [first, first + order_count) of the test order sequence
+struct string test_order_page_build_from(size_t first, size_t order_count) {
+  struct string page = {0};
+  FILE *file = open_memstream(&page.buf, &page.len);
+  assert(file != NULL);
+  const char *ranges[] = { "station", "solarsystem", "region", "1", "5", "40" };
+  fputc('[', file);
+  for (size_t i = first; i < first + order_count; ++i) {
+    fprintf(file,
+            "%s{\"duration\":%zu,\"is_buy_order\":%s,\"issued\":\"2024-11-%02zuT%02zu:%02zu:%02zuZ\","
+            "\"location_id\":%" PRIu64 ",\"min_volume\":%zu,\"order_id\":%" PRIu64 ","
+            "\"price\":%zu.%02zu,\"range\":\"%s\",\"system_id\":%zu,\"type_id\":%zu,"
+            "\"volume_remain\":%zu,\"volume_total\":%zu}",
+            i == first ? "" : ",", 30 + i % 60, i % 3 == 0 ? "true" : "false",
+            1 + i % 28, i % 24, i % 60, (i * 7) % 60,
+            i % 2 == 0 ? (uint64_t) 60003760 : (uint64_t) 1035466617946 + i,
+            1 + i % 10, (uint64_t) 6900000000 + i * 13, 1000 + i * 37, i % 100,
+            ranges[i % 6], 30000142 + i % 50, 34 + i * 11, 10 + i, 100 + i * 2);
+  }
+  fputc(']', file);
+  fclose(file);
+  return page;
+}
+
+struct string test_order_page_build(size_t order_count) {
+  return test_order_page_build_from(0, order_count);
+}
+
+bool test_order_is_equal(const struct order *a, const struct order *b) {
+  return a->is_buy_order == b->is_buy_order && a->range == b->range &&
+         a->duration == b->duration && a->issued == b->issued &&
+         a->min_volume == b->min_volume && a->volume_remain == b->volume_remain &&
+         a->volume_total == b->volume_total && a->location_id == b->location_id &&
+         a->system_id == b->system_id && a->type_id == b->type_id &&
+         a->region_id == b->region_id && a->order_id == b->order_id &&
+         a->price == b->price;
+}
+
+void test_order_table(void) {
+  struct string page = test_order_page_build(100);
+  struct order_table table = { .cap = 16 };
+  assert(order_parse_page(&table, page, 10000002) == E_OK);
+  assert(table.len == 100 && table.cap >= 100);
+
+  // slices and packed pages keep every field
+  struct order_table copy = {0};
+  assert(order_table_push_slice(&copy, &table, 10, 20) == E_OK);
+  size_t packed_len = 30 * ORDER_TABLE_ROW_SIZE;
+  char *packed = malloc(packed_len);
+  order_table_pack(&table, 30, 30, packed);
+  assert(order_table_push_packed(&copy, (struct string) { .buf = packed, .len = packed_len }) == E_OK);
+  assert(copy.len == 50);
+  for (size_t i = 0; i < copy.len; ++i) {
+    struct order a = order_table_get(&table, 10 + i);
+    struct order b = order_table_get(&copy, i);
+    assert(test_order_is_equal(&a, &b));
+  }
+  assert(order_table_push_packed(&copy, (struct string) { .buf = packed, .len = 7 }) == E_ERR);
+
+  // esi ids are int32
+  struct order wide = { .type_id = (uint64_t) UINT32_MAX + 1 };
+  assert(order_table_push(&copy, &wide) == E_ERR);
+  assert(copy.len == 50);
+
+  free(packed);
+  order_table_destroy(&copy);
+  order_table_destroy(&table);
+  string_destroy(&page);
+}
+
+void test_order_delta(void) {
+  struct string page = test_order_page_build(100);
+  struct order_table prev = {0};
+  assert(order_parse_page(&prev, page, 10000002) == E_OK);
+
+  // cur: orders 0..9 are gone, 10..19 were modified, 20 moved and 3 orders
+  // are new
+  struct order_table cur = {0};
+  order_table_push_slice(&cur, &prev, 10, 90);
+  for (size_t i = 0; i < 10; ++i) {
+    cur.price[i] += 1;
+    cur.volume_remain[i] -= 1;
+    cur.issued[i] += 60;
+  }
+  cur.location_id[10] += 1;
+  for (size_t i = 0; i < 3; ++i) {
+    struct order order = order_table_get(&prev, i);
+    order.order_id = 1 + i;
+    order_table_push(&cur, &order);
+  }
+
+  struct order_delta delta = {0};
+  assert(order_delta_compute(&delta, &prev, &cur) == E_OK);
+  assert(delta.added.len == 4);
+  assert(delta.removed.len == 11);
+  assert(delta.changed.len == 10);
+
+  struct order_table rebuilt = {0};
+  assert(order_delta_apply(&rebuilt, &prev, &delta) == E_OK);
+  assert(rebuilt.len == cur.len);
+  struct uint64_size_map index = {0};
+  for (size_t i = 0; i < cur.len; ++i) uint64_size_map_put(&index, cur.order_id[i], i);
+  for (size_t i = 0; i < rebuilt.len; ++i) {
+    size_t j;
+    assert(uint64_size_map_get(&index, rebuilt.order_id[i], &j) == E_OK);
+    struct order a = order_table_get(&rebuilt, i);
+    struct order b = order_table_get(&cur, j);
+    assert(test_order_is_equal(&a, &b));
+  }
+  assert(uint64_size_map_get(&index, 123456, NULL) == E_NOT_FOUND);
+
+  // nothing changed
+  order_delta_destroy(&delta);
+  delta = (struct order_delta) {0};
+  assert(order_delta_compute(&delta, &cur, &cur) == E_OK);
+  assert(delta.added.len == 0 && delta.removed.len == 0 && delta.changed.len == 0);
+
+  // region by region, only the changed regions keep their previous orders
+  uint64_t region_ids[] = { 10000002, 10000043 };
+  struct order_region *regions;
+  assert(order_region_create_all(&regions, region_ids, 2) == E_OK);
+  assert(order_table_push_slice(&regions[0].snapshot, &prev, 0, prev.len) == E_OK);
+  assert(order_table_push_slice(&regions[0].table, &cur, 0, cur.len) == E_OK);
+  regions[0].changed = true;
+  assert(order_table_push_slice(&regions[1].table, &cur, 0, cur.len) == E_OK);
+  order_delta_destroy(&delta);
+  delta = (struct order_delta) {0};
+  assert(order_region_delta_compute(&delta, regions, 2) == E_OK);
+  assert(delta.added.len == 4 && delta.removed.len == 11 && delta.changed.len == 10);
+  order_region_snapshot(regions, 2);
+  assert(!regions[0].changed && regions[0].snapshot.len == 0);
+  order_delta_destroy(&delta);
+  delta = (struct order_delta) {0};
+  assert(order_region_delta_compute(&delta, regions, 2) == E_OK);
+  assert(delta.added.len == 0 && delta.removed.len == 0 && delta.changed.len == 0);
+  order_region_destroy_all(regions, 2);
+
+  uint64_size_map_destroy(&index);
+  order_delta_destroy(&delta);
+  order_table_destroy(&rebuilt);
+  order_table_destroy(&cur);
+  order_table_destroy(&prev);
+  string_destroy(&page);
+}
+
+void test_order_table_dump(void) {
+  struct string page = test_order_page_build(1000);
+  struct order_table table = {0};
+  assert(order_parse_page(&table, page, 10000002) == E_OK);
+  struct order odd = order_table_get(&table, 0);
+  odd.order_id = 1;
+  odd.price = 0.1 + 0.2;  // not a whole number of cents
+  odd.duration = 42;
+  odd.region_id = 10000043;
+  assert(order_table_push(&table, &odd) == E_OK);
+
+  struct string path = string_new("/tmp/emd_test_orders.dump");
+  struct dump dump;
+  assert(dump_open_write(&dump, path, DUMP_TYPE_ORDERS, 0) == E_OK);
+  assert(dump_write_order_table(&dump, &table) == E_OK);
+  long size = ftell(dump.file) - 46;
+  assert(dump_close_write(&dump) == E_OK);
+  printf("%zu orders: %.1f bytes per order\n", table.len, (double) size / table.len);
+
+  struct order_table read = {0};
+  assert(dump_open_read(&dump, path) == E_OK);
+  assert(dump.version == DUMP_VERSION);
+  assert(dump_read_order_table(&dump, &read) == E_OK);
+  assert(dump_close_read(&dump) == E_OK);
+
+  // the orders are sorted by market in the dump
+  assert(read.len == table.len);
+  struct uint64_size_map index = {0};
+  for (size_t i = 0; i < read.len; ++i) uint64_size_map_put(&index, read.order_id[i], i);
+  for (size_t i = 0; i < table.len; ++i) {
+    size_t j;
+    assert(uint64_size_map_get(&index, table.order_id[i], &j) == E_OK);
+    struct order a = order_table_get(&table, i);
+    struct order b = order_table_get(&read, j);
+    assert(test_order_is_equal(&a, &b));
+  }
+  assert(read.region_id[read.len - 1] == 10000043);
+
+  // a view over the table split in two is written as the table itself
+  struct order_table halves[2] = {0};
+  assert(order_table_push_slice(&halves[0], &table, 0, table.len / 2) == E_OK);
+  assert(order_table_push_slice(&halves[1], &table, table.len / 2,
+                                table.len - table.len / 2) == E_OK);
+  const struct order_table *tables[] = { &halves[1], &halves[0] };
+  struct order_view view = { .tables = tables, .len = 2 };
+  assert(order_view_len(&view) == table.len);
+  assert(dump_open_write(&dump, path, DUMP_TYPE_ORDERS, 0) == E_OK);
+  assert(dump_write_order_view(&dump, &view) == E_OK);
+  assert(ftell(dump.file) - 46 == size);
+  assert(dump_close_write(&dump) == E_OK);
+  struct order_table read_view = {0};
+  assert(dump_open_read(&dump, path) == E_OK);
+  assert(dump_read_order_table(&dump, &read_view) == E_OK);
+  assert(dump_close_read(&dump) == E_OK);
+  assert(read_view.len == read.len);
+  for (size_t i = 0; i < read.len; ++i) {
+    struct order a = order_table_get(&read, i);
+    struct order b = order_table_get(&read_view, i);
+    assert(test_order_is_equal(&a, &b));
+  }
+
+  uint64_size_map_destroy(&index);
+  order_table_destroy(&read_view);
+  order_table_destroy(&halves[0]);
+  order_table_destroy(&halves[1]);
+  order_table_destroy(&read);
+  order_table_destroy(&table);
+  string_destroy(&page);
+}
+
+void test_market_summary(void) {
+  struct order_table table = {0};
+  struct order order = {
+    .region_id = 10000002, .type_id = 34, .location_id = 60003760, .system_id = 30000142,
+    .duration = 90, .range = -1,
+  };
+  double buy_prices[] = { 5.0, 4.9, 4.0 };
+  double sell_prices[] = { 6.0, 6.25, 7.0 };
+  for (size_t i = 0; i < 3; ++i) {
+    order.order_id = 1 + i;
+    order.is_buy_order = true;
+    order.price = buy_prices[i];
+    order.volume_remain = order.volume_total = 100;
+    assert(order_table_push(&table, &order) == E_OK);
+    order.order_id = 10 + i;
+    order.is_buy_order = false;
+    order.price = sell_prices[i];
+    order.volume_remain = order.volume_total = 10 * (i + 1);
+    assert(order_table_push(&table, &order) == E_OK);
+  }
+  // another location, sell only
+  order.order_id = 20;
+  order.location_id = 60008494;
+  assert(order_table_push(&table, &order) == E_OK);
+
+  struct market_summary_vec summary_vec = {0};
+  const struct order_table *tables[] = { &table };
+  struct order_view view = { .tables = tables, .len = 1 };
+  assert(market_summary_compute(&summary_vec, &view) == E_OK);
+  assert(summary_vec.len == 2);
+  struct market_summary summary = summary_vec.buf[0];
+  assert(summary.location_id == 60003760);
+  assert(summary.buy.count == 3 && summary.sell.count == 3);
+  assert(summary.buy.best == 5.0 && summary.sell.best == 6.0);
+  assert(summary.buy.volume == 200);
+  assert(summary.sell.volume == 30);
+  assert(summary.buy.average > 4.63 && summary.buy.average < 4.64);
+  assert(summary.sell.average > 6.58 && summary.sell.average < 6.59);
+  assert(summary_vec.buf[1].buy.count == 0 && summary_vec.buf[1].sell.count == 1);
+
+  struct string path = string_new("/tmp/emd_test_summaries.dump");
+  struct dump dump;
+  assert(dump_open_write(&dump, path, DUMP_TYPE_SUMMARIES, 0) == E_OK);
+  assert(dump_write_market_summary_vec(&dump, &summary_vec) == E_OK);
+  assert(dump_close_write(&dump) == E_OK);
+  struct market_summary_vec read = {0};
+  assert(dump_open_read(&dump, path) == E_OK);
+  assert(dump_read_market_summary_vec(&dump, &read) == E_OK);
+  assert(dump_close_read(&dump) == E_OK);
+  assert(read.len == 2);
+  for (size_t i = 0; i < 2; ++i) {
+    struct market_summary a = summary_vec.buf[i], b = read.buf[i];
+    assert(a.region_id == b.region_id && a.type_id == b.type_id &&
+           a.location_id == b.location_id);
+    assert(a.buy.count == b.buy.count && a.buy.best == b.buy.best &&
+           a.buy.volume == b.buy.volume && a.buy.average == b.buy.average);
+    assert(a.sell.count == b.sell.count && a.sell.best == b.sell.best &&
+           a.sell.volume == b.sell.volume && a.sell.average == b.sell.average);
+  }
+
+  market_summary_vec_destroy(&read);
+  market_summary_vec_destroy(&summary_vec);
+  order_table_destroy(&table);
+}
+
+void test_history_spill(void) {
+  struct history_spill spill;
+  history_spill_init(&spill, string_new("/tmp/emd_test_spill"), 3, 8);
+
+  // 4 days interleaved, the first day spills on its own, the others when the
+  // total cap is reached
+  struct history_bit_vec bit_vec = {0};
+  struct date first_day = { .year = 2024, .day = 365 };
+  for (uint64_t i = 0; i < 20; ++i) {
+    struct date date = first_day;
+    for (uint64_t d = 0; d < (i < 12 ? i % 4 : 0); ++d) date_incr(&date);
+    struct history_bit bit = {
+      .date = date,
+      .market = { .region_id = 10000002, .type_id = i },
+      .stats = { .volume = i },
+    };
+    assert(history_bit_vec_push(&bit_vec, bit) == E_OK);
+  }
+  assert(history_spill_push_vec(&spill, &bit_vec) == E_OK);
+  assert(spill.buckets.len == 4);
+  assert(dump_does_exist(string_new("/tmp/emd_test_spill-2024-365")));
+  assert(dump_does_exist(string_new("/tmp/emd_test_spill-2025-1")));
+
+  size_t expected_len[] = { 11, 3, 3, 3 };
+  struct date date = first_day;
+  for (size_t d = 0; d < 4; ++d) {
+    bit_vec.len = 0;
+    assert(history_spill_read_day(&spill, date, &bit_vec) == E_OK);
+    assert(bit_vec.len == expected_len[d]);
+    uint64_t prev = 0;
+    for (size_t i = 0; i < bit_vec.len; ++i) {
+      assert(date_is_equal(bit_vec.buf[i].date, date));
+      assert(bit_vec.buf[i].stats.volume == bit_vec.buf[i].market.type_id);
+      assert(i == 0 || bit_vec.buf[i].market.type_id > prev);
+      prev = bit_vec.buf[i].market.type_id;
+    }
+    date_incr(&date);
+  }
+  assert(spill.total_len == 0);
+  assert(!dump_does_exist(string_new("/tmp/emd_test_spill-2024-365")));
+  assert(!dump_does_exist(string_new("/tmp/emd_test_spill-2025-1")));
+
+  // a day without bits
+  bit_vec.len = 0;
+  assert(history_spill_read_day(&spill, date, &bit_vec) == E_OK);
+  assert(bit_vec.len == 0);
+
+  history_spill_destroy(&spill);
+  history_bit_vec_destroy(&bit_vec);
+}
+
+void test_order_stream(void) {
+  struct string page = test_order_page_build(1000);
+
+  struct order_table dom_table = {0};
+  assert(order_parse_page(&dom_table, page, 10000002) == E_OK);
+  assert(dom_table.len == 1000);
+
+  // feed the body in small chunks to cross every token boundary
+  struct order_table stream_table = {0};
+  struct order_stream stream;
+  order_stream_init(&stream, &stream_table, 10000002);
+  for (size_t i = 0; i < page.len; i += 7) {
+    size_t len = page.len - i < 7 ? page.len - i : 7;
+    assert(order_stream_feed(&stream, page.buf + i, len) == E_OK);
+  }
+  assert(order_stream_finish(&stream) == E_OK);
+
+  assert(stream_table.len == dom_table.len);
+  for (size_t i = 0; i < dom_table.len; ++i) {
+    struct order dom_order = order_table_get(&dom_table, i);
+    struct order stream_order = order_table_get(&stream_table, i);
+    assert(test_order_is_equal(&dom_order, &stream_order));
+  }
+
+  // a truncated body must not pass
+  order_stream_init(&stream, &stream_table, 10000002);
+  assert(order_stream_feed(&stream, page.buf, page.len / 2) == E_OK);
+  assert(order_stream_finish(&stream) != E_OK);
+
+  order_table_destroy(&dom_table);
+  order_table_destroy(&stream_table);
+  string_destroy(&page);
+}
+
+double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// distinct locations of a universe sized order table
+void bench_order_fill_location_id_vec(void) {
+  const size_t ORDER_LEN = 1000000;
+  const size_t LOCATION_LEN = 5000;
+  struct order_table table = {0};
+  order_table_create(&table, ORDER_LEN);
+  for (size_t i = 0; i < ORDER_LEN; ++i) {
+    struct order order = { .location_id = 60000000 + (i * 7919) % LOCATION_LEN };
+    order_table_push(&table, &order);
+  }
+
+  struct uint64_vec locid_vec = { .cap = 2048 };
+  const struct order_table *tables[] = { &table };
+  struct order_view view = { .tables = tables, .len = 1 };
+  double start = bench_now();
+  err_t err = order_fill_location_id_vec(&locid_vec, &view);
+  double secs = bench_now() - start;
+  assert(err == E_OK);
+  assert(locid_vec.len == LOCATION_LEN);
+  assert(locid_vec.buf[0] == 60000000);
+  assert(locid_vec.buf[1] == 60000000 + 7919 % LOCATION_LEN);
+
+  printf("%zu orders, %zu locations: %.1fms\n", ORDER_LEN, LOCATION_LEN, secs * 1e3);
+
+  uint64_vec_destroy(&locid_vec);
+  order_table_destroy(&table);
+}
+
+// jansson DOM vs order_stream on a 1000 orders page
+void bench_order_parse_page(void) {
+  const size_t ITERATIONS = 200;
+  struct string page = test_order_page_build(1000);
+  struct order_table table = { .cap = 1000 };
+
+  double start = bench_now();
+  for (size_t i = 0; i < ITERATIONS; ++i) {
+    table.len = 0;
+    assert(order_parse_page(&table, page, 10000002) == E_OK);
+  }
+  double dom_secs = (bench_now() - start) / ITERATIONS;
+
+  start = bench_now();
+  for (size_t i = 0; i < ITERATIONS; ++i) {
+    table.len = 0;
+    struct order_stream stream;
+    order_stream_init(&stream, &table, 10000002);
+    for (size_t j = 0; j < page.len; j += CURL_MAX_WRITE_SIZE) {
+      size_t len = page.len - j < CURL_MAX_WRITE_SIZE ? page.len - j : CURL_MAX_WRITE_SIZE;
+      assert(order_stream_feed(&stream, page.buf + j, len) == E_OK);
+    }
+    assert(order_stream_finish(&stream) == E_OK);
+  }
+  double stream_secs = (bench_now() - start) / ITERATIONS;
+
+  printf("page of %zu bytes: order_parse_page %.3fms, order_stream %.3fms\n",
+         page.len, dom_secs * 1e3, stream_secs * 1e3);
+  order_table_destroy(&table);
+  string_destroy(&page);
+}
+
+void bench_time_parse_iso(void) {
+  const size_t ITERATIONS = 1000000;
+  const char *iso = "2024-11-23T11:15:00Z";
+  time_t sum = 0;
+  double start = bench_now();
+  for (size_t i = 0; i < ITERATIONS; ++i) {
+    time_t time;
+    assert(time_parse("%Y-%m-%dT%H:%M:%SZ", iso, &time) == E_OK);
+    sum += time;
+  }
+  double strptime_secs = bench_now() - start;
+  start = bench_now();
+  for (size_t i = 0; i < ITERATIONS; ++i) {
+    time_t time;
+    assert(time_parse_iso(string_new((char *) iso), &time) == E_OK);
+    sum -= time;
+  }
+  double iso_secs = bench_now() - start;
+  assert(sum == 0);
+  printf("%zu times: time_parse %.1fms, time_parse_iso %.1fms\n", ITERATIONS,
+         strptime_secs * 1e3, iso_secs * 1e3);
+}
+
+// record an order page last modified at `modified` in the corpus
+void test_esi_corpus_record_page_at(uint64_t region_id, size_t page, size_t pages, int code,
+                                    const char *etag, struct string body, time_t modified) {
+  char uri_buf[128];
+  struct string uri = string_fmt(uri_buf, 128, "/markets/%" PRIu64 "/orders?page=%zu",
+                                 region_id, page);
+  struct esi_corpus_key key = { .method = string_new("GET"), .uri = uri };
+  struct esi_response response = {
+    .body = body,
+    .pages = pages,
+    .code = code,
+    .modified = modified,
+    .budget_remain = 100,
+    .budget_reset = 60,
+  };
+  strcpy(response.etag, etag);
+  esi_corpus_record(key, &response);
+}
+
+// record an order page in the corpus
+void test_esi_corpus_record_page(uint64_t region_id, size_t page, size_t pages, int code,
+                                 const char *etag, struct string body) {
+  test_esi_corpus_record_page_at(region_id, page, pages, code, etag, body, 0);
+}
+
+void test_esi_corpus(void) {
+  struct string path = string_new("/tmp/emd_test_esi.corpus");
+  struct string page = test_order_page_build(1000);
+  struct string page2 = test_order_page_build_from(1000, 1000);
+
+  // two cycles of a region of two pages, the first page is not modified on
+  // the second cycle
+  assert(esi_corpus_record_open(path) == E_OK);
+  test_esi_corpus_record_page(10000043, 1, 2, 200, "\"p1\"", page);
+  test_esi_corpus_record_page(10000043, 2, 2, 200, "\"p2\"", page2);
+  test_esi_corpus_record_page(10000043, 1, 2, 304, "\"p1\"", (struct string) {0});
+  test_esi_corpus_record_page(10000043, 2, 2, 200, "\"p2b\"", page2);
+  esi_corpus_close();
+
+  assert(esi_corpus_replay_load(path, 0, 0) == E_OK);
+  assert(esi_corpus.len == 4);
+  uint64_t regions[] = { 10000043 };
+  struct order_table table = {0};
+  assert(order_download_universe(&table, regions, 1, 4) == E_OK);
+  assert(table.len == 2000);
+  assert(order_download_universe(&table, regions, 1, 4) == E_OK);
+  assert(table.len == 2000);
+
+  struct esi_response response;
+  assert(esi_fetch(&response, string_new("GET"), string_new("/status"),
+                   (struct string) {0}, false, 1) == E_ESI_ERR);
+  esi_corpus_close();
+
+  // every request gets an injected error
+  assert(esi_corpus_replay_load(path, 0, 1) == E_OK);
+  struct esi_corpus_key key = {
+    .method = string_new("GET"),
+    .uri = string_new("/markets/10000043/orders?page=1"),
+  };
+  assert(esi_corpus_replay(key, &response) == E_OK);
+  assert(response.code == 420 || response.code == 429 || response.code == 504);
+  esi_response_destroy(&response);
+  esi_corpus_close();
+  order_table_destroy(&table);
+  string_destroy(&page);
+  string_destroy(&page2);
+}
+
+void test_order_region_listener_count(const struct order_region *region, time_t now, void *data) {
+  (void) now;
+  assert(region->region_id == 10000061);
+  *(size_t *) data += 1;
+}
+
+// a region with a missing page is retried on its own, the other regions are
+// still swapped in
+void test_order_download_region_retry(void) {
+  struct string path = string_new("/tmp/emd_test_retry.corpus");
+  struct string page = test_order_page_build(1000);
+  struct string page2 = test_order_page_build_from(1000, 1000);
+
+  assert(esi_corpus_record_open(path) == E_OK);
+  test_esi_corpus_record_page(10000061, 1, 2, 200, "", page);
+  test_esi_corpus_record_page(10000061, 2, 2, 200, "", page2);
+  test_esi_corpus_record_page(10000062, 1, 3, 200, "", page);
+  test_esi_corpus_record_page(10000062, 2, 3, 200, "", page2);
+  esi_corpus_close();
+  assert(esi_corpus_replay_load(path, 0, 0) == E_OK);
+
+  uint64_t region_ids[] = { 10000061, 10000062 };
+  struct order_region *regions;
+  assert(order_region_create_all(&regions, region_ids, 2) == E_OK);
+  size_t updated = 0;
+  struct order_region_listener listener = {
+    .updated = test_order_region_listener_count,
+    .data = &updated,
+  };
+  time_t now = time(NULL);
+  assert(order_download_regions(regions, 2, now, 4, &listener) == E_OK);
+  assert(updated == 1);
+  assert(regions[0].table.len == 2000);
+  assert(regions[0].markets.len > 0);
+  assert(regions[0].expires >= now + ORDER_REFRESH_MIN);
+  assert(regions[1].table.len == 0);
+  assert(regions[1].expires == now + ORDER_REGION_RETRY);
+  assert(!order_region_is_due(&regions[1], now));
+  assert(order_region_is_due(&regions[1], now + ORDER_REGION_RETRY + 1));
+
+  esi_corpus_close();
+  order_region_destroy_all(regions, 2);
+  string_destroy(&page);
+  string_destroy(&page2);
+}
+
+// esi rebuilds the region between its first and second page, the first page
+// is fetched again and the orders shifted to the second page are dropped
+void test_order_download_shifted_pages(void) {
+  struct string path = string_new("/tmp/emd_test_shifted.corpus");
+  struct string old_page = test_order_page_build(10);
+  struct string new_page = test_order_page_build(30);
+  struct string shifted_page = test_order_page_build(20);
+  assert(esi_corpus_record_open(path) == E_OK);
+  test_esi_corpus_record_page_at(10000064, 1, 2, 200, "", old_page, 1000);
+  test_esi_corpus_record_page_at(10000064, 1, 2, 200, "", new_page, 2000);
+  test_esi_corpus_record_page_at(10000064, 2, 2, 200, "", shifted_page, 2000);
+  esi_corpus_close();
+  assert(esi_corpus_replay_load(path, 0, 0) == E_OK);
+
+  uint64_t region_ids[] = { 10000064 };
+  struct order_region *regions;
+  assert(order_region_create_all(&regions, region_ids, 1) == E_OK);
+  assert(order_download_regions(regions, 1, time(NULL), 4, NULL) == E_OK);
+  assert(regions[0].modified == 2000);
+  assert(regions[0].table.len == 30);
+  for (size_t i = 0; i < 30; ++i) {
+    assert(regions[0].table.order_id[i] == 6900000000 + i * 13);
+  }
+
+  // order_table_dedup keeps the first of each order_id
+  struct order_table table = {0};
+  assert(order_table_push_slice(&table, &regions[0].table, 0, 30) == E_OK);
+  assert(order_table_push_slice(&table, &regions[0].table, 5, 10) == E_OK);
+  assert(order_table_push_slice(&table, &regions[0].table, 0, 30) == E_OK);
+  size_t dropped;
+  assert(order_table_dedup(&table, &dropped) == E_OK);
+  assert(dropped == 40 && table.len == 30);
+  assert(table.order_id[29] == regions[0].table.order_id[29]);
+
+  // a region out of refetches is counted as inconsistent once and its
+  // refetches are left as they are
+  struct order_page_vec queue = {0};
+  struct order_download_stats stats = {0};
+  struct order_region_download dl = {
+    .modified = 2000,
+    .refetches = ORDER_REGION_REFETCH_MAX,
+  };
+  struct order_page page = { .region_idx = 0, .page = 2 };
+  assert(order_region_check_page(&queue, &regions[0], &dl, page, 1000, &stats) == E_OK);
+  assert(order_region_check_page(&queue, &regions[0], &dl, page, 1000, &stats) == E_OK);
+  assert(dl.inconsistent);
+  assert(dl.refetches == ORDER_REGION_REFETCH_MAX);
+  assert(stats.inconsistent == 1);
+  assert(stats.refetched == 0);
+  assert(queue.len == 0);
+
+  esi_corpus_close();
+  order_table_destroy(&table);
+  order_region_destroy_all(regions, 1);
+  string_destroy(&old_page);
+  string_destroy(&new_page);
+  string_destroy(&shifted_page);
+}
+
+// a region sent to the region dumps hoardling is dumped and handed back
+void test_hoardling_region_dumps(void) {
+  uint64_t region_ids[] = { 10000002 };
+  struct order_region *regions;
+  assert(order_region_create_all(&regions, region_ids, 1) == E_OK);
+  struct string page = test_order_page_build(10);
+  assert(order_parse_page(&regions[0].table, page, 10000002) == E_OK);
+
+  // NOTE: static, the hoardling is left waiting on them once the test is done
+  static struct ptr_fifo chan_orders_to_region_dumps;
+  static struct ptr_fifo chan_region_dumps_to_orders;
+  assert(ptr_fifo_init(&chan_orders_to_region_dumps, 4) == E_OK);
+  assert(ptr_fifo_init(&chan_region_dumps_to_orders, 4) == E_OK);
+  struct hoardling_region_dumps_args args = {
+    .dump_dir = string_new("/tmp"),
+    .chan_orders_to_region_dumps = &chan_orders_to_region_dumps,
+    .chan_region_dumps_to_orders = &chan_region_dumps_to_orders,
+  };
+  pthread_t thread;
+  assert(pthread_create(&thread, NULL, hoardling_region_dumps, &args) == 0);
+  assert(pthread_detach(thread) == 0);
+
+  struct hoardling_region_dumps_state state = {
+    .chan_orders_to_region_dumps = &chan_orders_to_region_dumps,
+    .chan_region_dumps_to_orders = &chan_region_dumps_to_orders,
+  };
+  hoardling_orders_send_region(&regions[0], 1234, &state);
+  assert(state.pending == 1);
+  assert(hoardling_orders_wait_region_dumps(&state) == E_OK);
+  assert(state.pending == 0);
+
+  struct string path = string_new("/tmp/orders-region-10000002-1234.dump");
+  struct order_table read = {0};
+  struct dump dump;
+  assert(dump_open_read(&dump, path) == E_OK);
+  assert(dump_read_order_table(&dump, &read) == E_OK);
+  assert(dump_close_read(&dump) == E_OK);
+  assert(read.len == 10);
+  remove("/tmp/orders-region-10000002-1234.dump");
+
+  order_table_destroy(&read);
+  order_region_destroy_all(regions, 1);
+  string_destroy(&page);
+}
+
+// pages parsed out of order are still merged in page order
+void test_order_download_page_order(void) {
+  struct string path = string_new("/tmp/emd_test_page_order.corpus");
+  struct string pages[3] = {
+    test_order_page_build(3000),
+    test_order_page_build_from(3000, 20),
+    test_order_page_build_from(3020, 1),
+  };
+  assert(esi_corpus_record_open(path) == E_OK);
+  for (size_t p = 1; p <= 3; ++p) {
+    test_esi_corpus_record_page(10000063, p, 3, 200, "", pages[p - 1]);
+  }
+  esi_corpus_close();
+  assert(esi_corpus_replay_load(path, 0, 0) == E_OK);
+
+  uint64_t regions[] = { 10000063 };
+  struct order_table table = {0};
+  assert(order_download_universe(&table, regions, 1, 4) == E_OK);
+  assert(table.len == 3021);
+  for (size_t i = 0; i < table.len; ++i) {
+    assert(table.order_id[i] == 6900000000 + i * 13);
+  }
+
+  esi_corpus_close();
+  order_table_destroy(&table);
+  for (size_t p = 0; p < 3; ++p) string_destroy(&pages[p]);
+}
+
+// record the history of a market in the corpus
+void test_esi_corpus_record_history(uint64_t region_id, uint64_t type_id, int code,
+                                    const char *body) {
+  char uri_buf[128];
+  struct string uri = string_fmt(uri_buf, 128, "/markets/%" PRIu64 "/history?type_id=%" PRIu64,
+                                 region_id, type_id);
+  struct esi_corpus_key key = { .method = string_new("GET"), .uri = uri };
+  struct esi_response response = {
+    .body = string_new((char *) body),
+    .code = code,
+    .budget_remain = 100,
+    .budget_reset = 60,
+  };
+  esi_corpus_record(key, &response);
+}
+
+const char *TEST_HISTORY_BODY =
+  "[{\"average\":5.25,\"date\":\"2024-01-01\",\"highest\":5.5,\"lowest\":5.0,"
+  "\"order_count\":10,\"volume\":100},"
+  "{\"average\":5.5,\"date\":\"2024-01-02\",\"highest\":6.0,\"lowest\":5.0,"
+  "\"order_count\":12,\"volume\":120}]";
+
+err_t test_history_listener_count(struct history_market market,
+                                  const struct history_bit_vec *bit_vec, void *data) {
+  assert(market.region_id == 10000002);
+  assert(market.type_id == 34 || market.type_id == 37);
+  assert(bit_vec->len == 2);
+  assert(bit_vec->buf[1].stats.volume == 120);
+  *(size_t *) data += 1;
+  return E_OK;
+}
+
+void test_history_parse_day(void) {
+  struct history_market market = { .region_id = 10000002, .type_id = 34 };
+  struct string body = string_new((char *) TEST_HISTORY_BODY);
+  struct history_bit_vec bit_vec = {0};
+
+  struct history_bit_vec all = {0};
+  assert(history_parse(&all, body, market) == E_OK);
+  assert(all.len == 2);
+
+  // the last day, the day before and days out of the history
+  assert(history_parse_day(&bit_vec, body, market, all.buf[1].date) == E_OK);
+  assert(bit_vec.len == 1);
+  assert(date_is_equal(bit_vec.buf[0].date, all.buf[1].date));
+  assert(bit_vec.buf[0].stats.volume == 120);
+  assert(history_parse_day(&bit_vec, body, market, all.buf[0].date) == E_OK);
+  assert(bit_vec.len == 2);
+  assert(bit_vec.buf[1].stats.volume == 100);
+  struct date after = all.buf[1].date;
+  date_incr(&after);
+  assert(history_parse_day(&bit_vec, body, market, after) == E_OK);
+  struct date before = { .year = 2023, .day = 200 };
+  assert(history_parse_day(&bit_vec, body, market, before) == E_OK);
+  assert(bit_vec.len == 2);
+
+  assert(history_parse_day(&bit_vec, string_new("{}"), market, after) == E_ERR);
+  assert(history_parse_day(&bit_vec, string_new("[]"), market, after) == E_OK);
+  assert(bit_vec.len == 2);
+
+  history_bit_vec_destroy(&bit_vec);
+  history_bit_vec_destroy(&all);
+}
+
+// the days `first`..`first`+len of a market, with prices drifting a bit
+void test_history_series_build(struct history_bit_vec *bit_vec, struct history_market market,
+                               struct date first, size_t len) {
+  struct date date = first;
+  for (size_t i = 0; i < len; ++i) {
+    double average = 1000 + (double) ((i * 7919 + market.type_id) % 50) / 100;
+    struct history_bit bit = {
+      .date = date,
+      .market = market,
+      .stats = {
+        .average = average,
+        .highest = average + 0.25,
+        .lowest = i % 3 == 0 ? average : average - 1.5,
+        .order_count = 100 + i,
+        .volume = 10000 * (i % 5),
+      },
+    };
+    assert(history_bit_vec_push(bit_vec, bit) == E_OK);
+    date_incr(&date);
+  }
+}
+
+bool test_history_bit_is_equal(struct history_bit a, struct history_bit b) {
+  return date_is_equal(a.date, b.date) && a.market.region_id == b.market.region_id &&
+         a.market.type_id == b.market.type_id && a.stats.average == b.stats.average &&
+         a.stats.highest == b.stats.highest && a.stats.lowest == b.stats.lowest &&
+         a.stats.order_count == b.stats.order_count && a.stats.volume == b.stats.volume;
+}
+
+void test_history_store(void) {
+  struct string dump_dir = string_new("/tmp/emd_test_store");
+  mkdir(dump_dir.buf, 0755);
+  remove("/tmp/emd_test_store/history-store.index");
+  remove("/tmp/emd_test_store/history-store-0.data");
+  remove("/tmp/emd_test_store/history-store-1.data");
+
+  // floats survive their xor encoding
+  double values[] = { 0, 1000.25, 1000.25, -3.5, 1e-300, 123456789.125, 0.1, 0 };
+  char *buf = NULL;
+  size_t buf_len = 0;
+  struct dump dump;
+  assert(dump_open_memory_write(&dump, &buf, &buf_len) == E_OK);
+  uint64_t prev = 0;
+  for (size_t i = 0; i < 8; ++i) assert(dump_write_xor_float64(&dump, values[i], &prev) == E_OK);
+  assert(dump_close_memory(&dump) == E_OK);
+  assert(dump_open_memory_read(&dump, buf, buf_len) == E_OK);
+  prev = 0;
+  for (size_t i = 0; i < 8; ++i) {
+    double x;
+    assert(dump_read_xor_float64(&dump, &x, &prev) == E_OK);
+    assert(x == values[i]);
+  }
+  assert(dump_close_memory(&dump) == E_OK);
+  free(buf);
+
+  struct history_store store;
+  assert(history_store_open(&store, dump_dir) == E_OK);
+  assert(store.len == 0);
+
+  // backfill of two markets, crossing a year
+  struct history_market a = { .region_id = 10000002, .type_id = 34 };
+  struct history_market b = { .region_id = 10000002, .type_id = 35 };
+  struct date first = { .year = 2024, .day = 360 };
+  struct history_bit_vec all = {0};
+  struct history_bit_vec bit_vec = {0};
+  test_history_series_build(&all, a, first, 12);
+  test_history_series_build(&bit_vec, b, first, 12);
+  assert(history_store_append(&store, &bit_vec) == E_OK);
+  assert(history_store_append(&store, &all) == E_OK);
+  assert(store.len == 0);  // not committed yet
+  assert(history_store_commit(&store) == E_OK);
+  assert(store.len == 2 && store.markets == 2);
+  assert(store.entries[0].len == 12);
+  assert(store.entries[0].size < 12 * sizeof(struct history_bit) / 2);
+
+  // daily appends, days already stored are dropped
+  struct date day = all.buf[11].date;
+  for (size_t d = 0; d < 3; ++d) {
+    date_incr(&day);
+    bit_vec.len = 0;
+    test_history_series_build(&bit_vec, a, day, 1);
+    test_history_series_build(&bit_vec, b, day, 1);
+    bit_vec.buf[0].stats.volume = 42 + d;
+    assert(history_bit_vec_push(&bit_vec, all.buf[3]) == E_OK);
+    assert(history_store_append(&store, &bit_vec) == E_OK);
+    assert(history_store_commit(&store) == E_OK);
+    assert(history_bit_vec_push(&all, bit_vec.buf[0]) == E_OK);
+  }
+  assert(store.len == 8 && store.markets == 2);
+
+  // a range over several blocks, before and after reopening the store
+  for (size_t reopen = 0; reopen < 2; ++reopen) {
+    bit_vec.len = 0;
+    assert(history_store_read(&store, a, all.buf[10].date, all.buf[13].date, &bit_vec) == E_OK);
+    assert(bit_vec.len == 4);
+    for (size_t i = 0; i < 4; ++i) assert(test_history_bit_is_equal(bit_vec.buf[i], all.buf[10 + i]));
+    history_store_close(&store);
+    assert(history_store_open(&store, dump_dir) == E_OK);
+    assert(store.len == 8);
+  }
+
+  // a single block per market once compacted
+  assert(history_store_needs_compaction(&store) == false);
+  assert(history_store_compact(&store) == E_OK);
+  assert(store.len == 2 && store.generation == 1);
+  assert(store.entries[0].len == 15);
+  assert(!dump_does_exist(string_new("/tmp/emd_test_store/history-store-0.data")));
+  struct date last = { .year = UINT16_MAX };
+  bit_vec.len = 0;
+  assert(history_store_read(&store, a, first, last, &bit_vec) == E_OK);
+  assert(bit_vec.len == all.len);
+  for (size_t i = 0; i < all.len; ++i) assert(test_history_bit_is_equal(bit_vec.buf[i], all.buf[i]));
+  bit_vec.len = 0;
+  struct history_market c = { .region_id = 10000002, .type_id = 36 };
+  assert(history_store_read(&store, c, first, last, &bit_vec) == E_OK);
+  assert(bit_vec.len == 0);
+
+  history_store_close(&store);
+  history_bit_vec_destroy(&all);
+  history_bit_vec_destroy(&bit_vec);
+}
+
+// a market without history is skipped, a market that failed once is retried
+// and a market that always fails is given up on, without stopping the others
+void test_history_download_markets(void) {
+  struct string path = string_new("/tmp/emd_test_history.corpus");
+  assert(esi_corpus_record_open(path) == E_OK);
+  test_esi_corpus_record_history(10000002, 34, 200, TEST_HISTORY_BODY);
+  test_esi_corpus_record_history(10000002, 35, 404, "{\"error\":\"Type not found!\"}");
+  test_esi_corpus_record_history(10000002, 37, 502, "{\"error\":\"bad gateway\"}");
+  test_esi_corpus_record_history(10000002, 37, 200, TEST_HISTORY_BODY);
+  esi_corpus_close();
+  assert(esi_corpus_replay_load(path, 0, 0) == E_OK);
+
+  struct history_market markets[] = {
+    { .region_id = 10000002, .type_id = 34 },
+    { .region_id = 10000002, .type_id = 35 },
+    { .region_id = 10000002, .type_id = 36 },  // not in the corpus
+    { .region_id = 10000002, .type_id = 37 },
+  };
+  size_t downloaded = 0;
+  struct history_listener listener = {
+    .downloaded = test_history_listener_count,
+    .data = &downloaded,
+  };
+  struct history_negative_cache negative = {0};
+  assert(history_download_markets(markets, 4, (struct date) {0}, 4, 0.001, 0, &negative, &listener) == E_OK);
+  assert(downloaded == 2);
+
+  // the market without history is not asked again until its entry expires,
+  // the entry survives a save and load
+  time_t now = time(NULL);
+  assert(negative.dirty);
+  assert(history_negative_cache_has(&negative, markets[1], now));
+  assert(!history_negative_cache_has(&negative, markets[1], now + HISTORY_NEGATIVE_TTL + 1));
+  assert(!history_negative_cache_has(&negative, markets[0], now));
+  struct string negative_path = string_new("/tmp/emd_test_history_negative.dump");
+  assert(history_negative_cache_save(&negative, negative_path, now) == E_OK);
+  assert(!negative.dirty);
+  history_negative_cache_destroy(&negative);
+  assert(history_negative_cache_load(&negative, negative_path, now) == E_OK);
+  assert(negative.expires.len == 1);
+  assert(history_negative_cache_has(&negative, markets[1], now));
+  downloaded = 0;
+  assert(history_download_markets(markets + 1, 1, (struct date) {0}, 4, 0.001, 0, &negative, &listener) == E_OK);
+  assert(downloaded == 0);
+  assert(!negative.dirty);
+
+  // an expired entry is dropped on load, a missing dump is an empty cache
+  history_negative_cache_destroy(&negative);
+  assert(history_negative_cache_load(&negative, negative_path,
+                                     now + HISTORY_NEGATIVE_TTL + 1) == E_OK);
+  assert(negative.expires.len == 0);
+  remove("/tmp/emd_test_history_negative.dump");
+  assert(history_negative_cache_load(&negative, negative_path, now) == E_OK);
+  assert(negative.expires.len == 0);
+
+  // a market that has a history again is forgotten
+  assert(history_negative_cache_put(&negative, markets[0], now + 60) == E_OK);
+  assert(history_download_markets(markets, 1, (struct date) {0}, 4, 0.001, 0, &negative, &listener) == E_OK);
+  assert(downloaded == 0);  // still skipped
+  history_negative_cache_forget(&negative, markets[0]);
+  assert(!history_negative_cache_has(&negative, markets[0], now));
+  assert(history_download_markets(markets, 1, (struct date) {0}, 4, 0.001, 0, &negative, &listener) == E_OK);
+  assert(downloaded == 1);
+  history_negative_cache_destroy(&negative);
+
+  // markets held by the governor are sent once it lets them through
+  struct esi_governor init = ESI_GOVERNOR_INIT;
+  esi_governor = init;
+  esi_governor.blocked_until = esi_now() + 0.05;
+  downloaded = 0;
+  assert(history_download_markets(markets, 1, (struct date) {0}, 4, 0.001, 0, NULL, &listener) == E_OK);
+  assert(downloaded == 1);
+  assert(esi_governor_state_get().blocked_secs == 0);
+  esi_governor = init;
+
+  // a market that keeps failing is given up on at the retry horizon instead
+  // of being retried after every delay
+  downloaded = 0;
+  double start = esi_now();
+  assert(history_download_markets(markets + 2, 1, (struct date) {0}, 4, 1, 0.5, NULL, &listener) == E_OK);
+  assert(downloaded == 0);
+  assert(esi_now() - start < 0.5);
+
+  esi_corpus_close();
+}
+
+// a daily dump is only replaced when asked, and is found under the name of
+// the next day too, as builds that counted the days from 1 named it
+void test_hoardling_histories_dump(void) {
+  struct string dump_dir = string_new("/tmp");
+  remove("/tmp/history-day-2024-100.dump");
+  struct history_bit_vec bit_vec = {0};
+  struct date date = { .year = 2024, .day = 100 };
+  assert(hoardling_histories_dump(dump_dir, &bit_vec, date, false) == E_OK);
+  assert(hoardling_histories_dump(dump_dir, &bit_vec, date, false) == E_FULL);
+  assert(hoardling_histories_dump(dump_dir, &bit_vec, date, true) == E_OK);
+
+  assert(hoardling_histories_dump_does_exist(dump_dir, date));
+  assert(hoardling_histories_dump_does_exist(dump_dir, (struct date) { .year = 2024, .day = 99 }));
+  assert(!hoardling_histories_dump_does_exist(dump_dir, (struct date) { .year = 2024, .day = 101 }));
+  remove("/tmp/history-day-2024-100.dump");
+}
+// end-to-end order download replayed from a corpus of 5 regions of 10 pages
+void bench_order_download_replay(void) {
+  struct string path = string_new("/tmp/emd_bench_esi.corpus");
+  struct string pages[10];
+  for (size_t p = 0; p < 10; ++p) pages[p] = test_order_page_build_from(p * 1000, 1000);
+  uint64_t regions[] = { 10000051, 10000052, 10000053, 10000054, 10000055 };
+  size_t regions_len = sizeof(regions) / sizeof(regions[0]);
+
+  assert(esi_corpus_record_open(path) == E_OK);
+  for (size_t i = 0; i < regions_len; ++i) {
+    for (size_t p = 1; p <= 10; ++p) {
+      test_esi_corpus_record_page(regions[i], p, 10, 200, "", pages[p - 1]);
+    }
+  }
+  esi_corpus_close();
+
+  struct order_table table = {0};
+  size_t concurrencies[] = { 1, 16 };
+  for (size_t i = 0; i < 2; ++i) {
+    struct esi_governor init = ESI_GOVERNOR_INIT;
+    esi_governor = init;
+    assert(esi_corpus_replay_load(path, 20, 0) == E_OK);
+    double start = bench_now();
+    assert(order_download_universe(&table, regions, regions_len, concurrencies[i]) == E_OK);
+    double secs = bench_now() - start;
+    assert(table.len == regions_len * 10 * 1000);
+    printf("concurrency %zu, 20ms latency: %.0f pages/s\n", concurrencies[i],
+           regions_len * 10 / secs);
+    esi_corpus_close();
+  }
+
+  struct esi_endpoint_stats stats[ESI_ENDPOINT_LEN];
+  esi_stats_snapshot(stats);
+  printf("orders: %" PRIu64 " requests, %.1fMB, p50 %.0fms\n",
+         stats[ESI_ENDPOINT_ORDERS].requests, stats[ESI_ENDPOINT_ORDERS].bytes / 1e6,
+         esi_histogram_percentile(&stats[ESI_ENDPOINT_ORDERS].latency, 0.5) / 1e3);
+
+  order_table_destroy(&table);
+  for (size_t p = 0; p < 10; ++p) string_destroy(&pages[p]);
 }
 
 int main(void) {
@@ -155,12 +1402,64 @@ int main(void) {
 
   printf("---------- test_date_parse ----------\n");
   test_date_parse();
+  printf("---------- test_time_parse_iso ----------\n");
+  test_time_parse_iso();
   printf("---------- test_unsafe_ptr_fifo ----------\n");
   test_unsafe_ptr_fifo();
   printf("---------- test_ptr_fifo ----------\n");
   test_ptr_fifo();
   printf("---------- test_zeroed_vec ----------\n");
   test_zeroed_vec();
+  printf("---------- test_uint64_set ----------\n");
+  test_uint64_set();
+  printf("---------- test_esi_cache ----------\n");
+  test_esi_cache();
+  printf("---------- test_esi_governor ----------\n");
+  test_esi_governor();
+  printf("---------- test_esi_stats ----------\n");
+  test_esi_stats();
+  printf("---------- test_order_region_next_refresh ----------\n");
+  test_order_region_next_refresh();
+  printf("---------- test_active_markets ----------\n");
+  test_active_markets();
+  printf("---------- test_order_table ----------\n");
+  test_order_table();
+  printf("---------- test_order_delta ----------\n");
+  test_order_delta();
+  printf("---------- test_order_table_dump ----------\n");
+  test_order_table_dump();
+  printf("---------- test_market_summary ----------\n");
+  test_market_summary();
+  printf("---------- test_history_spill ----------\n");
+  test_history_spill();
+  printf("---------- test_order_stream ----------\n");
+  test_order_stream();
+  printf("---------- bench_order_fill_location_id_vec ----------\n");
+  bench_order_fill_location_id_vec();
+  printf("---------- bench_order_parse_page ----------\n");
+  bench_order_parse_page();
+  printf("---------- bench_time_parse_iso ----------\n");
+  bench_time_parse_iso();
+  printf("---------- test_esi_corpus ----------\n");
+  test_esi_corpus();
+  printf("---------- test_order_download_region_retry ----------\n");
+  test_order_download_region_retry();
+  printf("---------- test_order_download_page_order ----------\n");
+  test_order_download_page_order();
+  printf("---------- test_order_download_shifted_pages ----------\n");
+  test_order_download_shifted_pages();
+  printf("---------- test_hoardling_region_dumps ----------\n");
+  test_hoardling_region_dumps();
+  printf("---------- test_history_parse_day ----------\n");
+  test_history_parse_day();
+  printf("---------- test_history_store ----------\n");
+  test_history_store();
+  printf("---------- test_history_download_markets ----------\n");
+  test_history_download_markets();
+  printf("---------- test_hoardling_histories_dump ----------\n");
+  test_hoardling_histories_dump();
+  printf("---------- bench_order_download_replay ----------\n");
+  bench_order_download_replay();
   // TODO: remove
   return 0;
 
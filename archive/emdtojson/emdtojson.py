@@ -13,6 +13,20 @@ def unpack_string(file, checksum):
     len, = unpack("!Q", file, checksum)
     return file.read(len).decode("utf-8")
 
+def unpack_varint(file, checksum):
+    n = 0
+    shift = 0
+    while True:
+        byte, = unpack("!B", file, checksum)
+        n |= (byte & 0x7f) << shift
+        if byte & 0x80 == 0:
+            return n
+        shift += 7
+
+def unpack_zigzag(file, checksum):
+    n = unpack_varint(file, checksum)
+    return (n >> 1) ^ -(n & 1)
+
 def unpack_loc_table(file, checksum):
     loc_table = []
     loc_table_len, = unpack("!Q", file, checksum)
@@ -29,7 +43,63 @@ def unpack_loc_table(file, checksum):
         })
     return loc_table
 
+ORDER_RANGES = [-2, -1, 0, 1, 2, 3, 4, 5, 10, 20, 30, 40]
+ORDER_DURATIONS = [1, 3, 7, 14, 30, 90, 365]
+ORDER_DURATION_OTHER = 7
+
+def unpack_order_dict(file, checksum):
+    dict = []
+    for _ in range(unpack_varint(file, checksum)):
+        delta = unpack_varint(file, checksum)
+        dict.append(delta if len(dict) == 0 else dict[-1] + delta)
+    return dict
+
+# see dump_write_order_table in emd/src/orders.c
+def unpack_order_table_v2(file, checksum):
+    order_table = []
+    order_table_len = unpack_varint(file, checksum)
+    locations = unpack_order_dict(file, checksum)
+    systems = unpack_order_dict(file, checksum)
+    region_id = type_id = location = order_id = issued = 0
+    for i in range(order_table_len):
+        prev_region_id, prev_type_id = region_id, type_id
+        region_id += unpack_varint(file, checksum)
+        same_region = i > 0 and region_id == prev_region_id
+        type_id = (prev_type_id if same_region else 0) + unpack_varint(file, checksum)
+        same_market = same_region and type_id == prev_type_id
+        location = (location if same_market else 0) + unpack_varint(file, checksum)
+        system = unpack_varint(file, checksum)
+        order_id += unpack_zigzag(file, checksum)
+        codes, = unpack("!B", file, checksum)
+        if codes >> 5 == ORDER_DURATION_OTHER:
+            duration = unpack_varint(file, checksum)
+        else:
+            duration = ORDER_DURATIONS[codes >> 5]
+        issued += unpack_zigzag(file, checksum)
+        volume_remain = unpack_varint(file, checksum)
+        volume_total = volume_remain + unpack_zigzag(file, checksum)
+        min_volume = unpack_varint(file, checksum)
+        price = unpack_order_price(file, checksum)
+        order_table.append({
+            "is_buy_order": codes & 1,
+            "duration": duration,
+            "range": ORDER_RANGES[(codes >> 1) & 0xf],
+            "issued": issued,
+            "min_volume": min_volume,
+            "volume_remain": volume_remain,
+            "volume_total": volume_total,
+            "location_id": locations[location],
+            "system_id": systems[system],
+            "type_id": type_id,
+            "region_id": region_id,
+            "order_id": order_id,
+            "price": price,
+        })
+    return order_table
+
 def unpack_order_table(file, checksum):
+    if version >= 2:
+        return unpack_order_table_v2(file, checksum)
     order_table = []
     order_table_len, = unpack("!Q", file, checksum)
     for _ in range(order_table_len):
@@ -51,6 +121,58 @@ def unpack_order_table(file, checksum):
         })
     return order_table
 
+def unpack_order_delta(file, checksum):
+    base, = unpack("!Q", file, checksum)
+    added = unpack_order_table(file, checksum)
+    removed_len, = unpack("!Q", file, checksum)
+    removed = [unpack("!Q", file, checksum)[0] for _ in range(removed_len)]
+    changed = []
+    changed_len, = unpack("!Q", file, checksum)
+    for _ in range(changed_len):
+        order_id, issued, volume_remain, price = unpack("!QQQd", file, checksum)
+        changed.append({
+            "order_id": order_id,
+            "issued": issued,
+            "volume_remain": volume_remain,
+            "price": price,
+        })
+    return { "base": base, "added": added, "removed": removed, "changed": changed }
+
+def unpack_order_price(file, checksum):
+    price = unpack_varint(file, checksum)
+    if price == 1:
+        price, = unpack("!d", file, checksum)
+        return price
+    return (price >> 1) / 100
+
+def unpack_market_side(file, checksum):
+    count = unpack_varint(file, checksum)
+    if count == 0:
+        return { "count": 0, "best": 0, "volume": 0, "average": 0 }
+    best = unpack_order_price(file, checksum)
+    volume = unpack_varint(file, checksum)
+    average, = unpack("!d", file, checksum)
+    return { "count": count, "best": best, "volume": volume, "average": average }
+
+def unpack_market_summaries(file, checksum):
+    summaries = []
+    summaries_len = unpack_varint(file, checksum)
+    region_id = type_id = 0
+    for i in range(summaries_len):
+        prev_region_id = region_id
+        region_id += unpack_varint(file, checksum)
+        same_region = i > 0 and region_id == prev_region_id
+        type_id = (type_id if same_region else 0) + unpack_varint(file, checksum)
+        location_id = unpack_varint(file, checksum)
+        summaries.append({
+            "region_id": region_id,
+            "type_id": type_id,
+            "location_id": location_id,
+            "buy": unpack_market_side(file, checksum),
+            "sell": unpack_market_side(file, checksum),
+        })
+    return summaries
+
 def unpack_history_day(file, checksum):
     stats = []
     year, day, len = unpack("!HHQ", file, checksum)
@@ -83,6 +205,10 @@ elif _type == 1:  # orders
     dump_json["data"] = unpack_order_table(sys.stdin.buffer, checksum)
 elif _type == 2:  # histories
     dump_json["data"] = unpack_history_day(sys.stdin.buffer, checksum)
+elif _type == 4:  # orders delta
+    dump_json["data"] = unpack_order_delta(sys.stdin.buffer, checksum)
+elif _type == 5:  # market summaries
+    dump_json["data"] = unpack_market_summaries(sys.stdin.buffer, checksum)
 else:
     print("unknown dump type", file=sys.stderr)
 